@@ -27,15 +27,29 @@
  */
 
 /*- Includes ----------------------------------------------------------------*/
+#define _POSIX_C_SOURCE 200809L // posix_madvise()
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
-#include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include "file_io.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "pixel_convert.h"
 #include "bmp_image.h"
 
 /*- Definitions -------------------------------------------------------------*/
+#define BMP_BUFFER_SIZE    65536 // Converted rows written at once
+#define BMP_MAX_IOV        64
+#define BMP_READ_SIZE      (256 * 1024)
+
+#define BMP_BI_RGB             0
+#define BMP_BI_BITFIELDS       3
+#define BMP_BI_ALPHABITFIELDS  6
 
 /*- Types -------------------------------------------------------------------*/
 typedef struct __attribute__((packed))
@@ -111,85 +125,604 @@ typedef struct __attribute__((packed))
   BMPRGBAImageHeader image;
 } BMPRGBAFileHeader;
 
+typedef struct
+{
+  int      width;
+  int      height;
+  int      bits;
+  bool     bottom_up;
+  bool     bitfields;
+  bool     rgba;
+  bool     direct;
+  size_t   offset;
+  size_t   row_size;
+  uint32_t mask[4];
+  int      shift[4];
+  int      size[4];
+} BMPLayout;
+
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
-void bmp_image_write_rgb(const char *name, int width, int height, uint8_t *data)
+static void bmp_image_rgb_header(BMPRGBFileHeader *header, int width, int height, int bits, uint32_t size)
 {
-  BMPRGBFileHeader header;
-  int size = height * width;
-  uint8_t *abgr;
-  int fd;
+  memset(header, 0, sizeof(BMPRGBFileHeader));
+
+  header->file.bfType           = 0x4d42; // BM
+  header->file.bfSize           = sizeof(BMPRGBFileHeader) + size;
+  header->file.bfOffBits        = sizeof(BMPRGBFileHeader);
+  header->image.biSize          = sizeof(BMPRGBImageHeader);
+  header->image.biWidth         = width;
+  header->image.biHeight        = -height;
+  header->image.biPlanes        = 1;
+  header->image.biBitCount      = bits;
+  header->image.biCompression   = 0; // BI_RGB
+  header->image.biSizeImage     = size;
+  header->image.biXPelsPerMeter = 2835; // 72 DPI
+  header->image.biYPelsPerMeter = 2835; // 72 DPI
+  header->image.biClrUsed       = 0;
+  header->image.biClrImportant  = 0;
+}
+
+//-----------------------------------------------------------------------------
+static void bmp_image_rgba_header(BMPRGBAFileHeader *header, int width, int height, uint32_t size)
+{
+  memset(header, 0, sizeof(BMPRGBAFileHeader));
+
+  header->file.bfType           = 0x4d42; // BM
+  header->file.bfSize           = sizeof(BMPRGBAFileHeader) + size;
+  header->file.bfOffBits        = sizeof(BMPRGBAFileHeader);
+  header->image.biSize          = sizeof(BMPRGBAImageHeader);
+  header->image.biWidth         = width;
+  header->image.biHeight        = -height;
+  header->image.biPlanes        = 1;
+  header->image.biBitCount      = 32;
+  header->image.biCompression   = 3; // BI_BITFIELDS
+  header->image.biSizeImage     = size;
+  header->image.biXPelsPerMeter = 2835; // 72 DPI
+  header->image.biYPelsPerMeter = 2835; // 72 DPI
+  header->image.biClrUsed       = 0;
+  header->image.biClrImportant  = 0;
+  header->image.biRedMask       = 0x000000ff;
+  header->image.biGreenMask     = 0x0000ff00;
+  header->image.biBlueMask      = 0x00ff0000;
+  header->image.biAlphaMask     = 0xff000000;
+  header->image.biCSType        = 0x73524742; // sRGB
+}
+
+//-----------------------------------------------------------------------------
+static bool bmp_image_writev(BMPWriter *writer, struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t size = writev(writer->fd, iov, count);
+
+    if (size < 0 && EINTR == errno)
+      continue;
+
+    if (size <= 0)
+    {
+      writer->error = true;
+      return false;
+    }
+
+    // Partial writes continue from the first vector that is not done
+    while (count > 0 && (size_t)size >= iov->iov_len)
+    {
+      size -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + size;
+      iov->iov_len -= size;
+    }
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+bool bmp_image_write_begin(BMPWriter *writer, const char *name, int width, int height, int format)
+{
+  union
+  {
+    BMPRGBFileHeader  rgb;
+    BMPRGBAFileHeader rgba;
+  } header;
+  struct iovec iov;
+  uint64_t size;
 
-  memset(&header, 0, sizeof(header));
+  // The writer stays in the error state until it is ready, so rows and end
+  // are safe to call after a failed begin
+  memset(writer, 0, sizeof(BMPWriter));
+  writer->fd    = -1;
+  writer->error = true;
 
-  header.file.bfType           = 0x4d42; // BM
-  header.file.bfSize           = sizeof(BMPRGBFileHeader) + size * 3;
-  header.file.bfOffBits        = sizeof(BMPRGBFileHeader);
-  header.image.biSize          = sizeof(BMPRGBImageHeader);
-  header.image.biWidth         = width;
-  header.image.biHeight        = -height;
-  header.image.biPlanes        = 1;
-  header.image.biBitCount      = 24;
-  header.image.biCompression   = 0;
-  header.image.biSizeImage     = 0;
-  header.image.biXPelsPerMeter = 2835; // 72 DPI
-  header.image.biYPelsPerMeter = 2835; // 72 DPI
-  header.image.biClrUsed       = 0;
-  header.image.biClrImportant  = 0;
+  if (width <= 0 || height <= 0 || format < 0 || format >= BMP_IMAGE_FORMAT_COUNT)
+    return false;
 
-  abgr = malloc(size * sizeof(uint32_t));
+  // 24-bit rows are padded to a multiple of 4 bytes
+  writer->width    = width;
+  writer->height   = height;
+  writer->format   = format;
+  writer->row_size = (BMP_IMAGE_FORMAT_BGR == format) ? ((uint64_t)width * 3 + 3) & ~3 : (uint64_t)width * 4;
 
-  for (int i = 0; i < size; i++)
+  size = (uint64_t)writer->row_size * height;
+
+  if (writer->row_size > INT32_MAX || (size + sizeof(header)) > UINT32_MAX)
+    return false;
+
+  // Only RGBA rows are written as is, others are converted
+  if (BMP_IMAGE_FORMAT_RGBA != format)
   {
-    int dst_offset = i * 3;
-    int src_offset = i * sizeof(uint32_t);
+    writer->buf_rows = BMP_BUFFER_SIZE / writer->row_size;
+    writer->buf_rows = (writer->buf_rows < 1) ? 1 : (writer->buf_rows > height) ? height : writer->buf_rows;
+    writer->buf = (uint8_t *)calloc(writer->buf_rows, writer->row_size);
 
-    abgr[dst_offset + 0] = data[src_offset + 3];
-    abgr[dst_offset + 1] = data[src_offset + 2];
-    abgr[dst_offset + 2] = data[src_offset + 1];
+    if (!writer->buf)
+      return false;
   }
 
-  fd = file_io_open_for_write(name);
-  file_io_write(fd, (uint8_t *)&header, sizeof(header));
-  file_io_write(fd, abgr, width * height * 3);
-  file_io_close(fd);
+  writer->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (writer->fd < 0)
+  {
+    bmp_image_write_end(writer);
+    return false;
+  }
+
+  if (BMP_IMAGE_FORMAT_RGBA == format)
+  {
+    bmp_image_rgba_header(&header.rgba, width, height, size);
+    iov.iov_len = sizeof(BMPRGBAFileHeader);
+  }
+  else
+  {
+    bmp_image_rgb_header(&header.rgb, width, height, (BMP_IMAGE_FORMAT_BGR == format) ? 24 : 32, size);
+    iov.iov_len = sizeof(BMPRGBFileHeader);
+  }
+
+  iov.iov_base  = &header;
+  writer->error = false;
+
+  if (!bmp_image_writev(writer, &iov, 1))
+  {
+    bmp_image_write_end(writer);
+    return false;
+  }
 
-  free(abgr);
+  return true;
 }
 
 //-----------------------------------------------------------------------------
-void bmp_image_write_rgba(const char *name, int width, int height, uint8_t *data)
+bool bmp_image_write_rows(BMPWriter *writer, const uint8_t *data, int stride, int rows)
 {
-  BMPRGBAFileHeader header;
-  int size = height * width;
+  struct iovec iov[BMP_MAX_IOV];
+  int count = 0;
+
+  if (writer->error || rows < 0 || rows > (writer->height - writer->row))
+  {
+    writer->error = true;
+    return false;
+  }
+
+  if (BMP_IMAGE_FORMAT_RGBA == writer->format)
+  {
+    // Rows go straight from the source, adjacent rows are merged into one vector
+    for (int i = 0; i < rows; i++)
+    {
+      uint8_t *row = (uint8_t *)&data[(size_t)i * stride];
+
+      if (count > 0 && (uint8_t *)iov[count - 1].iov_base + iov[count - 1].iov_len == row)
+      {
+        iov[count - 1].iov_len += writer->row_size;
+      }
+      else
+      {
+        if (BMP_MAX_IOV == count)
+        {
+          if (!bmp_image_writev(writer, iov, count))
+            return false;
+
+          count = 0;
+        }
+
+        iov[count].iov_base = row;
+        iov[count].iov_len  = writer->row_size;
+        count++;
+      }
+    }
+
+    if (count > 0 && !bmp_image_writev(writer, iov, count))
+      return false;
+  }
+  else
+  {
+    // Converted 24-bit rows keep the zero padding from the allocation
+    for (int i = 0; i < rows; i += count)
+    {
+      count = rows - i;
+      count = (count > writer->buf_rows) ? writer->buf_rows : count;
+
+      for (int j = 0; j < count; j++)
+      {
+        uint8_t *dst = &writer->buf[(size_t)j * writer->row_size];
+        const uint8_t *src = &data[(size_t)(i + j) * stride];
+
+        if (BMP_IMAGE_FORMAT_BGR == writer->format)
+          pixel_convert_rgba_to_bgr(dst, src, writer->width);
+        else
+          pixel_convert_rgba_to_bgra(dst, src, writer->width);
+      }
+
+      iov[0].iov_base = writer->buf;
+      iov[0].iov_len  = (size_t)count * writer->row_size;
+
+      if (!bmp_image_writev(writer, iov, 1))
+        return false;
+    }
+  }
+
+  writer->row += rows;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+bool bmp_image_write_end(BMPWriter *writer)
+{
+  bool res = !writer->error && writer->row == writer->height;
+
+  if (writer->fd >= 0 && close(writer->fd) < 0)
+    res = false;
+
+  free(writer->buf);
+
+  writer->fd  = -1;
+  writer->buf = NULL;
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static bool bmp_image_write(const char *name, int width, int height, uint8_t *data, int format)
+{
+  BMPWriter writer;
+
+  if (!bmp_image_write_begin(&writer, name, width, height, format))
+    return false;
+
+  bmp_image_write_rows(&writer, data, width * 4, height);
+
+  return bmp_image_write_end(&writer);
+}
+
+//-----------------------------------------------------------------------------
+bool bmp_image_write_rgb(const char *name, int width, int height, uint8_t *data)
+{
+  return bmp_image_write(name, width, height, data, BMP_IMAGE_FORMAT_BGR);
+}
+
+//-----------------------------------------------------------------------------
+bool bmp_image_write_bgra(const char *name, int width, int height, uint8_t *data)
+{
+  return bmp_image_write(name, width, height, data, BMP_IMAGE_FORMAT_BGRA);
+}
+
+//-----------------------------------------------------------------------------
+bool bmp_image_write_rgba(const char *name, int width, int height, uint8_t *data)
+{
+  return bmp_image_write(name, width, height, data, BMP_IMAGE_FORMAT_RGBA);
+}
+
+//-----------------------------------------------------------------------------
+static bool bmp_image_parse_masks(BMPLayout *layout, const BMPRGBAImageHeader *image, bool alpha)
+{
+  layout->mask[0] = image->biRedMask;
+  layout->mask[1] = image->biGreenMask;
+  layout->mask[2] = image->biBlueMask;
+  layout->mask[3] = alpha ? image->biAlphaMask : 0;
+
+  for (int c = 0; c < 4; c++)
+  {
+    uint32_t mask = layout->mask[c];
+
+    if (0 == mask)
+      continue;
+
+    layout->shift[c] = __builtin_ctz(mask);
+    layout->size[c]  = __builtin_popcount(mask);
+    mask >>= layout->shift[c];
+
+    // Only contiguous masks are valid
+    if (mask & (mask + 1))
+      return false;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool bmp_image_parse(BMPLayout *layout, const uint8_t *data, size_t size)
+{
+  BMPFileHeader file;
+  BMPRGBAImageHeader image;
+  size_t header_size;
+  int32_t width, height;
+  uint64_t end;
+
+  memset(layout, 0, sizeof(BMPLayout));
+
+  if (size < sizeof(BMPFileHeader) + sizeof(BMPRGBImageHeader))
+    return false;
+
+  // BITFIELDS masks follow a 40 byte header at the same place where V2 and
+  // later headers have them, so they are read from the V5 layout either way
+  header_size = size - sizeof(BMPFileHeader);
+  header_size = (header_size < sizeof(BMPRGBAImageHeader)) ? header_size : sizeof(BMPRGBAImageHeader);
+
+  memcpy(&file, data, sizeof(BMPFileHeader));
+  memset(&image, 0, sizeof(BMPRGBAImageHeader));
+  memcpy(&image, &data[sizeof(BMPFileHeader)], header_size);
+
+  if (0x4d42 != file.bfType || image.biSize < sizeof(BMPRGBImageHeader) || 1 != image.biPlanes)
+    return false;
+
+  if (((uint64_t)sizeof(BMPFileHeader) + image.biSize) > size)
+    return false;
+
+  width  = image.biWidth;
+  height = image.biHeight;
+
+  if (width <= 0 || width > (INT32_MAX / 4) || 0 == height || INT32_MIN == height)
+    return false;
+
+  layout->width     = width;
+  layout->height    = (height < 0) ? -height : height;
+  layout->bottom_up = (height > 0);
+  layout->bits      = image.biBitCount;
+  layout->offset    = file.bfOffBits;
+  layout->row_size  = (((uint64_t)width * layout->bits + 31) / 32) * 4;
+
+  if (BMP_BI_RGB == image.biCompression)
+  {
+    if (24 != layout->bits && 32 != layout->bits)
+      return false;
+  }
+  else if (BMP_BI_BITFIELDS == image.biCompression || BMP_BI_ALPHABITFIELDS == image.biCompression)
+  {
+    bool alpha = (BMP_BI_ALPHABITFIELDS == image.biCompression) ||
+        image.biSize >= offsetof(BMPRGBAImageHeader, biCSType);
+
+    if (32 != layout->bits || header_size < offsetof(BMPRGBAImageHeader, biAlphaMask))
+      return false;
+
+    if (!bmp_image_parse_masks(layout, &image, alpha))
+      return false;
+
+    layout->bitfields = true;
+  }
+  else
+  {
+    return false;
+  }
+
+  end = (uint64_t)layout->row_size * layout->height + layout->offset;
+
+  if (layout->offset < (sizeof(BMPFileHeader) + sizeof(BMPRGBImageHeader)) || end > size)
+    return false;
+
+  if ((uint64_t)width * 4 * layout->height > SIZE_MAX)
+    return false;
+
+  // The layout written by bmp_image_write_rgba() is RGBA already
+  layout->rgba = layout->bitfields &&
+      0x000000ff == layout->mask[0] && 0x0000ff00 == layout->mask[1] &&
+      0x00ff0000 == layout->mask[2] && 0xff000000 == layout->mask[3];
+  layout->direct = layout->rgba && !layout->bottom_up;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void bmp_image_unpack(const BMPLayout *layout, uint8_t *dst, const uint8_t *src)
+{
+  for (int i = 0; i < layout->width; i++)
+  {
+    uint32_t pixel;
+
+    memcpy(&pixel, &src[i * 4], sizeof(uint32_t));
+
+    for (int c = 0; c < 4; c++)
+    {
+      uint32_t value = (pixel & layout->mask[c]) >> layout->shift[c];
+      int size = layout->size[c];
+
+      // Missing alpha is opaque, narrow channels are scaled to the full range
+      if (0 == size)
+        value = (3 == c) ? 0xff : 0;
+      else if (size >= 8)
+        value >>= size - 8;
+      else
+        value = value * 255 / ((1u << size) - 1);
+
+      dst[c] = value;
+    }
+
+    dst += 4;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static bool bmp_image_convert(BMPImage *image, const BMPLayout *layout, const uint8_t *data)
+{
+  image->width  = layout->width;
+  image->height = layout->height;
+  image->stride = layout->width * 4;
+  image->data   = (uint8_t *)malloc((size_t)image->stride * image->height);
+
+  if (!image->data)
+  {
+    memset(image, 0, sizeof(BMPImage));
+    return false;
+  }
+
+  for (int y = 0; y < image->height; y++)
+  {
+    int row = layout->bottom_up ? (image->height - 1 - y) : y;
+    const uint8_t *src = &data[layout->offset + (size_t)row * layout->row_size];
+    uint8_t *dst = &image->data[(size_t)y * image->stride];
+
+    if (24 == layout->bits)
+      pixel_convert_bgr_to_rgba(dst, src, image->width);
+    else if (!layout->bitfields)
+      pixel_convert_rgba_to_bgra(dst, src, image->width);
+    else if (layout->rgba)
+      memcpy(dst, src, image->stride);
+    else
+      bmp_image_unpack(layout, dst, src);
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *bmp_file_read(int fd, size_t *size)
+{
+  size_t capacity = BMP_READ_SIZE;
+  uint8_t *data = malloc(capacity);
+  ssize_t len;
+
+  *size = 0;
+
+  while (data)
+  {
+    if (*size == capacity)
+    {
+      uint8_t *ptr = realloc(data, capacity * 2);
+
+      if (!ptr)
+        break;
+
+      data = ptr;
+      capacity *= 2;
+    }
+
+    len = read(fd, &data[*size], capacity - *size);
+
+    if (0 == len)
+      return data;
+
+    if (len < 0 && EINTR == errno)
+      continue;
+
+    if (len < 0)
+      break;
+
+    *size += len;
+  }
+
+  free(data);
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+bool bmp_image_read(BMPImage *image, const uint8_t *data, size_t size)
+{
+  BMPLayout layout;
+
+  memset(image, 0, sizeof(BMPImage));
+
+  if (!bmp_image_parse(&layout, data, size))
+    return false;
+
+  return bmp_image_convert(image, &layout, data);
+}
+
+//-----------------------------------------------------------------------------
+bool bmp_image_map(BMPImage *image, const char *name)
+{
+  struct stat stat;
+  BMPLayout layout;
+  uint8_t *data = MAP_FAILED;
+  size_t size = 0;
+  bool res;
   int fd;
 
-  memset(&header, 0, sizeof(header));
-
-  header.file.bfType           = 0x4d42; // BM
-  header.file.bfSize           = sizeof(BMPRGBAFileHeader) + size * sizeof(uint32_t);
-  header.file.bfOffBits        = sizeof(BMPRGBAFileHeader);
-  header.image.biSize          = sizeof(BMPRGBAImageHeader);
-  header.image.biWidth         = width;
-  header.image.biHeight        = -height;
-  header.image.biPlanes        = 1;
-  header.image.biBitCount      = 32;
-  header.image.biCompression   = 3; // BI_BITFIELDS
-  header.image.biSizeImage     = 0;
-  header.image.biXPelsPerMeter = 2835; // 72 DPI
-  header.image.biYPelsPerMeter = 2835; // 72 DPI
-  header.image.biClrUsed       = 0;
-  header.image.biClrImportant  = 0;
-  header.image.biRedMask       = 0x000000ff;
-  header.image.biGreenMask     = 0x0000ff00;
-  header.image.biBlueMask      = 0x00ff0000;
-  header.image.biAlphaMask     = 0xff000000;
-  header.image.biCSType        = 0x73524742; // sRGB
-
-  fd = file_io_open_for_write(name);
-  file_io_write(fd, (uint8_t *)&header, sizeof(header));
-  file_io_write(fd, data, size * sizeof(uint32_t));
-  file_io_close(fd);
+  memset(image, 0, sizeof(BMPImage));
+
+  fd = open(name, O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  if (fstat(fd, &stat) < 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  // The mapping is private, so pixels can be modified without changing the file
+  if (S_ISREG(stat.st_mode) && stat.st_size > 0 && (uint64_t)stat.st_size <= SIZE_MAX)
+  {
+    size = stat.st_size;
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+
+  if (MAP_FAILED == data)
+  {
+    uint8_t *buf = bmp_file_read(fd, &size);
+
+    close(fd);
+
+    if (!buf)
+      return false;
+
+    res = bmp_image_read(image, buf, size);
+    free(buf);
+
+    return res;
+  }
+
+  close(fd);
+
+  if (!bmp_image_parse(&layout, data, size))
+  {
+    munmap(data, size);
+    return false;
+  }
+
+  // Pages of the pixel array are only read when they are accessed
+  if (layout.direct)
+  {
+    image->width    = layout.width;
+    image->height   = layout.height;
+    image->stride   = layout.width * 4;
+    image->data     = &data[layout.offset];
+    image->map      = data;
+    image->map_size = size;
+    return true;
+  }
+
+  posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+  res = bmp_image_convert(image, &layout, data);
+  munmap(data, size);
+
+  return res;
 }
 
+//-----------------------------------------------------------------------------
+void bmp_image_free(BMPImage *image)
+{
+  if (image->map)
+    munmap(image->map, image->map_size);
+  else
+    free(image->data);
+
+  memset(image, 0, sizeof(BMPImage));
+}
@@ -29,9 +29,70 @@
 #ifndef _BMP_IMAGE_H_
 #define _BMP_IMAGE_H_
 
+/*- Includes ----------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*- Definitions -------------------------------------------------------------*/
+enum
+{
+  BMP_IMAGE_FORMAT_BGR,  // 24-bit BI_RGB
+  BMP_IMAGE_FORMAT_BGRA, // 32-bit BI_RGB
+  BMP_IMAGE_FORMAT_RGBA, // 32-bit BI_BITFIELDS, rows are written without conversion
+  BMP_IMAGE_FORMAT_COUNT,
+};
+
+/*- Types -------------------------------------------------------------------*/
+// Streaming writer state. Rows are converted into a small buffer and written
+// as they are passed in, so memory use doesn't depend on the image size.
+typedef struct
+{
+  int      fd;
+  int      width;
+  int      height;
+  int      format;
+  int      row;
+  int      row_size;
+  int      buf_rows;
+  uint8_t  *buf;
+  bool     error;
+} BMPWriter;
+
+// Decoded image, pixels are RGBA and rows go from top to bottom. Mapped
+// images point into a private mapping of the file, so the pixels may be
+// modified without changing the file.
+typedef struct
+{
+  int      width;
+  int      height;
+  int      stride;
+  uint8_t  *data;
+  void     *map;
+  size_t   map_size;
+} BMPImage;
+
 /*- Prototypes --------------------------------------------------------------*/
-void bmp_image_write_rgb(const char *name, int width, int height, uint8_t *data);
-void bmp_image_write_rgba(const char *name, int width, int height, uint8_t *data);
+// Source pixels are RGBA. Images are written as 24-bit BGR, 32-bit BGRA
+// or 32-bit RGBA with BI_BITFIELDS.
+bool bmp_image_write_rgb(const char *name, int width, int height, uint8_t *data);
+bool bmp_image_write_bgra(const char *name, int width, int height, uint8_t *data);
+bool bmp_image_write_rgba(const char *name, int width, int height, uint8_t *data);
 
-#endif // _BMP_IMAGE_H_
+// Rows are written top to bottom in any number of calls, the stride is in
+// bytes. End closes the file and must be called even after an error, it
+// fails if any of the calls failed or not all rows were written.
+bool bmp_image_write_begin(BMPWriter *writer, const char *name, int width, int height, int format);
+bool bmp_image_write_rows(BMPWriter *writer, const uint8_t *data, int stride, int rows);
+bool bmp_image_write_end(BMPWriter *writer);
+
+// Uncompressed 24 and 32-bit images are supported, 32-bit BI_RGB alpha is
+// kept as stored. Read always converts into a new buffer. Map returns the
+// pixel array of the file directly when it is top-down RGBA, which is the
+// layout written by bmp_image_write_rgba(), other layouts are converted.
+// Mapped pixels are only byte aligned. Both must be freed with bmp_image_free().
+bool bmp_image_read(BMPImage *image, const uint8_t *data, size_t size);
+bool bmp_image_map(BMPImage *image, const char *name);
+void bmp_image_free(BMPImage *image);
 
+#endif // _BMP_IMAGE_H_
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "bmp_image.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define MAX_WIDTH      67
+#define MAX_HEIGHT     9
+#define STRIDE_PAD     12
+
+/*- Variables ---------------------------------------------------------------*/
+static int total_checks = 0;
+static int total_errors = 0;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void check(bool ok, const char *what, int format, int width, int height)
+{
+  total_checks++;
+
+  if (ok)
+    return;
+
+  printf("Error: %s (format %d, %d x %d)\n", what, format, width, height);
+  total_errors++;
+}
+
+//-----------------------------------------------------------------------------
+static bool compare(BMPImage *image, uint8_t *src, int stride, int format, int width, int height)
+{
+  if (image->width != width || image->height != height)
+    return false;
+
+  for (int y = 0; y < height; y++)
+  {
+    for (int x = 0; x < width; x++)
+    {
+      uint8_t *a = &image->data[y * image->stride + x * 4];
+      uint8_t *b = &src[y * stride + x * 4];
+      uint8_t alpha = (BMP_IMAGE_FORMAT_BGR == format) ? 0xff : b[3];
+
+      if (a[0] != b[0] || a[1] != b[1] || a[2] != b[2] || a[3] != alpha)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void round_trip(char *name, int format, int width, int height)
+{
+  int stride = width * 4 + STRIDE_PAD;
+  uint8_t *src = malloc(stride * height);
+  BMPWriter writer;
+  BMPImage image;
+  bool ok;
+
+  for (int i = 0; i < stride * height; i++)
+    src[i] = rand();
+
+  // Uneven row batches exercise the conversion buffer and the vector merging
+  ok = bmp_image_write_begin(&writer, name, width, height, format);
+
+  for (int row = 0; ok && row < height; row += 2)
+  {
+    int rows = (height - row) < 2 ? (height - row) : 2;
+    ok = bmp_image_write_rows(&writer, &src[row * stride], stride, rows);
+  }
+
+  ok = bmp_image_write_end(&writer) && ok;
+  check(ok, "write", format, width, height);
+
+  if (ok)
+  {
+    ok = bmp_image_map(&image, name);
+    check(ok && compare(&image, src, stride, format, width, height), "read back", format, width, height);
+
+    if (ok)
+      bmp_image_free(&image);
+  }
+
+  free(src);
+}
+
+//-----------------------------------------------------------------------------
+static void failed_begin(void)
+{
+  uint8_t src[4 * 4 * 4] = {0};
+  BMPWriter writer;
+
+  // A failed begin leaves a writer that rejects rows and is safe to end
+  for (int format = 0; format < BMP_IMAGE_FORMAT_COUNT; format++)
+  {
+    check(!bmp_image_write_begin(&writer, "/nonexistent/demo.bmp", 4, 4, format), "begin", format, 4, 4);
+    check(!bmp_image_write_rows(&writer, src, 16, 4), "rows after begin", format, 4, 4);
+    check(!bmp_image_write_end(&writer), "end after begin", format, 4, 4);
+
+    check(!bmp_image_write_begin(&writer, "/nonexistent/demo.bmp", 0, 4, format), "size", format, 0, 4);
+    check(!bmp_image_write_rows(&writer, src, 16, 4), "rows after size", format, 0, 4);
+    check(!bmp_image_write_end(&writer), "end after size", format, 0, 4);
+  }
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+  if (argc != 2)
+  {
+    printf("Temporary file name required\n");
+    return 0;
+  }
+
+  for (int format = 0; format < BMP_IMAGE_FORMAT_COUNT; format++)
+  {
+    for (int width = 1; width <= MAX_WIDTH; width += 3)
+    {
+      for (int height = 1; height <= MAX_HEIGHT; height += 4)
+        round_trip(argv[1], format, width, height);
+    }
+  }
+
+  failed_begin();
+
+  remove(argv[1]);
+
+  printf("Checks: %d, errors: %d\n", total_checks, total_errors);
+
+  return total_errors ? 1 : 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "checksum.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define CRC32_POLY     0xedb88320
+#define ADLER32_BASE   65521
+#define ADLER32_NMAX   5552 // Largest n such that 255n(n+1)/2 + (n+1)(BASE-1) fits 32 bits
+
+/*- Types -------------------------------------------------------------------*/
+typedef uint32_t (*ChecksumFunc)(uint32_t value, const uint8_t *data, size_t size);
+
+/*- Variables ---------------------------------------------------------------*/
+static uint32_t crc32_table[8][256];
+static ChecksumFunc crc32_kernel;
+static ChecksumFunc adler32_kernel;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static inline uint32_t load_le(const uint8_t *data)
+{
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *data, size_t size)
+{
+  crc = ~crc;
+
+  while (size >= 8)
+  {
+    uint32_t lo = crc ^ load_le(data);
+    uint32_t hi = load_le(data + 4);
+
+    crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+          crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+          crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+          crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+
+    data += 8;
+    size -= 8;
+  }
+
+  while (size--)
+    crc = crc32_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t adler32_scalar(uint32_t adler, const uint8_t *data, size_t size)
+{
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = adler >> 16;
+
+  while (size > 0)
+  {
+    size_t n = (size < ADLER32_NMAX) ? size : ADLER32_NMAX;
+
+    size -= n;
+
+    while (n >= 4)
+    {
+      s1 += data[0]; s2 += s1;
+      s1 += data[1]; s2 += s1;
+      s1 += data[2]; s2 += s1;
+      s1 += data[3]; s2 += s1;
+      data += 4;
+      n -= 4;
+    }
+
+    while (n--)
+    {
+      s1 += *data++;
+      s2 += s1;
+    }
+
+    s1 %= ADLER32_BASE;
+    s2 %= ADLER32_BASE;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//-----------------------------------------------------------------------------
+static __attribute__((target("pclmul,sse4.1"))) uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t size)
+{
+  // Folding with carry-less multiplication as described in Intel's "Fast CRC
+  // Computation for Generic Polynomials Using PCLMULQDQ Instruction". The
+  // constants are for the bit-reflected CRC-32 polynomial.
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+  size_t tail;
+
+  if (size < 64)
+    return crc32_slice8(crc, data, size);
+
+  tail = size & 15;
+  size -= tail;
+
+  x1 = _mm_loadu_si128((__m128i *)(data + 0x00));
+  x2 = _mm_loadu_si128((__m128i *)(data + 0x10));
+  x3 = _mm_loadu_si128((__m128i *)(data + 0x20));
+  x4 = _mm_loadu_si128((__m128i *)(data + 0x30));
+
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(~crc));
+
+  data += 64;
+  size -= 64;
+
+  // Four independent 128-bit accumulators hide the multiplier latency
+  while (size >= 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i *)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i *)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i *)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i *)(data + 0x30)));
+
+    data += 64;
+    size -= 64;
+  }
+
+  // Fold the accumulators into one
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (size >= 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i *)data)), x5);
+
+    data += 16;
+    size -= 16;
+  }
+
+  // Reduce 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x2 = _mm_and_si128(x1, mask);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  crc = ~(uint32_t)_mm_extract_epi32(x1, 1);
+
+  return crc32_slice8(crc, data, tail);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) uint32_t adler32_ssse3(uint32_t adler, const uint8_t *data, size_t size)
+{
+  // Each 32-byte block adds its bytes to s1 and the bytes weighted by their
+  // distance from the end of the block to s2. The s1 values from before each
+  // block are accumulated separately and added to s2 times the block size.
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = adler >> 16;
+  size_t blocks = size / 32;
+
+  size -= blocks * 32;
+
+  while (blocks > 0)
+  {
+    size_t n = (blocks < ADLER32_NMAX / 32) ? blocks : ADLER32_NMAX / 32;
+    __m128i v_ps = _mm_setr_epi32(s1 * n, 0, 0, 0);
+    __m128i v_s2 = _mm_setr_epi32(s2, 0, 0, 0);
+    __m128i v_s1 = zero;
+
+    blocks -= n;
+
+    do
+    {
+      __m128i bytes1 = _mm_loadu_si128((__m128i *)data);
+      __m128i bytes2 = _mm_loadu_si128((__m128i *)(data + 16));
+
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+
+      data += 32;
+    } while (--n);
+
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    s1 = (s1 + (uint32_t)_mm_cvtsi128_si32(v_s1)) % ADLER32_BASE;
+    s2 = (uint32_t)_mm_cvtsi128_si32(v_s2) % ADLER32_BASE;
+  }
+
+  return adler32_scalar((s2 << 16) | s1, data, size);
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("avx2"))) uint32_t sum_epi32_avx2(__m256i v)
+{
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+  return (uint32_t)_mm_cvtsi128_si32(sum);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("avx2"))) uint32_t adler32_avx2(uint32_t adler, const uint8_t *data, size_t size)
+{
+  // Same as the SSSE3 version, but the whole block fits into one register
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+      16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = adler >> 16;
+  size_t blocks = size / 32;
+
+  size -= blocks * 32;
+
+  while (blocks > 0)
+  {
+    size_t n = (blocks < ADLER32_NMAX / 32) ? blocks : ADLER32_NMAX / 32;
+    __m256i v_ps = zero;
+    __m256i v_s1 = zero;
+    __m256i v_s2 = zero;
+
+    blocks -= n;
+    s2 += s1 * 32 * n;
+
+    do
+    {
+      __m256i bytes = _mm256_loadu_si256((__m256i *)data);
+
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+
+      data += 32;
+    } while (--n);
+
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    s1 = (s1 + sum_epi32_avx2(v_s1)) % ADLER32_BASE;
+    s2 = (s2 + sum_epi32_avx2(v_s2)) % ADLER32_BASE;
+  }
+
+  return adler32_scalar((s2 << 16) | s1, data, size);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+static void __attribute__((constructor)) checksum_select_kernels(void)
+{
+  for (int i = 0; i < 256; i++)
+  {
+    uint32_t crc = i;
+
+    for (int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32_POLY : 0);
+
+    crc32_table[0][i] = crc;
+  }
+
+  for (int i = 0; i < 256; i++)
+  {
+    for (int j = 1; j < 8; j++)
+      crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^ crc32_table[0][crc32_table[j - 1][i] & 0xff];
+  }
+
+  crc32_kernel   = crc32_slice8;
+  adler32_kernel = adler32_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    crc32_kernel = crc32_pclmul;
+
+  if (__builtin_cpu_supports("ssse3"))
+    adler32_kernel = adler32_ssse3;
+
+  if (__builtin_cpu_supports("avx2"))
+    adler32_kernel = adler32_avx2;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+uint32_t checksum_crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+  return crc32_kernel(crc, data, size);
+}
+
+//-----------------------------------------------------------------------------
+uint32_t checksum_adler32(uint32_t adler, const uint8_t *data, size_t size)
+{
+  return adler32_kernel(adler, data, size);
+}
+
+//-----------------------------------------------------------------------------
+uint32_t checksum_adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+  uint32_t rem  = size2 % ADLER32_BASE;
+  uint32_t sum1 = adler1 & 0xffff;
+  uint32_t sum2 = (rem * sum1) % ADLER32_BASE;
+
+  // Each block adds its own s1 and s2 on top of the first one, s2 also
+  // gets s1 of the first block once for every byte of the second block
+  sum1 += (adler2 & 0xffff) + ADLER32_BASE - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER32_BASE - rem;
+
+  if (sum1 >= ADLER32_BASE)
+    sum1 -= ADLER32_BASE;
+
+  if (sum1 >= ADLER32_BASE)
+    sum1 -= ADLER32_BASE;
+
+  if (sum2 >= 2 * ADLER32_BASE)
+    sum2 -= 2 * ADLER32_BASE;
+
+  if (sum2 >= ADLER32_BASE)
+    sum2 -= ADLER32_BASE;
+
+  return (sum2 << 16) | sum1;
+}
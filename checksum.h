@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+
+/*- Definitions -------------------------------------------------------------*/
+#define CHECKSUM_CRC32_INIT    0
+#define CHECKSUM_ADLER32_INIT  1
+
+/*- Prototypes --------------------------------------------------------------*/
+// Both checksums are updated incrementally, starting from the initial value.
+// The fastest implementation supported by the CPU is selected at startup.
+uint32_t checksum_crc32(uint32_t crc, const uint8_t *data, size_t size);
+uint32_t checksum_adler32(uint32_t adler, const uint8_t *data, size_t size);
+
+// Returns the Adler-32 of the concatenation of two blocks, given the
+// checksum of each block and the size of the second one
+uint32_t checksum_adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2);
+
+#endif // _CHECKSUM_H_
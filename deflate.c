@@ -0,0 +1,982 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "deflate.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define WINDOW_SIZE    32768
+#define WINDOW_MASK    (WINDOW_SIZE - 1)
+#define HASH_BITS      15
+#define HASH_SIZE      (1 << HASH_BITS)
+#define MIN_MATCH      3
+#define MAX_MATCH      258
+#define TOO_FAR        4096 // Minimal matches further than this are not worth it
+#define MAX_SYMBOLS    32768
+#define MAX_STORED     65535
+#define MAX_SEGMENT    (1 << 30) // Input positions within a segment fit an int
+
+#define LITLEN_CODES   286
+#define DIST_CODES     30
+#define CODELEN_CODES  19
+#define MAX_BITS       15
+#define MAX_CODELEN_BITS 7
+#define END_OF_BLOCK   256
+
+/*- Types -------------------------------------------------------------------*/
+// Greedy levels use max_lazy as the longest match for which all positions
+// are added to the hash chains
+typedef struct
+{
+  int      good_length;
+  int      max_lazy;
+  int      nice_length;
+  int      max_chain;
+  bool     lazy;
+} DeflateConfig;
+
+typedef struct
+{
+  const DeflateConfig *config;
+  const uint8_t *base;
+  int      end;
+  int      *head;
+  int      *prev;
+
+  uint16_t *lit;
+  uint16_t *dist;
+  int      count;
+  int      block_start;
+  int      block_size;
+  uint32_t lit_freq[LITLEN_CODES];
+  uint32_t dist_freq[DIST_CODES];
+
+  uint8_t  *data;
+  size_t   size;
+  size_t   capacity;
+  uint64_t bits;
+  int      bit_count;
+  int      flags;
+  bool     error;
+} Deflate;
+
+/*- Constants ---------------------------------------------------------------*/
+// Compression levels, the same trade-offs as in zlib
+static const DeflateConfig deflate_configs[DEFLATE_MAX_LEVEL + 1] =
+{
+  {  0,   0,   0,    0, false },
+  {  4,   4,   8,    4, false },
+  {  4,   5,  16,    8, false },
+  {  4,   6,  32,   32, false },
+  {  4,   4,  16,   16, true },
+  {  8,  16,  32,   32, true },
+  {  8,  16, 128,  128, true },
+  {  8,  32, 128,  256, true },
+  { 32, 128, 258, 1024, true },
+  { 32, 258, 258, 4096, true },
+};
+
+static const int length_base[29] =
+{
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const int length_extra_bits[29] =
+{
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const int dist_base[DIST_CODES] =
+{
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+
+static const int dist_extra_bits[DIST_CODES] =
+{
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static const int codelen_order[CODELEN_CODES] =
+{
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+/*- Variables ---------------------------------------------------------------*/
+static uint8_t length_code[MAX_MATCH + 1];
+static uint8_t dist_code[512]; // Distances up to 256 and then in steps of 128
+static uint8_t fixed_lengths[LITLEN_CODES + 2];
+static uint8_t fixed_dist_lengths[DIST_CODES];
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void __attribute__((constructor)) deflate_init_tables(void)
+{
+  for (int code = 0; code < 29; code++)
+  {
+    for (int i = 0; i < (1 << length_extra_bits[code]); i++)
+      length_code[length_base[code] + i] = code;
+  }
+
+  // 258 has its own code, even though 227 + 31 also fits the previous one
+  length_code[MAX_MATCH] = 28;
+
+  for (int code = 0; code < DIST_CODES; code++)
+  {
+    for (int i = 0; i < (1 << dist_extra_bits[code]); i++)
+    {
+      int dist = dist_base[code] + i - 1;
+
+      if (dist < 256)
+        dist_code[dist] = code;
+      else
+        dist_code[256 + (dist >> 7)] = code;
+    }
+  }
+
+  for (int i = 0; i < LITLEN_CODES + 2; i++)
+    fixed_lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+
+  memset(fixed_dist_lengths, 5, sizeof(fixed_dist_lengths));
+}
+
+//-----------------------------------------------------------------------------
+static inline int get_dist_code(int dist)
+{
+  dist--;
+  return (dist < 256) ? dist_code[dist] : dist_code[256 + (dist >> 7)];
+}
+
+//-----------------------------------------------------------------------------
+static bool deflate_reserve(Deflate *d, size_t size)
+{
+  uint8_t *data;
+  size_t capacity;
+
+  // The bit buffer may hold up to 8 more bytes
+  size += 16;
+
+  if ((d->size + size) <= d->capacity)
+    return true;
+
+  capacity = d->capacity * 2;
+
+  if (capacity < (d->size + size))
+    capacity = d->size + size;
+
+  data = (uint8_t *)realloc(d->data, capacity);
+
+  if (!data)
+  {
+    d->error = true;
+    return false;
+  }
+
+  d->data     = data;
+  d->capacity = capacity;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static inline void put_bits(Deflate *d, uint32_t value, int bits)
+{
+  d->bits |= (uint64_t)value << d->bit_count;
+  d->bit_count += bits;
+
+  if (d->bit_count >= 32)
+  {
+    d->data[d->size++] = d->bits;
+    d->data[d->size++] = d->bits >> 8;
+    d->data[d->size++] = d->bits >> 16;
+    d->data[d->size++] = d->bits >> 24;
+    d->bits >>= 32;
+    d->bit_count -= 32;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void align_bits(Deflate *d)
+{
+  while (d->bit_count > 0)
+  {
+    d->data[d->size++] = d->bits;
+    d->bits >>= 8;
+    d->bit_count -= 8;
+  }
+
+  d->bits = 0;
+  d->bit_count = 0;
+}
+
+//-----------------------------------------------------------------------------
+static void build_lengths(const uint32_t *freq, int size, int max_bits, uint8_t *lengths)
+{
+  // Minimum redundancy code lengths are computed in place on the sorted
+  // frequencies (Moffat and Katajainen), then limited to max_bits by moving
+  // the deepest codes up the tree until the code is complete again
+  uint32_t weight[LITLEN_CODES];
+  uint16_t symbol[LITLEN_CODES];
+  int count[LITLEN_CODES + 1] = { 0 };
+  int n = 0, root, leaf, next, avail, used, depth;
+  uint32_t total = 0;
+
+  memset(lengths, 0, size);
+
+  for (int i = 0; i < size; i++)
+  {
+    if (0 == freq[i])
+      continue;
+
+    // Insertion sort is fine for at most 286 symbols that are mostly sorted
+    int j = n++;
+
+    while (j > 0 && weight[j - 1] > freq[i])
+    {
+      weight[j] = weight[j - 1];
+      symbol[j] = symbol[j - 1];
+      j--;
+    }
+
+    weight[j] = freq[i];
+    symbol[j] = i;
+  }
+
+  if (0 == n)
+    return;
+
+  if (1 == n)
+  {
+    lengths[symbol[0]] = 1;
+    return;
+  }
+
+  weight[0] += weight[1];
+  root = 0;
+  leaf = 2;
+
+  for (next = 1; next < n - 1; next++)
+  {
+    if (leaf >= n || weight[root] < weight[leaf])
+    {
+      weight[next] = weight[root];
+      weight[root++] = next;
+    }
+    else
+    {
+      weight[next] = weight[leaf++];
+    }
+
+    if (leaf >= n || (root < next && weight[root] < weight[leaf]))
+    {
+      weight[next] += weight[root];
+      weight[root++] = next;
+    }
+    else
+    {
+      weight[next] += weight[leaf++];
+    }
+  }
+
+  weight[n - 2] = 0;
+
+  for (next = n - 3; next >= 0; next--)
+    weight[next] = weight[weight[next]] + 1;
+
+  avail = 1;
+  used  = 0;
+  depth = 0;
+  root  = n - 2;
+  next  = n - 1;
+
+  while (avail > 0)
+  {
+    while (root >= 0 && (int)weight[root] == depth)
+    {
+      used++;
+      root--;
+    }
+
+    while (avail > used)
+    {
+      weight[next--] = depth;
+      avail--;
+    }
+
+    avail = 2 * used;
+    depth++;
+    used = 0;
+  }
+
+  for (int i = 0; i < n; i++)
+    count[(weight[i] > (uint32_t)max_bits) ? max_bits : (int)weight[i]]++;
+
+  for (int i = max_bits; i > 0; i--)
+    total += (uint32_t)count[i] << (max_bits - i);
+
+  while (total > (1u << max_bits))
+  {
+    count[max_bits]--;
+
+    for (int i = max_bits - 1; i > 0; i--)
+    {
+      if (count[i])
+      {
+        count[i]--;
+        count[i + 1] += 2;
+        break;
+      }
+    }
+
+    total--;
+  }
+
+  // The most frequent symbols get the shortest codes
+  for (int i = 1, j = n; i <= max_bits; i++)
+  {
+    for (int k = count[i]; k > 0; k--)
+      lengths[symbol[--j]] = i;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void build_codes(const uint8_t *lengths, int size, uint16_t *codes)
+{
+  int count[MAX_BITS + 1] = { 0 };
+  int next[MAX_BITS + 1];
+  int code = 0;
+
+  for (int i = 0; i < size; i++)
+    count[lengths[i]]++;
+
+  count[0] = 0;
+
+  for (int i = 1; i <= MAX_BITS; i++)
+  {
+    code = (code + count[i - 1]) << 1;
+    next[i] = code;
+  }
+
+  // Codes are sent starting from the most significant bit
+  for (int i = 0; i < size; i++)
+  {
+    int len = lengths[i];
+    int value, reversed = 0;
+
+    if (0 == len)
+      continue;
+
+    value = next[len]++;
+
+    for (int j = 0; j < len; j++)
+      reversed |= ((value >> j) & 1) << (len - 1 - j);
+
+    codes[i] = reversed;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void complete_code(uint8_t *lengths, int size)
+{
+  int used = 0, last = 0;
+
+  // A single code would make an incomplete tree, which not all decoders accept
+  for (int i = 0; i < size; i++)
+  {
+    if (lengths[i])
+    {
+      used++;
+      last = i;
+    }
+  }
+
+  if (0 == used)
+    lengths[0] = lengths[1] = 1;
+  else if (1 == used)
+    lengths[last ? 0 : 1] = 1;
+}
+
+//-----------------------------------------------------------------------------
+static int encode_lengths(const uint8_t *lengths, int size, uint8_t *symbols, uint8_t *extra,
+    uint32_t *freq)
+{
+  int count = 0;
+
+  // Runs of zeros and repeated lengths are replaced with codes 16-18
+  for (int i = 0; i < size;)
+  {
+    int len = lengths[i];
+    int run = 1;
+
+    while ((i + run) < size && lengths[i + run] == len)
+      run++;
+
+    i += run;
+
+    if (0 == len)
+    {
+      while (run >= 11)
+      {
+        int n = (run > 138) ? 138 : run;
+        symbols[count] = 18;
+        extra[count++] = n - 11;
+        run -= n;
+      }
+
+      if (run >= 3)
+      {
+        symbols[count] = 17;
+        extra[count++] = run - 3;
+        run = 0;
+      }
+    }
+    else
+    {
+      symbols[count] = len;
+      extra[count++] = 0;
+      run--;
+
+      while (run >= 3)
+      {
+        int n = (run > 6) ? 6 : run;
+        symbols[count] = 16;
+        extra[count++] = n - 3;
+        run -= n;
+      }
+    }
+
+    while (run-- > 0)
+    {
+      symbols[count] = len;
+      extra[count++] = 0;
+    }
+  }
+
+  for (int i = 0; i < count; i++)
+    freq[symbols[i]]++;
+
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t symbols_cost(Deflate *d, const uint8_t *lit_len, const uint8_t *dist_len)
+{
+  uint64_t cost = 0;
+
+  for (int i = 0; i < LITLEN_CODES; i++)
+    cost += (uint64_t)d->lit_freq[i] * (lit_len[i] + ((i > END_OF_BLOCK) ? length_extra_bits[i - 257] : 0));
+
+  for (int i = 0; i < DIST_CODES; i++)
+    cost += (uint64_t)d->dist_freq[i] * (dist_len[i] + dist_extra_bits[i]);
+
+  return cost;
+}
+
+//-----------------------------------------------------------------------------
+static void write_symbols(Deflate *d, const uint8_t *lit_len, const uint16_t *lit_codes,
+    const uint8_t *dist_len, const uint16_t *dist_codes)
+{
+  for (int i = 0; i < d->count; i++)
+  {
+    int dist = d->dist[i];
+
+    if (0 == dist)
+    {
+      int lit = d->lit[i];
+      put_bits(d, lit_codes[lit], lit_len[lit]);
+    }
+    else
+    {
+      int len  = d->lit[i];
+      int lc   = length_code[len];
+      int dc   = get_dist_code(dist);
+
+      put_bits(d, lit_codes[257 + lc], lit_len[257 + lc]);
+      put_bits(d, len - length_base[lc], length_extra_bits[lc]);
+      put_bits(d, dist_codes[dc], dist_len[dc]);
+      put_bits(d, dist - dist_base[dc], dist_extra_bits[dc]);
+    }
+  }
+
+  put_bits(d, lit_codes[END_OF_BLOCK], lit_len[END_OF_BLOCK]);
+}
+
+//-----------------------------------------------------------------------------
+static void write_stored(Deflate *d, const uint8_t *data, int size, bool final)
+{
+  do
+  {
+    int len = (size > MAX_STORED) ? MAX_STORED : size;
+    bool last = final && (len == size);
+
+    put_bits(d, last ? 1 : 0, 3);
+    align_bits(d);
+
+    d->data[d->size++] = len;
+    d->data[d->size++] = len >> 8;
+    d->data[d->size++] = ~len;
+    d->data[d->size++] = ~len >> 8;
+
+    if (len)
+      memcpy(&d->data[d->size], data, len);
+
+    d->size += len;
+    data += len;
+    size -= len;
+  } while (size > 0);
+}
+
+//-----------------------------------------------------------------------------
+static void deflate_write_block(Deflate *d, bool final)
+{
+  uint8_t lit_len[LITLEN_CODES], dist_len[DIST_CODES], cl_len[CODELEN_CODES];
+  uint16_t lit_codes[LITLEN_CODES + 2], dist_codes[DIST_CODES], cl_codes[CODELEN_CODES];
+  uint8_t lengths[LITLEN_CODES + DIST_CODES], cl_symbols[LITLEN_CODES + DIST_CODES];
+  uint8_t cl_extra[LITLEN_CODES + DIST_CODES];
+  uint32_t cl_freq[CODELEN_CODES] = { 0 };
+  int stored_blocks = d->block_size / MAX_STORED + 1;
+  uint64_t dynamic_cost, fixed_cost, stored_cost;
+  int hlit, hdist, hclen, cl_count;
+
+  // The output never grows more than stored blocks would need
+  if (!deflate_reserve(d, d->block_size + stored_blocks * 6))
+    return;
+
+  d->lit_freq[END_OF_BLOCK] = 1;
+
+  build_lengths(d->lit_freq, LITLEN_CODES, MAX_BITS, lit_len);
+  build_lengths(d->dist_freq, DIST_CODES, MAX_BITS, dist_len);
+  complete_code(lit_len, LITLEN_CODES);
+  complete_code(dist_len, DIST_CODES);
+
+  for (hlit = LITLEN_CODES; hlit > 257 && 0 == lit_len[hlit - 1]; hlit--);
+  for (hdist = DIST_CODES; hdist > 1 && 0 == dist_len[hdist - 1]; hdist--);
+
+  memcpy(lengths, lit_len, hlit);
+  memcpy(&lengths[hlit], dist_len, hdist);
+
+  cl_count = encode_lengths(lengths, hlit + hdist, cl_symbols, cl_extra, cl_freq);
+  build_lengths(cl_freq, CODELEN_CODES, MAX_CODELEN_BITS, cl_len);
+  complete_code(cl_len, CODELEN_CODES);
+
+  for (hclen = CODELEN_CODES; hclen > 4 && 0 == cl_len[codelen_order[hclen - 1]]; hclen--);
+
+  dynamic_cost = 3 + 5 + 5 + 4 + hclen * 3 + symbols_cost(d, lit_len, dist_len) +
+      cl_freq[16] * 2 + cl_freq[17] * 3 + cl_freq[18] * 7;
+
+  for (int i = 0; i < CODELEN_CODES; i++)
+    dynamic_cost += (uint64_t)cl_freq[i] * cl_len[i];
+
+  fixed_cost = 3 + symbols_cost(d, fixed_lengths, fixed_dist_lengths);
+
+  // Header bits and the worst case padding for each stored block
+  stored_cost = (uint64_t)d->block_size * 8 + stored_blocks * 42;
+
+  // Forced blocks may be larger than the stored ones would be
+  if (d->flags & DEFLATE_FIXED)
+  {
+    dynamic_cost = stored_cost = UINT64_MAX;
+
+    if (!deflate_reserve(d, fixed_cost / 8 + 1))
+      return;
+  }
+  else if (d->flags & DEFLATE_DYNAMIC)
+  {
+    fixed_cost = stored_cost = UINT64_MAX;
+
+    if (!deflate_reserve(d, dynamic_cost / 8 + 1))
+      return;
+  }
+
+  if (0 == d->config->max_chain || (stored_cost <= fixed_cost && stored_cost <= dynamic_cost))
+  {
+    write_stored(d, d->base + d->block_start, d->block_size, final);
+  }
+  else if (fixed_cost <= dynamic_cost)
+  {
+    // Unused codes 286 and 287 are a part of the fixed code
+    build_codes(fixed_lengths, LITLEN_CODES + 2, lit_codes);
+    build_codes(fixed_dist_lengths, DIST_CODES, dist_codes);
+
+    put_bits(d, (final ? 1 : 0) | (1 << 1), 3);
+    write_symbols(d, fixed_lengths, lit_codes, fixed_dist_lengths, dist_codes);
+  }
+  else
+  {
+    build_codes(lit_len, LITLEN_CODES, lit_codes);
+    build_codes(dist_len, DIST_CODES, dist_codes);
+    build_codes(cl_len, CODELEN_CODES, cl_codes);
+
+    put_bits(d, (final ? 1 : 0) | (2 << 1), 3);
+    put_bits(d, hlit - 257, 5);
+    put_bits(d, hdist - 1, 5);
+    put_bits(d, hclen - 4, 4);
+
+    for (int i = 0; i < hclen; i++)
+      put_bits(d, cl_len[codelen_order[i]], 3);
+
+    for (int i = 0; i < cl_count; i++)
+    {
+      int sym = cl_symbols[i];
+
+      put_bits(d, cl_codes[sym], cl_len[sym]);
+
+      if (sym >= 16)
+        put_bits(d, cl_extra[i], (16 == sym) ? 2 : (17 == sym) ? 3 : 7);
+    }
+
+    write_symbols(d, lit_len, lit_codes, dist_len, dist_codes);
+  }
+
+  d->block_start += d->block_size;
+  d->block_size = 0;
+  d->count = 0;
+  memset(d->lit_freq, 0, sizeof(d->lit_freq));
+  memset(d->dist_freq, 0, sizeof(d->dist_freq));
+}
+
+//-----------------------------------------------------------------------------
+static inline void deflate_literal(Deflate *d, int lit)
+{
+  d->lit[d->count]  = lit;
+  d->dist[d->count] = 0;
+  d->count++;
+  d->block_size++;
+  d->lit_freq[lit]++;
+
+  if (MAX_SYMBOLS == d->count)
+    deflate_write_block(d, false);
+}
+
+//-----------------------------------------------------------------------------
+static inline void deflate_match(Deflate *d, int len, int dist)
+{
+  d->lit[d->count]  = len;
+  d->dist[d->count] = dist;
+  d->count++;
+  d->block_size += len;
+  d->lit_freq[257 + length_code[len]]++;
+  d->dist_freq[get_dist_code(dist)]++;
+
+  if (MAX_SYMBOLS == d->count)
+    deflate_write_block(d, false);
+}
+
+//-----------------------------------------------------------------------------
+static inline uint32_t hash(const uint8_t *data)
+{
+  uint32_t value = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+
+  return (value * 0x9e3779b1) >> (32 - HASH_BITS);
+}
+
+//-----------------------------------------------------------------------------
+static inline int insert(Deflate *d, int pos)
+{
+  uint32_t h = hash(&d->base[pos]);
+  int head = d->head[h];
+
+  d->prev[pos & WINDOW_MASK] = head;
+  d->head[h] = pos;
+
+  return head;
+}
+
+//-----------------------------------------------------------------------------
+static inline int match_length(const uint8_t *a, const uint8_t *b, int max)
+{
+  int len = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while ((len + 8) <= max)
+  {
+    uint64_t x, y;
+
+    memcpy(&x, &a[len], 8);
+    memcpy(&y, &b[len], 8);
+
+    if (x != y)
+      return len + (__builtin_ctzll(x ^ y) >> 3);
+
+    len += 8;
+  }
+#endif
+
+  while (len < max && a[len] == b[len])
+    len++;
+
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+static int find_match(Deflate *d, int pos, int cand, int best, int *dist)
+{
+  const uint8_t *data = &d->base[pos];
+  int max = d->end - pos;
+  int limit = pos - WINDOW_SIZE;
+  int chain = d->config->max_chain;
+  int nice = d->config->nice_length;
+
+  if (max > MAX_MATCH)
+    max = MAX_MATCH;
+
+  if (nice > max)
+    nice = max;
+
+  if (best >= max)
+    return best;
+
+  // A good enough match is improved with a shorter chain
+  if (best >= d->config->good_length)
+    chain >>= 2;
+
+  while (cand >= 0 && cand >= limit && chain-- > 0)
+  {
+    const uint8_t *match = &d->base[cand];
+    int next;
+
+    if (match[best] == data[best] && match[0] == data[0] && match[1] == data[1])
+    {
+      int len = match_length(match, data, max);
+
+      if (len > best)
+      {
+        best  = len;
+        *dist = pos - cand;
+
+        if (len >= nice)
+          break;
+      }
+    }
+
+    // Slots of positions that fell out of the window are reused
+    next = d->prev[cand & WINDOW_MASK];
+
+    if (next >= cand)
+      break;
+
+    cand = next;
+  }
+
+  return best;
+}
+
+//-----------------------------------------------------------------------------
+static void deflate_greedy(Deflate *d, int pos)
+{
+  while (pos < d->end)
+  {
+    int len = 0, dist = 0;
+
+    if ((d->end - pos) >= MIN_MATCH)
+      len = find_match(d, pos, insert(d, pos), MIN_MATCH - 1, &dist);
+
+    if (len == MIN_MATCH && dist > TOO_FAR)
+      len = 0;
+
+    if (len >= MIN_MATCH)
+    {
+      int last = pos + len;
+
+      deflate_match(d, len, dist);
+
+      // Skipping long matches keeps the chains short and the older
+      // matches reachable
+      if (len <= d->config->max_lazy)
+      {
+        for (pos++; pos < last; pos++)
+        {
+          if ((d->end - pos) >= MIN_MATCH)
+            insert(d, pos);
+        }
+      }
+
+      pos = last;
+    }
+    else
+    {
+      deflate_literal(d, d->base[pos]);
+      pos++;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void deflate_lazy(Deflate *d, int pos)
+{
+  int prev_len = 0, prev_dist = 0;
+  bool prev_literal = false;
+
+  // A match is only taken if the match at the next position is not longer
+  while (pos < d->end)
+  {
+    int len = 0, dist = 0;
+
+    if ((d->end - pos) >= MIN_MATCH)
+    {
+      int cand = insert(d, pos);
+
+      if (prev_len < d->config->max_lazy)
+        len = find_match(d, pos, cand, (prev_len < MIN_MATCH) ? MIN_MATCH - 1 : prev_len, &dist);
+
+      if (len == MIN_MATCH && dist > TOO_FAR)
+        len = 0;
+    }
+
+    if (prev_len >= MIN_MATCH && len <= prev_len)
+    {
+      int last = pos - 1 + prev_len;
+
+      deflate_match(d, prev_len, prev_dist);
+
+      for (pos++; pos < last; pos++)
+      {
+        if ((d->end - pos) >= MIN_MATCH)
+          insert(d, pos);
+      }
+
+      prev_len = 0;
+      prev_literal = false;
+      continue;
+    }
+
+    if (prev_literal)
+      deflate_literal(d, d->base[pos - 1]);
+
+    prev_len  = len;
+    prev_dist = dist;
+    prev_literal = true;
+    pos++;
+  }
+
+  if (prev_literal)
+    deflate_literal(d, d->base[pos - 1]);
+}
+
+//-----------------------------------------------------------------------------
+static void deflate_segment(Deflate *d, const uint8_t *data, int size, int dict_size)
+{
+  d->base        = data - dict_size;
+  d->end         = dict_size + size;
+  d->block_start = dict_size;
+
+  if (0 == d->config->max_chain)
+  {
+    d->block_size = size;
+    return;
+  }
+
+  memset(d->head, 0xff, HASH_SIZE * sizeof(int));
+
+  for (int pos = 0; pos < dict_size && (d->end - pos) >= MIN_MATCH; pos++)
+    insert(d, pos);
+
+  if (d->config->lazy)
+    deflate_lazy(d, dict_size);
+  else
+    deflate_greedy(d, dict_size);
+}
+
+//-----------------------------------------------------------------------------
+uint8_t *deflate_compress(const uint8_t *data, size_t size, int dict_size, int level,
+    int flags, size_t *out_size)
+{
+  bool final = (flags & DEFLATE_FINAL);
+  size_t offset = 0;
+  Deflate d;
+
+  if (level < 0 || level > DEFLATE_MAX_LEVEL || dict_size < 0)
+    return NULL;
+
+  if (dict_size > DEFLATE_DICT_SIZE)
+    dict_size = DEFLATE_DICT_SIZE;
+
+  memset(&d, 0, sizeof(Deflate));
+
+  d.config      = &deflate_configs[level];
+  d.flags       = flags;
+  d.capacity    = size / 2 + 64;
+  d.data        = (uint8_t *)malloc(d.capacity);
+  d.head        = (int *)malloc(HASH_SIZE * sizeof(int));
+  d.prev        = (int *)malloc(WINDOW_SIZE * sizeof(int));
+  d.lit         = (uint16_t *)malloc(MAX_SYMBOLS * sizeof(uint16_t));
+  d.dist        = (uint16_t *)malloc(MAX_SYMBOLS * sizeof(uint16_t));
+
+  if (!d.data || !d.head || !d.prev || !d.lit || !d.dist)
+    d.error = true;
+
+  // Larger inputs are compressed in segments, each one uses the end of the
+  // previous one as a dictionary. A block never spans two segments.
+  while (!d.error)
+  {
+    int segment = (size - offset > MAX_SEGMENT) ? MAX_SEGMENT : (int)(size - offset);
+
+    deflate_segment(&d, data + offset, segment, offset ? DEFLATE_DICT_SIZE : dict_size);
+    offset += segment;
+
+    if (offset == size)
+      break;
+
+    if (!d.error && d.block_size)
+      deflate_write_block(&d, false);
+  }
+
+  // The last block is always written, even if it is empty
+  if (!d.error && (d.block_size || final))
+    deflate_write_block(&d, final);
+
+  // Empty stored block aligns the output on a byte boundary
+  if (!d.error && !final && deflate_reserve(&d, 0))
+    write_stored(&d, NULL, 0, false);
+
+  if (!d.error)
+    align_bits(&d);
+
+  free(d.head);
+  free(d.prev);
+  free(d.lit);
+  free(d.dist);
+
+  if (d.error)
+  {
+    free(d.data);
+    return NULL;
+  }
+
+  *out_size = d.size;
+
+  return d.data;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DEFLATE_H_
+#define _DEFLATE_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*- Definitions -------------------------------------------------------------*/
+#define DEFLATE_MAX_LEVEL      9
+#define DEFLATE_DICT_SIZE      32768
+
+#define DEFLATE_FINAL          (1 << 0) // The last part of the stream
+#define DEFLATE_FIXED          (1 << 1) // Only fixed Huffman code blocks
+#define DEFLATE_DYNAMIC        (1 << 2) // Only dynamic Huffman code blocks
+
+/*- Prototypes --------------------------------------------------------------*/
+// Compresses the data into a raw deflate stream allocated with malloc().
+// Level 0 only stores the data, levels 1-3 use greedy matching and higher
+// levels use lazy matching with longer hash chains. Up to DEFLATE_DICT_SIZE
+// bytes right before the data are used as a preset dictionary. A stream
+// that is not final ends with an empty stored block, so it is byte aligned
+// and the next part of the data can be appended to it. The block type is
+// picked by the size of the output, unless it is forced by the flags.
+uint8_t *deflate_compress(const uint8_t *data, size_t size, int dict_size, int level,
+    int flags, size_t *out_size);
+
+#endif // _DEFLATE_H_
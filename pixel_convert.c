@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "pixel_convert.h"
+
+/*- Types -------------------------------------------------------------------*/
+typedef void (*PixelConvertFunc)(uint8_t *dst, const uint8_t *src, int width);
+
+/*- Variables ---------------------------------------------------------------*/
+static PixelConvertFunc bgr_kernel;
+static PixelConvertFunc bgra_kernel;
+static PixelConvertFunc rgba_kernel;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void convert_bgr_scalar(uint8_t *dst, const uint8_t *src, int width)
+{
+  for (int i = 0; i < width; i++)
+  {
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = src[0];
+    dst += 3;
+    src += 4;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void convert_bgra_scalar(uint8_t *dst, const uint8_t *src, int width)
+{
+  for (int i = 0; i < width; i++)
+  {
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = src[0];
+    dst[3] = src[3];
+    dst += 4;
+    src += 4;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void convert_rgba_scalar(uint8_t *dst, const uint8_t *src, int width)
+{
+  for (int i = 0; i < width; i++)
+  {
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = src[0];
+    dst[3] = 0xff;
+    dst += 4;
+    src += 3;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Loads and stores never go past the end of the source or destination row,
+// the tail is handled by the scalar versions. BGR kernels pack each group of
+// 4 pixels into 12 bytes at the bottom of a 128-bit lane and then merge the
+// groups, so that only full width stores are used.
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void convert_bgr_ssse3(uint8_t *dst, const uint8_t *src, int width)
+{
+  __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  int i = 0;
+
+  for (; i <= (width - 16); i += 16)
+  {
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)&src[i * 4]), shuffle);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)&src[i * 4 + 16]), shuffle);
+    __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)&src[i * 4 + 32]), shuffle);
+    __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)&src[i * 4 + 48]), shuffle);
+
+    _mm_storeu_si128((__m128i *)&dst[i * 3], _mm_or_si128(a, _mm_slli_si128(b, 12)));
+    _mm_storeu_si128((__m128i *)&dst[i * 3 + 16], _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+    _mm_storeu_si128((__m128i *)&dst[i * 3 + 32], _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+  }
+
+  convert_bgr_scalar(&dst[i * 3], &src[i * 4], width - i);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void convert_bgra_ssse3(uint8_t *dst, const uint8_t *src, int width)
+{
+  __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int i = 0;
+
+  for (; i <= (width - 4); i += 4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&src[i * 4]);
+
+    _mm_storeu_si128((__m128i *)&dst[i * 4], _mm_shuffle_epi8(v, shuffle));
+  }
+
+  convert_bgra_scalar(&dst[i * 4], &src[i * 4], width - i);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void convert_rgba_ssse3(uint8_t *dst, const uint8_t *src, int width)
+{
+  __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  __m128i alpha = _mm_set1_epi32(0xff000000);
+  int i = 0;
+
+  for (; (i * 3 + 16) <= (width * 3); i += 4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&src[i * 3]);
+
+    _mm_storeu_si128((__m128i *)&dst[i * 4], _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+  }
+
+  convert_rgba_scalar(&dst[i * 4], &src[i * 3], width - i);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("avx2"))) void convert_bgr_avx2(uint8_t *dst, const uint8_t *src, int width)
+{
+  __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                     2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  // Valid dwords are 0-2 and 4-6, permutations move them to their place in
+  // the output vector, blends pick the right source for each dword
+  __m256i pa = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 0, 0);
+  __m256i pb = _mm256_setr_epi32(2, 4, 5, 6, 0, 0, 0, 1);
+  __m256i pc = _mm256_setr_epi32(5, 6, 0, 0, 0, 1, 2, 4);
+  __m256i pd = _mm256_setr_epi32(0, 0, 0, 1, 2, 4, 5, 6);
+  int i = 0;
+
+  for (; i <= (width - 32); i += 32)
+  {
+    __m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)&src[i * 4]), shuffle);
+    __m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)&src[i * 4 + 32]), shuffle);
+    __m256i c = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)&src[i * 4 + 64]), shuffle);
+    __m256i d = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)&src[i * 4 + 96]), shuffle);
+
+    a = _mm256_permutevar8x32_epi32(a, pa);
+    b = _mm256_permutevar8x32_epi32(b, pb);
+    c = _mm256_permutevar8x32_epi32(c, pc);
+    d = _mm256_permutevar8x32_epi32(d, pd);
+
+    _mm256_storeu_si256((__m256i *)&dst[i * 3], _mm256_blend_epi32(a, b, 0xc0));
+    _mm256_storeu_si256((__m256i *)&dst[i * 3 + 32], _mm256_blend_epi32(b, c, 0xf0));
+    _mm256_storeu_si256((__m256i *)&dst[i * 3 + 64], _mm256_blend_epi32(c, d, 0xfc));
+  }
+
+  convert_bgr_ssse3(&dst[i * 3], &src[i * 4], width - i);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("avx2"))) void convert_bgra_avx2(uint8_t *dst, const uint8_t *src, int width)
+{
+  __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                     2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int i = 0;
+
+  for (; i <= (width - 8); i += 8)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i *)&src[i * 4]);
+
+    _mm256_storeu_si256((__m256i *)&dst[i * 4], _mm256_shuffle_epi8(v, shuffle));
+  }
+
+  convert_bgra_scalar(&dst[i * 4], &src[i * 4], width - i);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+static void __attribute__((constructor)) pixel_convert_select_kernels(void)
+{
+  bgr_kernel  = convert_bgr_scalar;
+  bgra_kernel = convert_bgra_scalar;
+  rgba_kernel = convert_rgba_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("ssse3"))
+  {
+    bgr_kernel  = convert_bgr_ssse3;
+    bgra_kernel = convert_bgra_ssse3;
+    rgba_kernel = convert_rgba_ssse3;
+  }
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    bgr_kernel  = convert_bgr_avx2;
+    bgra_kernel = convert_bgra_avx2;
+  }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+void pixel_convert_rgba_to_bgr(uint8_t *dst, const uint8_t *src, int width)
+{
+  bgr_kernel(dst, src, width);
+}
+
+//-----------------------------------------------------------------------------
+void pixel_convert_rgba_to_bgra(uint8_t *dst, const uint8_t *src, int width)
+{
+  bgra_kernel(dst, src, width);
+}
+
+//-----------------------------------------------------------------------------
+void pixel_convert_bgr_to_rgba(uint8_t *dst, const uint8_t *src, int width)
+{
+  rgba_kernel(dst, src, width);
+}
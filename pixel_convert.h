@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PIXEL_CONVERT_H_
+#define _PIXEL_CONVERT_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+
+/*- Prototypes --------------------------------------------------------------*/
+// Convert one row of RGBA pixels. Swapping R and B is its own inverse, so
+// the BGRA conversion also turns BGRA into RGBA. Source and destination must
+// not overlap. The fastest implementation supported by the CPU is selected
+// at startup.
+void pixel_convert_rgba_to_bgr(uint8_t *dst, const uint8_t *src, int width);
+void pixel_convert_rgba_to_bgra(uint8_t *dst, const uint8_t *src, int width);
+
+// Expand BGR pixels to RGBA with opaque alpha
+void pixel_convert_bgr_to_rgba(uint8_t *dst, const uint8_t *src, int width);
+
+#endif // _PIXEL_CONVERT_H_
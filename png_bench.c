@@ -0,0 +1,1094 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "checksum.h"
+#include "deflate.h"
+#include "png_image.h"
+#include "thread_pool.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define IDAT_SIZE          65536
+#define MIN_ITERATIONS     3
+#define MIN_TIME           0.25 // Seconds per image
+#define ATTACK_SIZE        16384 // Compressed data of the block attacks
+
+// Limits for -l, the ratio is above what real images reach
+#define LIMIT_TABLE_BUILDS 64
+#define LIMIT_RATIO        1024
+#define LIMIT_TIME         2.0  // Seconds
+
+enum
+{
+  CONTENT_PHOTO,
+  CONTENT_FLAT,
+};
+
+enum
+{
+  FILTER_NONE,
+  FILTER_SUB,
+  FILTER_UP,
+  FILTER_AVG,
+  FILTER_PAETH,
+  FILTER_ADAPTIVE,
+};
+
+enum
+{
+  BLOCK_STORED,
+  BLOCK_FIXED,
+  BLOCK_DYNAMIC,
+};
+
+enum
+{
+  ATTACK_TABLES,
+  ATTACK_STORED,
+  ATTACK_MATCHES,
+  ATTACK_CHUNKS,
+  ATTACK_COUNT,
+};
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  int      width;
+  int      height;
+  int      type;
+  int      content;
+  int      filter;
+  int      block;
+} BenchImage;
+
+typedef struct
+{
+  double   time;
+  PNGImageStats stats;
+} BenchResult;
+
+typedef struct
+{
+  uint8_t  *data;
+  int      size;
+  uint32_t word;
+  int      bits;
+} BitWriter;
+
+/*- Constants ---------------------------------------------------------------*/
+static const char *content_names[] = { "photo", "flat" };
+static const char *filter_names[] = { "none", "sub", "up", "avg", "paeth", "adaptive" };
+static const char *block_names[] = { "stored", "fixed", "dynamic" };
+static const char *attack_names[] = { "dynamic-tables", "empty-stored", "long-matches", "tiny-chunks" };
+static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+
+// Each filter and block type is covered in isolation on a large image,
+// the rest of the corpus covers the sizes and the content types
+static const BenchImage corpus[] =
+{
+  { 1920, 1080, PNG_IMAGE_TYPE_RGB,  CONTENT_PHOTO, FILTER_NONE,     BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGB,  CONTENT_PHOTO, FILTER_SUB,      BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGB,  CONTENT_PHOTO, FILTER_UP,       BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGB,  CONTENT_PHOTO, FILTER_AVG,      BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGB,  CONTENT_PHOTO, FILTER_PAETH,    BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGB,  CONTENT_PHOTO, FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_NONE,     BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_SUB,      BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_UP,       BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_AVG,      BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_PAETH,    BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_ADAPTIVE, BLOCK_STORED },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_ADAPTIVE, BLOCK_FIXED },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGB,  CONTENT_FLAT,  FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_FLAT,  FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+  { 1920, 1080, PNG_IMAGE_TYPE_RGBA, CONTENT_FLAT,  FILTER_ADAPTIVE, BLOCK_FIXED },
+  {   64,   64, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+  {  256,  256, PNG_IMAGE_TYPE_RGBA, CONTENT_FLAT,  FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+  {  640,  480, PNG_IMAGE_TYPE_RGB,  CONTENT_PHOTO, FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+  { 4096, 2160, PNG_IMAGE_TYPE_RGBA, CONTENT_PHOTO, FILTER_ADAPTIVE, BLOCK_DYNAMIC },
+};
+
+/*- Variables ---------------------------------------------------------------*/
+static uint32_t random_state = 1;
+static double clock_rate = 1.0;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static uint32_t bench_random(void)
+{
+  random_state = random_state * 1103515245 + 12345;
+  return random_state >> 8;
+}
+
+//-----------------------------------------------------------------------------
+static double bench_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//-----------------------------------------------------------------------------
+static void calibrate_clock(void)
+{
+  double start = bench_time();
+  uint64_t ticks = png_image_clock();
+
+  while ((bench_time() - start) < 0.1);
+
+  clock_rate = (png_image_clock() - ticks) / (bench_time() - start);
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t clamp(int value)
+{
+  return (value < 0) ? 0 : (value > 255) ? 255 : value;
+}
+
+//-----------------------------------------------------------------------------
+static void generate_photo(uint8_t *pixels, int width, int height, int channels)
+{
+  // Smooth value noise with a bit of sensor noise on top, which behaves
+  // close enough to a photograph for the filters and the compressor
+  int grid_width = width / 32 + 2;
+  int grid_height = height / 32 + 2;
+  uint8_t *grid = (uint8_t *)malloc(grid_width * grid_height * channels);
+
+  for (int i = 0; i < grid_width * grid_height * channels; i++)
+    grid[i] = bench_random();
+
+  for (int y = 0; y < height; y++)
+  {
+    int gy = y / 32, fy = y % 32;
+
+    for (int x = 0; x < width; x++)
+    {
+      int gx = x / 32, fx = x % 32;
+
+      for (int c = 0; c < channels; c++)
+      {
+        uint8_t *g = &grid[(gy * grid_width + gx) * channels + c];
+        int top = g[0] * (32 - fx) + g[channels] * fx;
+        int bottom = g[grid_width * channels] * (32 - fx) + g[(grid_width + 1) * channels] * fx;
+        int value = (top * (32 - fy) + bottom * fy) >> 10;
+
+        if (3 == c)
+          pixels[(y * width + x) * channels + c] = clamp(value + 64);
+        else
+          pixels[(y * width + x) * channels + c] = clamp(value + (int)(bench_random() % 7) - 3);
+      }
+    }
+  }
+
+  free(grid);
+}
+
+//-----------------------------------------------------------------------------
+static void generate_flat(uint8_t *pixels, int width, int height, int channels)
+{
+  // Rectangles of a few solid colors, like screenshots and UI elements
+  static const uint8_t colors[5][4] =
+  {
+    { 255, 255, 255, 255 }, { 32, 32, 32, 255 }, { 0, 120, 215, 255 },
+    { 240, 240, 240, 0 }, { 200, 60, 40, 128 },
+  };
+
+  for (int y = 0; y < height; y++)
+  {
+    for (int x = 0; x < width; x++)
+    {
+      int index = ((x / 48) * 7 + (y / 40) * 3 + ((x / 48 + y / 40) & 1)) % 5;
+
+      memcpy(&pixels[(y * width + x) * channels], colors[index], channels);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static int paeth_predictor(int a, int b, int c)
+{
+  int pa = abs(b - c);
+  int pb = abs(a - c);
+  int pc = abs(a + b - 2 * c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  else if (pb <= pc)
+    return b;
+
+  return c;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t filter_row(uint8_t *dst, uint8_t *line, uint8_t *prior, int size, int bpp, int filter)
+{
+  uint32_t sum = 0;
+
+  for (int i = 0; i < size; i++)
+  {
+    int a = (i >= bpp) ? line[i - bpp] : 0;
+    int b = prior[i];
+    int c = (i >= bpp) ? prior[i - bpp] : 0;
+    int p = 0;
+
+    if (FILTER_SUB == filter)
+      p = a;
+    else if (FILTER_UP == filter)
+      p = b;
+    else if (FILTER_AVG == filter)
+      p = (a + b) >> 1;
+    else if (FILTER_PAETH == filter)
+      p = paeth_predictor(a, b, c);
+
+    dst[i] = line[i] - p;
+    sum += (dst[i] < 128) ? dst[i] : 256 - dst[i];
+  }
+
+  return sum;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *filter_image(uint8_t *pixels, int width, int height, int bpp, int filter)
+{
+  int line_size = width * bpp;
+  uint8_t *filtered = (uint8_t *)malloc((size_t)height * (line_size + 1));
+  uint8_t *zero = (uint8_t *)calloc(1, line_size);
+
+  for (int y = 0; y < height; y++)
+  {
+    uint8_t *line = &pixels[(size_t)y * line_size];
+    uint8_t *prior = y ? line - line_size : zero;
+    uint8_t *dst = &filtered[(size_t)y * (line_size + 1)];
+    int best = filter;
+
+    // Minimum sum of absolute differences, as in most encoders
+    if (FILTER_ADAPTIVE == filter)
+    {
+      uint32_t best_sum = UINT32_MAX;
+
+      for (int f = FILTER_NONE; f <= FILTER_PAETH; f++)
+      {
+        uint32_t sum = filter_row(&dst[1], line, prior, line_size, bpp, f);
+
+        if (sum < best_sum)
+        {
+          best_sum = sum;
+          best = f;
+        }
+      }
+    }
+
+    dst[0] = best;
+    filter_row(&dst[1], line, prior, line_size, bpp, best);
+  }
+
+  free(zero);
+
+  return filtered;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *put_word(uint8_t *ptr, uint32_t value)
+{
+  ptr[0] = value >> 24;
+  ptr[1] = value >> 16;
+  ptr[2] = value >> 8;
+  ptr[3] = value;
+
+  return ptr + 4;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *put_chunk(uint8_t *ptr, const char *type, const uint8_t *data, int size)
+{
+  uint8_t *start = ptr;
+
+  ptr = put_word(ptr, size);
+  memcpy(ptr, type, 4);
+  ptr += 4;
+
+  if (size)
+    memcpy(ptr, data, size);
+
+  ptr += size;
+
+  return put_word(ptr, checksum_crc32(CHECKSUM_CRC32_INIT, start + 4, size + 4));
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *wrap_png(int width, int height, int type, uint8_t *zlib, int zlib_size,
+    int chunk_size, int *size)
+{
+  uint8_t header[13], *data, *ptr;
+
+  put_word(&header[0], width);
+  put_word(&header[4], height);
+  header[8]  = 8;
+  header[9]  = type;
+  header[10] = 0;
+  header[11] = 0;
+  header[12] = 0;
+
+  data = (uint8_t *)malloc(8 + 25 + zlib_size + (zlib_size / chunk_size + 1) * 12 + 12);
+  memcpy(data, "\x89PNG\r\n\x1a\n", 8);
+  ptr = put_chunk(data + 8, "IHDR", header, sizeof(header));
+
+  for (int i = 0; i < zlib_size; i += chunk_size)
+    ptr = put_chunk(ptr, "IDAT", &zlib[i], (zlib_size - i) < chunk_size ? (zlib_size - i) : chunk_size);
+
+  ptr = put_chunk(ptr, "IEND", NULL, 0);
+  *size = ptr - data;
+
+  return data;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *generate_png(const BenchImage *desc, uint8_t **pixels, int *size)
+{
+  int bpp = (PNG_IMAGE_TYPE_RGBA == desc->type) ? 4 : 3;
+  int raw_size = desc->height * (desc->width * bpp + 1);
+  int level = (BLOCK_STORED == desc->block) ? 0 : 6;
+  int flags = DEFLATE_FINAL | ((BLOCK_FIXED == desc->block) ? DEFLATE_FIXED : 0) |
+      ((BLOCK_DYNAMIC == desc->block) ? DEFLATE_DYNAMIC : 0);
+  uint8_t *filtered, *deflated, *zlib, *data;
+  size_t deflated_size;
+  int zlib_size;
+
+  *pixels = (uint8_t *)malloc((size_t)desc->width * desc->height * bpp);
+
+  if (CONTENT_PHOTO == desc->content)
+    generate_photo(*pixels, desc->width, desc->height, bpp);
+  else
+    generate_flat(*pixels, desc->width, desc->height, bpp);
+
+  filtered = filter_image(*pixels, desc->width, desc->height, bpp, desc->filter);
+  deflated = deflate_compress(filtered, raw_size, 0, level, flags, &deflated_size);
+
+  zlib_size = deflated_size + 6;
+  zlib = (uint8_t *)malloc(zlib_size);
+  zlib[0] = 0x78;
+  zlib[1] = level ? 0x9c : 0x01;
+  memcpy(&zlib[2], deflated, deflated_size);
+  put_word(&zlib[2 + deflated_size], checksum_adler32(CHECKSUM_ADLER32_INIT, filtered, raw_size));
+
+  data = wrap_png(desc->width, desc->height, desc->type, zlib, zlib_size, IDAT_SIZE, size);
+
+  free(filtered);
+  free(deflated);
+  free(zlib);
+
+  return data;
+}
+
+//-----------------------------------------------------------------------------
+static void put_bits(BitWriter *writer, uint32_t value, int bits)
+{
+  writer->word |= value << writer->bits;
+  writer->bits += bits;
+
+  while (writer->bits >= 8)
+  {
+    writer->data[writer->size++] = writer->word;
+    writer->word >>= 8;
+    writer->bits -= 8;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void put_code(BitWriter *writer, uint32_t code, int bits)
+{
+  // Huffman codes are packed starting from the most significant bit
+  for (int i = bits - 1; i >= 0; i--)
+    put_bits(writer, (code >> i) & 1, 1);
+}
+
+//-----------------------------------------------------------------------------
+static void put_stored(BitWriter *writer, const uint8_t *data, int size, bool final)
+{
+  do
+  {
+    int len = (size < 65535) ? size : 65535;
+
+    put_bits(writer, final && len == size, 1);
+    put_bits(writer, 0, 2);
+
+    if (writer->bits)
+      put_bits(writer, 0, 8 - writer->bits);
+
+    put_bits(writer, len, 16);
+    put_bits(writer, len ^ 0xffff, 16);
+
+    if (len)
+      memcpy(&writer->data[writer->size], data, len);
+
+    writer->size += len;
+    data += len;
+    size -= len;
+  } while (size > 0);
+}
+
+//-----------------------------------------------------------------------------
+static void put_empty_dynamic(BitWriter *writer)
+{
+  // Only the end of block and one distance have codes, which is still
+  // enough to make the decoder build all three tables
+  put_bits(writer, 0, 1);
+  put_bits(writer, 2, 2);
+  put_bits(writer, 0, 5);    // 257 literal/length codes
+  put_bits(writer, 0, 5);    // 1 distance code
+  put_bits(writer, 1, 4);    // Code lengths for 16, 17, 18, 0 and 8
+
+  put_bits(writer, 0, 3);
+  put_bits(writer, 0, 3);
+  put_bits(writer, 1, 3);
+  put_bits(writer, 0, 3);
+  put_bits(writer, 1, 3);
+
+  // Code 0 is length 8, code 1 is a run of zeros
+  put_code(writer, 1, 1);
+  put_bits(writer, 138 - 11, 7);
+  put_code(writer, 1, 1);
+  put_bits(writer, 118 - 11, 7);
+  put_code(writer, 0, 1);
+  put_code(writer, 0, 1);
+
+  put_code(writer, 0, 8);    // End of block
+}
+
+//-----------------------------------------------------------------------------
+static void put_zero_matches(BitWriter *writer, int size)
+{
+  // Code lengths for 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14 and 1
+  static const int lengths[18] = { 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 2 };
+
+  // Matches of 258 bytes at the distance of 1 take two bits, which is the
+  // highest ratio deflate can reach
+  put_bits(writer, 1, 1);
+  put_bits(writer, 2, 2);
+  put_bits(writer, 29, 5);   // 286 literal/length codes
+  put_bits(writer, 0, 5);    // 1 distance code
+  put_bits(writer, 14, 4);
+
+  for (int i = 0; i < 18; i++)
+    put_bits(writer, lengths[i], 3);
+
+  // Code 0 is a run of zeros, codes 10 and 11 are lengths 1 and 2
+  put_code(writer, 3, 2);
+  put_code(writer, 0, 1);
+  put_bits(writer, 138 - 11, 7);
+  put_code(writer, 0, 1);
+  put_bits(writer, 117 - 11, 7);
+  put_code(writer, 3, 2);
+  put_code(writer, 0, 1);
+  put_bits(writer, 28 - 11, 7);
+  put_code(writer, 2, 2);
+  put_code(writer, 2, 2);
+
+  // Length 258 is code 0, literal 0 is 10, end of block is 11
+  put_code(writer, 2, 2);
+
+  for (size--; size >= 258; size -= 258)
+    put_bits(writer, 0, 2);
+
+  for (; size > 0; size--)
+    put_code(writer, 2, 2);
+
+  put_code(writer, 3, 2);
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *generate_attack(int attack, int *size)
+{
+  // Images of black gray pixels, the cost is in the way the data is encoded
+  static const int sizes[ATTACK_COUNT] = { 16, 16, 4096, 256 };
+  int width = sizes[attack];
+  int raw_size = width * (width + 1);
+  uint8_t *raw = (uint8_t *)calloc(1, raw_size);
+  BitWriter writer;
+  uint8_t *data;
+
+  writer.data = (uint8_t *)malloc(2 * ATTACK_SIZE + 2 * raw_size + 64);
+  writer.size = 0;
+  writer.word = 0;
+  writer.bits = 0;
+
+  put_bits(&writer, 0x78, 8);
+  put_bits(&writer, 0x01, 8);
+
+  if (ATTACK_TABLES == attack)
+  {
+    while (writer.size < ATTACK_SIZE)
+      put_empty_dynamic(&writer);
+
+    put_stored(&writer, raw, raw_size, true);
+  }
+  else if (ATTACK_STORED == attack)
+  {
+    while (writer.size < ATTACK_SIZE)
+      put_stored(&writer, NULL, 0, false);
+
+    put_stored(&writer, raw, raw_size, true);
+  }
+  else if (ATTACK_MATCHES == attack)
+  {
+    put_zero_matches(&writer, raw_size);
+  }
+  else
+  {
+    put_stored(&writer, raw, raw_size, true);
+  }
+
+  if (writer.bits)
+    put_bits(&writer, 0, 8 - writer.bits);
+
+  put_word(&writer.data[writer.size], checksum_adler32(CHECKSUM_ADLER32_INIT, raw, raw_size));
+  writer.size += 4;
+
+  // The chunk attack puts every byte of the data into its own chunk
+  data = wrap_png(width, width, PNG_IMAGE_TYPE_GRAY, writer.data, writer.size,
+      (ATTACK_CHUNKS == attack) ? 1 : IDAT_SIZE, size);
+
+  free(writer.data);
+  free(raw);
+
+  return data;
+}
+
+//-----------------------------------------------------------------------------
+static bool load_file(char *name, uint8_t **data, int *size)
+{
+  struct stat stat;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  if (fstat(fd, &stat) < 0 || stat.st_size > INT32_MAX)
+  {
+    close(fd);
+    return false;
+  }
+
+  *data = (uint8_t *)malloc(stat.st_size);
+  *size = stat.st_size;
+
+  if (read(fd, *data, *size) != *size)
+  {
+    free(*data);
+    close(fd);
+    return false;
+  }
+
+  close(fd);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool save_file(char *name, uint8_t *data, int size)
+{
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool res;
+
+  if (fd < 0)
+    return false;
+
+  res = (write(fd, data, size) == size);
+  close(fd);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static int run_benchmark(PNGDecoder *decoder, uint8_t *data, int size, int format,
+    uint8_t *expected, BenchResult *best)
+{
+  double start = bench_time();
+  int iterations = 0;
+
+  best->time = -1.0;
+
+  // The fastest run is reported, it is the least affected by the system noise
+  while (iterations < MIN_ITERATIONS || (bench_time() - start) < MIN_TIME)
+  {
+    PNGImageStats stats;
+    PNGImage image;
+    double time;
+    int res;
+
+    memset(&stats, 0, sizeof(stats));
+    decoder->stats = &stats;
+
+    time = bench_time();
+    res = png_decoder_read_as(decoder, &image, data, size, format);
+    time = bench_time() - time;
+
+    if (PNG_IMAGE_SUCCESS != res)
+      return res;
+
+    // Generated images are checked against the source pixels once
+    if (expected && 0 == iterations &&
+        memcmp(image.data, expected, (size_t)image.stride * image.height))
+    {
+      png_image_free(&image);
+      return PNG_IMAGE_ERROR;
+    }
+
+    png_image_free(&image);
+
+    if (best->time < 0 || time < best->time)
+    {
+      best->time  = time;
+      best->stats = stats;
+    }
+
+    iterations++;
+  }
+
+  decoder->stats = NULL;
+
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+static int run_batch(ThreadPool *pool, PNGBatchItem *items, int count, int format, double *best)
+{
+  double start = bench_time();
+  int iterations = 0;
+
+  *best = -1.0;
+
+  while (iterations < MIN_ITERATIONS || (bench_time() - start) < MIN_TIME)
+  {
+    double time;
+    int res;
+
+    for (int i = 0; i < count; i++)
+    {
+      memset(&items[i].image, 0, sizeof(PNGImage));
+      items[i].image.format = format;
+    }
+
+    time = bench_time();
+    res = png_image_read_batch(pool, items, count, NULL, NULL);
+    time = bench_time() - time;
+
+    for (int i = 0; i < count; i++)
+    {
+      if (PNG_IMAGE_SUCCESS == items[i].status)
+        png_image_free(&items[i].image);
+      else if (PNG_IMAGE_SUCCESS == res)
+        res = items[i].status;
+    }
+
+    if (PNG_IMAGE_SUCCESS != res)
+      return res;
+
+    if (*best < 0 || time < *best)
+      *best = time;
+
+    iterations++;
+  }
+
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+static int run_attack(PNGDecoder *decoder, uint8_t *data, int size, int format, BenchResult *best)
+{
+  double start = bench_time();
+  int iterations = 0;
+  int res = PNG_IMAGE_SUCCESS;
+
+  best->time = -1.0;
+
+  // Rejected inputs are timed as well, the time it takes to reject them is
+  // what matters for the limits
+  while (iterations < MIN_ITERATIONS || (bench_time() - start) < MIN_TIME)
+  {
+    PNGImageStats stats;
+    PNGImage image;
+    double time;
+
+    memset(&stats, 0, sizeof(stats));
+    decoder->stats = &stats;
+
+    time = bench_time();
+    res = png_decoder_read_as(decoder, &image, data, size, format);
+    time = bench_time() - time;
+
+    if (PNG_IMAGE_SUCCESS == res)
+      png_image_free(&image);
+
+    if (best->time < 0 || time < best->time)
+    {
+      best->time  = time;
+      best->stats = stats;
+    }
+
+    iterations++;
+  }
+
+  decoder->stats = NULL;
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static void report_attack(FILE *json, const char *name, int size, int res, BenchResult *result)
+{
+  PNGImageStats *stats = &result->stats;
+  double ns = result->time * 1e9 / size;
+
+  printf("%-40s %8d bytes %10.3f ms %10.1f ns/byte | tables %llu, inflated %llu, result %d\n",
+      name, size, result->time * 1e3, ns, (unsigned long long)stats->table_builds,
+      (unsigned long long)stats->inflated, res);
+
+  if (json)
+  {
+    fprintf(json, "{\"name\": \"%s\", \"file_size\": %d, \"time_ms\": %.6f, \"ns_per_byte\": %.3f, "
+        "\"table_builds\": %llu, \"inflated\": %llu, \"result\": %d}\n", name, size,
+        result->time * 1e3, ns, (unsigned long long)stats->table_builds,
+        (unsigned long long)stats->inflated, res);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void report(FILE *json, const char *name, uint8_t *data, int size, BenchResult *result)
+{
+  PNGImageStats *stats = &result->stats;
+  PNGImageInfo info;
+  double raw, mpix, parse, inflate, defilter, convert, match_length;
+
+  png_image_info(&info, data, size);
+
+  // Throughput is measured against the size of the decompressed data
+  raw      = (double)info.height * (((uint64_t)info.width * info.depth * channels[info.type] + 7) / 8 + 1) / 1e6;
+  mpix     = (double)info.width * info.height / 1e6;
+  parse    = result->stats.parse / clock_rate;
+  inflate  = result->stats.inflate / clock_rate;
+  defilter = result->stats.defilter / clock_rate;
+  convert  = result->stats.convert / clock_rate;
+  match_length = stats->matches ? (double)stats->match_bytes / stats->matches : 0.0;
+
+  printf("%-40s %8.3f ms %8.1f MB/s %8.1f MP/s | parse %6.3f ms  inflate %7.1f MB/s  "
+      "defilter %7.1f MB/s  convert %7.1f MP/s\n", name, result->time * 1e3,
+      raw / result->time, mpix / result->time, parse * 1e3, raw / inflate, raw / defilter,
+      mpix / convert);
+
+  printf("%-40s blocks %llu/%llu/%llu, literals %llu, matches %llu (%.1f bytes), "
+      "filters %llu/%llu/%llu/%llu/%llu\n", "",
+      (unsigned long long)stats->stored_blocks, (unsigned long long)stats->fixed_blocks,
+      (unsigned long long)stats->dynamic_blocks, (unsigned long long)stats->literals,
+      (unsigned long long)stats->matches, match_length,
+      (unsigned long long)stats->filters[0], (unsigned long long)stats->filters[1],
+      (unsigned long long)stats->filters[2], (unsigned long long)stats->filters[3],
+      (unsigned long long)stats->filters[4]);
+
+  if (json)
+  {
+    fprintf(json, "{\"name\": \"%s\", \"width\": %d, \"height\": %d, \"file_size\": %d, "
+        "\"raw_mb\": %.6f, \"time_ms\": %.6f, \"mb_per_s\": %.3f, \"mpix_per_s\": %.3f, "
+        "\"parse_ms\": %.6f, \"inflate_ms\": %.6f, \"defilter_ms\": %.6f, \"convert_ms\": %.6f, ",
+        name, info.width, info.height, size, raw, result->time * 1e3, raw / result->time,
+        mpix / result->time, parse * 1e3, inflate * 1e3, defilter * 1e3, convert * 1e3);
+
+    fprintf(json, "\"stored_blocks\": %llu, \"fixed_blocks\": %llu, \"dynamic_blocks\": %llu, "
+        "\"table_builds\": %llu, \"literals\": %llu, \"matches\": %llu, \"match_length\": %.3f, "
+        "\"inflated\": %llu, \"filters\": [%llu, %llu, %llu, %llu, %llu]}\n",
+        (unsigned long long)stats->stored_blocks, (unsigned long long)stats->fixed_blocks,
+        (unsigned long long)stats->dynamic_blocks, (unsigned long long)stats->table_builds,
+        (unsigned long long)stats->literals, (unsigned long long)stats->matches, match_length,
+        (unsigned long long)stats->inflated, (unsigned long long)stats->filters[0],
+        (unsigned long long)stats->filters[1], (unsigned long long)stats->filters[2],
+        (unsigned long long)stats->filters[3], (unsigned long long)stats->filters[4]);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void report_batch(FILE *json, PNGBatchItem *items, int count, double time)
+{
+  double raw = 0.0, mpix = 0.0;
+
+  for (int i = 0; i < count; i++)
+  {
+    PNGImageInfo info;
+
+    png_image_info(&info, items[i].data, items[i].size);
+    raw  += (double)info.height * (((uint64_t)info.width * info.depth * channels[info.type] + 7) / 8 + 1) / 1e6;
+    mpix += (double)info.width * info.height / 1e6;
+  }
+
+  printf("%-40s %8.3f ms %8.1f MB/s %8.1f MP/s | %d images\n", "batch", time * 1e3,
+      raw / time, mpix / time, count);
+
+  if (json)
+  {
+    fprintf(json, "{\"name\": \"batch\", \"images\": %d, \"raw_mb\": %.6f, \"time_ms\": %.6f, "
+        "\"mb_per_s\": %.3f, \"mpix_per_s\": %.3f}\n", count, raw, time * 1e3, raw / time, mpix / time);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void usage(char *name)
+{
+  printf("Usage: %s [options] [file.png ...]\n", name);
+  printf("  -a         decode generated adversarial inputs instead\n");
+  printf("  -b         decode all images at once with png_image_read_batch()\n");
+  printf("  -f format  output format: rgba, bgra, rgb or native (default rgba)\n");
+  printf("  -j file    write results as JSON lines\n");
+  printf("  -l         decode with the work limits for untrusted images\n");
+  printf("  -t count   decode with a pool of worker threads (default none)\n");
+  printf("  -w dir     save the generated corpus\n");
+  printf("Without files, a synthetic corpus is generated and decoded.\n");
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+  static const char *format_names[] = { "rgba", "bgra", "rgb", "premultiplied", "native" };
+  char *json_name = NULL, *corpus_dir = NULL;
+  int format = PNG_IMAGE_FORMAT_RGBA;
+  ThreadPool *pool = NULL;
+  PNGDecoder decoder;
+  FILE *json = NULL;
+  PNGBatchItem *items = NULL;
+  int opt, threads = 0, errors = 0, count = 0;
+  bool attacks = false, batch = false, limits = false;
+
+  while (-1 != (opt = getopt(argc, argv, "abf:j:lt:w:h")))
+  {
+    if ('a' == opt)
+    {
+      attacks = true;
+    }
+    else if ('b' == opt)
+    {
+      batch = true;
+    }
+    else if ('f' == opt)
+    {
+      for (format = 0; format < PNG_IMAGE_FORMAT_COUNT; format++)
+      {
+        if (0 == strcmp(optarg, format_names[format]))
+          break;
+      }
+    }
+    else if ('j' == opt)
+    {
+      json_name = optarg;
+    }
+    else if ('l' == opt)
+    {
+      limits = true;
+    }
+    else if ('t' == opt)
+    {
+      threads = atoi(optarg);
+    }
+    else if ('w' == opt)
+    {
+      corpus_dir = optarg;
+    }
+    else
+    {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
+  if (format >= PNG_IMAGE_FORMAT_COUNT)
+  {
+    printf("Error: unknown format\n");
+    return 1;
+  }
+
+  if (json_name)
+  {
+    json = fopen(json_name, "w");
+
+    if (!json)
+    {
+      printf("Error: can't open %s\n", json_name);
+      return 1;
+    }
+  }
+
+  // Batch mode keeps all inputs in memory and decodes them in one call,
+  // which is how a pool is shared between images rather than within one
+  if (batch)
+    items = (PNGBatchItem *)calloc(argc + sizeof(corpus) / sizeof(corpus[0]), sizeof(PNGBatchItem));
+
+  if (threads > 0)
+  {
+    pool = thread_pool_create(threads);
+
+    if (!pool)
+    {
+      printf("Error: can't create the thread pool\n");
+      return 1;
+    }
+  }
+
+  calibrate_clock();
+  png_decoder_init(&decoder, NULL);
+  decoder.pool = pool;
+
+  if (limits)
+  {
+    decoder.limits.table_builds = LIMIT_TABLE_BUILDS;
+    decoder.limits.ratio        = LIMIT_RATIO;
+    decoder.limits.cycles       = LIMIT_TIME * clock_rate;
+  }
+
+  if (attacks)
+  {
+    double worst = 0.0;
+    int worst_index = 0;
+
+    // The cost of an input is its decode time per byte, the worst one bounds
+    // the time a decoder can be kept busy by a given amount of data
+    for (int i = 0; i < ATTACK_COUNT; i++)
+    {
+      BenchResult result;
+      uint8_t *data;
+      int size, res;
+
+      data = generate_attack(i, &size);
+      res = run_attack(&decoder, data, size, format, &result);
+      report_attack(json, attack_names[i], size, res, &result);
+
+      if (result.time / size > worst)
+      {
+        worst = result.time / size;
+        worst_index = i;
+      }
+
+      free(data);
+    }
+
+    printf("Worst case: %.1f ns/byte (%s)\n", worst * 1e9, attack_names[worst_index]);
+  }
+  else if (optind < argc)
+  {
+    for (int i = optind; i < argc; i++)
+    {
+      BenchResult result;
+      uint8_t *data;
+      int size, res;
+
+      if (!load_file(argv[i], &data, &size))
+      {
+        printf("%s: can't read the file\n", argv[i]);
+        errors++;
+        continue;
+      }
+
+      if (batch)
+      {
+        items[count].data = data;
+        items[count++].size = size;
+        continue;
+      }
+
+      res = run_benchmark(&decoder, data, size, format, NULL, &result);
+
+      if (PNG_IMAGE_SUCCESS == res)
+        report(json, argv[i], data, size, &result);
+      else
+        printf("%s: error %d\n", argv[i], res);
+
+      errors += (PNG_IMAGE_SUCCESS != res);
+      free(data);
+    }
+  }
+  else
+  {
+    for (int i = 0; i < (int)(sizeof(corpus) / sizeof(corpus[0])); i++)
+    {
+      const BenchImage *desc = &corpus[i];
+      bool check = (PNG_IMAGE_FORMAT_RGBA == format && PNG_IMAGE_TYPE_RGBA == desc->type) ||
+          ((PNG_IMAGE_FORMAT_RGB == format || PNG_IMAGE_FORMAT_NATIVE == format) &&
+          PNG_IMAGE_TYPE_RGB == desc->type);
+      BenchResult result;
+      uint8_t *data, *pixels;
+      char name[256];
+      int size, res;
+
+      snprintf(name, sizeof(name), "%dx%d-%s-%s-%s-%s", desc->width, desc->height,
+          (PNG_IMAGE_TYPE_RGBA == desc->type) ? "rgba" : "rgb", content_names[desc->content],
+          filter_names[desc->filter], block_names[desc->block]);
+
+      random_state = i + 1;
+      data = generate_png(desc, &pixels, &size);
+
+      if (corpus_dir)
+      {
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/%s.png", corpus_dir, name);
+
+        if (!save_file(path, data, size))
+          printf("%s: can't save the file\n", path);
+      }
+
+      if (batch)
+      {
+        items[count].data = data;
+        items[count++].size = size;
+        free(pixels);
+        continue;
+      }
+
+      res = run_benchmark(&decoder, data, size, format, check ? pixels : NULL, &result);
+
+      if (PNG_IMAGE_SUCCESS == res)
+        report(json, name, data, size, &result);
+      else
+        printf("%s: error %d\n", name, res);
+
+      errors += (PNG_IMAGE_SUCCESS != res);
+      free(pixels);
+      free(data);
+    }
+  }
+
+  if (count)
+  {
+    double time;
+    int res = run_batch(pool, items, count, format, &time);
+
+    if (PNG_IMAGE_SUCCESS == res)
+      report_batch(json, items, count, time);
+    else
+      printf("batch: error %d\n", res);
+
+    errors += (PNG_IMAGE_SUCCESS != res);
+
+    for (int i = 0; i < count; i++)
+      free(items[i].data);
+  }
+
+  free(items);
+  png_decoder_free(&decoder);
+
+  if (pool)
+    thread_pool_destroy(pool);
+
+  if (json)
+    fclose(json);
+
+  return errors ? 1 : 0;
+}
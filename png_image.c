@@ -27,11 +27,24 @@
  */
 
 /*- Includes ----------------------------------------------------------------*/
+#define _POSIX_C_SOURCE 200809L // posix_madvise()
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "thread_pool.h"
+#include "checksum.h"
+#include "pixel_convert.h"
 #include "png_image.h"
 
 /*- Definitions -------------------------------------------------------------*/
@@ -41,39 +54,252 @@
 #define PNG_IHDR       0x52444849
 #define PNG_IDAT       0x54414449
 #define PNG_IEND       0x444e4549
-
-#define PNG_TYPE_RGB   2
-#define PNG_TYPE_RGBA  6
+#define PNG_IDOT       0x544f4469
+#define PNG_PLTE       0x45544c50
+#define PNG_TRNS       0x534e5274
+#define PNG_ACTL       0x4c546361
+#define PNG_FCTL       0x4c546366
+#define PNG_FDAT       0x54416466
 
 #define FIXED_HLIT     288
 #define FIXED_HDIST    32
 #define MAX_LENGTH     15
+#define MAX_MATCH      258
+#define INVALID_SYMBOL 0xfff // Table entries not covered by an incomplete code
+#define ROOT_BITS      9
+#define ROOT_SIZE      (1 << ROOT_BITS)
+#define TABLE_SIZE     1024 // Root table and at most 414 subtable entries
+#define TABLE_BUILD_BYTES 64 // Compressed data that earns one more table build
+
+#define WINDOW_SIZE    32768
+#define WINDOW_MASK    (WINDOW_SIZE - 1)
+
+#define FILE_READ_SIZE 65536
+
+#define DEFLATE_RAW        (1 << 0) // No zlib header
+#define DEFLATE_PARTIAL    (1 << 1) // May end on a block boundary without a final block
+#define DEFLATE_FDAT       (1 << 2) // Data is in APNG frame data chunks
+
+#define PNG_MAX_SEGMENTS   2
+
+#define PNG_PIPELINE_WORKERS  2
+#define PNG_PIPELINE_MIN_SIZE (256 * 1024) // Smaller images are not worth the hand-off
+#define PNG_PIPELINE_RING     (512 * 1024)
 
 /*- Types -------------------------------------------------------------------*/
 typedef struct
 {
   uint8_t  *data;
-  int      size;
+  size_t   size;
   bool     error;
 } ByteStream;
 
 typedef struct
 {
   uint8_t  *data;
-  int      size;
+  size_t   size;
+  uint8_t  *next;
+  uint8_t  *end;
+  uint32_t type;
+  size_t   loaded;
   int      bits;
   uint32_t word;
   bool     error;
 } BitStream;
 
+typedef bool (*OutputCallback)(void *ctx, uint8_t *data, size_t size);
+typedef void (*DefilterFunc)(uint8_t *line, uint8_t *prior, int size, int bpp);
+typedef void (*ConvertFunc)(uint8_t *dst, uint8_t *src, int width);
+typedef void (*PlanarFunc)(const PNGTensor *tensor, uint8_t *dst, uint8_t *src, int width);
+typedef struct RowDecoder RowDecoder;
+typedef void (*UnpackFunc)(RowDecoder *dec, uint8_t *dst, uint8_t *src, int width);
+
+// Adler-32 of the decompressed data and the one stored after the final block
+typedef struct
+{
+  uint32_t adler;
+  uint32_t trailer;
+  bool     final;
+} InflateChecksum;
+
 typedef struct
 {
   uint8_t  *data;
-  int      size;
   int      ptr;
+  int      pending;
+  size_t   total;
+  InflateChecksum *checksum;
+  PNGImageStats *stats;
+  size_t   limit;
+  uint64_t deadline;
+  uint64_t table_builds;
+  uint64_t max_table_builds;
+  bool     limit_error;
+  OutputCallback callback;
+  void     *ctx;
 } OutputBuffer;
 
+typedef struct
+{
+  PNGBandCallback callback;
+  void     *ctx;
+  int      height;
+} BandSink;
+
+struct RowDecoder
+{
+  PNGImage *image;
+  ConvertFunc convert;
+  UnpackFunc unpack;
+  int      type;
+  int      depth;
+  int      bits;
+  int      bpp;
+  int      pixel_size;
+  int      line_size;
+  int      pass;
+  int      last_pass;
+  int      width;
+  int      height;
+  int      src_width;
+  int      src_height;
+  int      crop_x;
+  int      crop_y;
+  int      crop_width;
+  int      crop_height;
+  int      scale;
+  int      sample_size;
+  int      row;
+  int      ptr;
+  uint8_t  *line;
+  uint8_t  *prior;
+  uint8_t  *pixels;
+  uint8_t  *rgba;
+  uint8_t  *packed;
+  uint32_t *sums;
+  bool     filter_error;
+  bool     subsample;
+  bool     partial;
+  bool     replicate;
+  PNGProgressCallback progress;
+  void     *progress_ctx;
+  PNGImageStats *stats;
+  const BandSink *sink;
+  int      band_y;
+  bool     sink_error;
+};
+
+typedef struct
+{
+  uint8_t  *data;
+  uint8_t  *end;
+  int      first_row;
+  int      rows;
+} InflateSegment;
+
+// Scratch memory and the state of the current decode, kept between decodes.
+// Contexts of the segments decompressed by the pool are kept here as well.
+typedef struct PNGDecoderState
+{
+  uint8_t  *window;
+  uint16_t *lit_table;
+  uint16_t *dist_table;
+  bool     fixed_tables;
+  uint8_t  *lines;
+  size_t   lines_size;
+  uint8_t  *pipeline;
+  size_t   pipeline_size;
+  uint64_t deadline;
+  bool     limit_error;
+  PNGDecoder segments[PNG_MAX_SEGMENTS - 1];
+} PNGDecoderState;
+
+typedef struct
+{
+  PNGDecoder *decoder;
+  uint8_t  *data;
+  uint8_t  *end;
+  bool     last;
+  uint8_t  *buf;
+  size_t   size;
+  size_t   ptr;
+  bool     res;
+  InflateChecksum checksum;
+  bool     verify;
+  PNGImageStats stats;
+} SegmentTask;
+
+// Inflated rows are passed from the inflating thread to the workers through
+// a ring of scanlines. A worker claims a run of rows starting at a row that
+// doesn't depend on the previous one, or a row whose previous row is done.
+// Workers return when there is nothing to claim and are submitted again as
+// new rows arrive, so they never hold a pool thread while the data inflates.
+typedef struct
+{
+  RowDecoder *dec;
+  struct ThreadPool *pool;
+  ThreadPoolGroup *group;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint8_t  *ring;
+  uint8_t  *zero;
+  uint8_t  *done;
+  uint8_t  *scratch;
+  size_t   scratch_size;
+  int      active;
+  uint32_t free_scratch;
+  int      slots;
+  int      row_size;
+  int      height;
+  int      ptr;
+  int      written;
+  int      limit;
+  int      ready;
+  int      claim;
+  int      completed;
+  int      sleeping;
+  uint64_t defilter;
+  uint64_t convert;
+} RowPipeline;
+
+typedef struct BatchDecoder
+{
+  PNGDecoder decoder;
+  struct BatchDecoder *next;
+} BatchDecoder;
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  BatchDecoder *decoders;
+  struct ThreadPool *pool;
+  PNGBatchCallback callback;
+  void     *ctx;
+} BatchContext;
+
+typedef struct
+{
+  BatchContext *batch;
+  PNGBatchItem *item;
+} BatchTask;
+
 /*- Constants ---------------------------------------------------------------*/
+static const int png_channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+
+// Pass 0 is a non-interlaced image, passes 1-7 are Adam7 passes.
+// Columns are: x offset, y offset, x step, y step, block width, block height.
+static const uint8_t adam7_passes[8][6] =
+{
+  { 0, 0, 1, 1, 1, 1 },
+  { 0, 0, 8, 8, 8, 8 },
+  { 4, 0, 8, 8, 4, 8 },
+  { 0, 4, 4, 8, 4, 4 },
+  { 2, 0, 4, 4, 2, 4 },
+  { 0, 2, 2, 4, 2, 2 },
+  { 1, 0, 2, 2, 1, 2 },
+  { 0, 1, 1, 2, 1, 1 },
+};
+
 static const int length_index_map[19] =
 {
   16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
@@ -127,18 +353,75 @@ static const int fixed_lengths[FIXED_HLIT + FIXED_HDIST] =
   5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5 // 32
 };
 
+/*- Variables ---------------------------------------------------------------*/
+// Defilter kernels for generic, 3 and 4 byte pixels indexed by the filter type
+static DefilterFunc defilter_kernels[3][5];
+
+// Conversion kernels for RGB and RGBA sources indexed by the output format
+static ConvertFunc convert_kernels[2][PNG_IMAGE_FORMAT_COUNT];
+
+// Kernels that split RGBA rows into 8-bit and float planes
+static PlanarFunc planar_kernels[2];
+
+// Rows are only pipelined if the workers can run next to the inflating thread
+static int online_cpus = 1;
+
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
-static void bit_stream_init(BitStream *stream, uint8_t *data, int size)
+static inline bool png_size_mul(size_t a, size_t b, size_t *res)
+{
+  return !__builtin_mul_overflow(a, b, res);
+}
+
+//-----------------------------------------------------------------------------
+static void bit_stream_init(BitStream *stream, uint8_t *data, uint8_t *end)
 {
   stream->data  = data;
-  stream->size  = size;
+  stream->size  = 0;
+  stream->next  = data;
+  stream->end   = end;
+  stream->type  = PNG_IDAT;
+  stream->loaded = 0;
   stream->bits  = 0;
   stream->word  = 0;
   stream->error = false;
 }
 
+//-----------------------------------------------------------------------------
+static bool bit_stream_next_chunk(BitStream *stream)
+{
+  // The compressed data is read in place directly from the IDAT chunks,
+  // moving over the chunk headers and CRCs when the current chunk is exhausted
+  while (0 == stream->size)
+  {
+    uint8_t *next = stream->next;
+    uint32_t ch_len, ch_type, skip;
+
+    if ((stream->end - next) < 12)
+      return false;
+
+    ch_len  = ((uint32_t)next[0] << 24) | ((uint32_t)next[1] << 16) | ((uint32_t)next[2] << 8) | next[3];
+    ch_type = ((uint32_t)next[7] << 24) | ((uint32_t)next[6] << 16) | ((uint32_t)next[5] << 8) | next[4];
+
+    if (stream->type != ch_type || ch_len > (uint32_t)(stream->end - next - 12))
+      return false;
+
+    // Frame data chunks start with a sequence number
+    skip = (PNG_FDAT == ch_type) ? 4 : 0;
+
+    if (ch_len < skip)
+      return false;
+
+    stream->data = next + 8 + skip;
+    stream->size = ch_len - skip;
+    stream->next = next + 12 + ch_len;
+    stream->loaded += stream->size;
+  }
+
+  return true;
+}
+
 //-----------------------------------------------------------------------------
 static uint32_t bit_stream_peek(BitStream *stream, int bits)
 {
@@ -146,7 +429,7 @@ static uint32_t bit_stream_peek(BitStream *stream, int bits)
 
   while (bits > stream->bits)
   {
-    if (stream->size > 0)
+    if (stream->size > 0 || bit_stream_next_chunk(stream))
     {
       uint32_t byte = stream->data[0];
 
@@ -173,6 +456,10 @@ static uint32_t bit_stream_bits(BitStream *stream, int bits)
 {
   uint32_t res = bit_stream_peek(stream, bits);
 
+  // Bits past the end of the data are never consumed
+  if (stream->error)
+    return 0;
+
   stream->word >>= bits;
   stream->bits -= bits;
 
@@ -180,30 +467,45 @@ static uint32_t bit_stream_bits(BitStream *stream, int bits)
 }
 
 //-----------------------------------------------------------------------------
-static inline bool bit_stream_empty(BitStream *stream)
+static bool bit_stream_end(BitStream *stream)
 {
-  return (0 == stream->size && 0 == stream->bits);
+  // Only the padding bits of the last byte are left
+  return stream->bits < 8 && 0 == stream->size && !bit_stream_next_chunk(stream);
 }
 
 //-----------------------------------------------------------------------------
-static void bit_stream_buf(BitStream *stream, uint8_t *buf, int size)
+static void bit_stream_buf(BitStream *stream, uint8_t *buf, size_t size)
 {
   // We expect the stream to be aligned on a byte boundary
   // and have no data in the bit buffer
-  if (stream->bits > 0 || stream->size < size)
+  if (stream->bits > 0)
   {
     stream->error = true;
+    return;
   }
-  else
+
+  while (size > 0)
   {
-    memcpy(buf, stream->data, size);
-    stream->data += size;
-    stream->size -= size;
+    size_t len;
+
+    if (0 == stream->size && !bit_stream_next_chunk(stream))
+    {
+      stream->error = true;
+      return;
+    }
+
+    len = (size < stream->size) ? size : stream->size;
+
+    memcpy(buf, stream->data, len);
+    stream->data += len;
+    stream->size -= len;
+    buf += len;
+    size -= len;
   }
 }
 
 //-----------------------------------------------------------------------------
-static void byte_stream_init(ByteStream *stream, uint8_t *data, int size)
+static void byte_stream_init(ByteStream *stream, uint8_t *data, size_t size)
 {
   stream->data  = data;
   stream->size  = size;
@@ -211,7 +513,7 @@ static void byte_stream_init(ByteStream *stream, uint8_t *data, int size)
 }
 
 //-----------------------------------------------------------------------------
-static void byte_stream_buf(ByteStream *stream, uint8_t *buf, int size)
+static void byte_stream_buf(ByteStream *stream, uint8_t *buf, size_t size)
 {
   if (stream->size < size)
   {
@@ -232,7 +534,7 @@ static uint8_t byte_stream_byte(ByteStream *stream)
 {
   uint8_t res = 0;
 
-  if (stream->size < (int)sizeof(uint8_t))
+  if (stream->size < sizeof(uint8_t))
   {
     stream->error = true;
   }
@@ -251,7 +553,7 @@ static uint32_t byte_stream_word(ByteStream *stream)
 {
   uint32_t res = 0;
 
-  if (stream->size < (int)sizeof(uint32_t))
+  if (stream->size < sizeof(uint32_t))
   {
     stream->error = true;
   }
@@ -266,12 +568,31 @@ static uint32_t byte_stream_word(ByteStream *stream)
   return res;
 }
 
+//-----------------------------------------------------------------------------
+static uint16_t byte_stream_word16_be(ByteStream *stream)
+{
+  uint16_t res = 0;
+
+  if (stream->size < sizeof(uint16_t))
+  {
+    stream->error = true;
+  }
+  else
+  {
+    res = (stream->data[0] << 8) | stream->data[1];
+    stream->data += sizeof(uint16_t);
+    stream->size -= sizeof(uint16_t);
+  }
+
+  return res;
+}
+
 //-----------------------------------------------------------------------------
 static uint32_t byte_stream_word_be(ByteStream *stream)
 {
   uint32_t res = 0;
 
-  if (stream->size < (int)sizeof(uint32_t))
+  if (stream->size < sizeof(uint32_t))
   {
     stream->error = true;
   }
@@ -287,54 +608,129 @@ static uint32_t byte_stream_word_be(ByteStream *stream)
 }
 
 //-----------------------------------------------------------------------------
-static void build_huffman_table(uint16_t *table, const int bit_length[], int size)
+static bool build_huffman_table(uint16_t *table, const int bit_length[], int size)
 {
+  uint16_t order[FIXED_HLIT + FIXED_HDIST], rev[FIXED_HLIT + FIXED_HDIST];
   int bl_count[MAX_LENGTH+1];
-  int next_code[MAX_LENGTH+1];
-  int code = 0;
+  int offset[MAX_LENGTH+1];
+  int count = 0, code = 0, len = 0, next = ROOT_SIZE, root = -1, base = 0;
+  int left = 1;
 
-  for (int i = 0; i < MAX_LENGTH; i++)
-    bl_count[i] = next_code[i] = 0;
+  for (int i = 0; i <= MAX_LENGTH; i++)
+    bl_count[i] = 0;
 
   for (int i = 0; i < size; i++)
     bl_count[bit_length[i]]++;
 
-  for (int i = 0; i < MAX_LENGTH; i++)
+  // Over-subscribed codes are invalid. Entries not covered by an incomplete
+  // code would keep the values from the previous table.
+  for (int i = 1; i <= MAX_LENGTH; i++)
+  {
+    left = (left << 1) - bl_count[i];
+
+    if (left < 0)
+      return false;
+  }
+
+  if (left > 0)
   {
-    code = (code + bl_count[i]) << 1;
-    next_code[i+1] = code;
+    for (int i = 0; i < ROOT_SIZE; i++)
+      table[i] = INVALID_SYMBOL;
+  }
+
+  // Symbols in the canonical order, by code length and then by value
+  for (int i = 1; i <= MAX_LENGTH; i++)
+  {
+    offset[i] = count;
+    count += bl_count[i];
   }
 
   for (int i = 0; i < size; i++)
   {
-    int len = bit_length[i];
-    int spare = 1 << (MAX_LENGTH - len);
-    int value = (len << 12) | i;
-    int rev = 0;
+    if (bit_length[i])
+      order[offset[bit_length[i]]++] = i;
+  }
+
+  for (int n = 0; n < count; n++)
+  {
+    int r = 0;
+
+    code <<= bit_length[order[n]] - len;
+    len = bit_length[order[n]];
+
+    for (int j = 0, c = code; j < len; j++, c >>= 1)
+      r = (r << 1) | (c & 1);
+
+    rev[n] = r;
+    code++;
+  }
+
+  // Short codes are replicated over the root table. Longer codes sharing
+  // the same root bits follow each other in the canonical order, they go to
+  // a subtable sized by the longest of them. This keeps the work per build
+  // proportional to the number of codes rather than to the longest code.
+  for (int n = 0; n < count; n++)
+  {
+    int sym = order[n];
+    int value;
+
+    len   = bit_length[sym];
+    value = (len << 12) | sym;
+
+    if (len <= ROOT_BITS)
+    {
+      for (int j = rev[n]; j < ROOT_SIZE; j += 1 << len)
+        table[j] = value;
 
-    if (len == 0)
       continue;
+    }
 
-    code = next_code[len];
-    next_code[len]++;
+    if ((rev[n] & (ROOT_SIZE - 1)) != root)
+    {
+      int last = n;
+      int bits;
+
+      root = rev[n] & (ROOT_SIZE - 1);
+
+      while ((last + 1) < count && (rev[last + 1] & (ROOT_SIZE - 1)) == root)
+        last++;
+
+      bits = bit_length[order[last]] - ROOT_BITS;
+      base = next;
+      next += 1 << bits;
+      table[root] = ((ROOT_BITS + bits) << 12) | base;
 
-    for (int j = 0; j < len; j++, code >>= 1)
-      rev = (rev << 1) | (code & 1);
+      if (left > 0)
+      {
+        for (int j = 0; j < (1 << bits); j++)
+          table[base + j] = INVALID_SYMBOL;
+      }
+    }
 
-    for (int j = 0; j < spare; j++)
-      table[(j << len) | rev] = value;
+    for (int j = rev[n] >> ROOT_BITS; j < (next - base); j += 1 << (len - ROOT_BITS))
+      table[base + j] = value;
   }
+
+  return true;
 }
 
 //-----------------------------------------------------------------------------
 static int get_symbol(BitStream *stream, uint16_t *table)
 {
-  int index = bit_stream_peek(stream, 15);
-  int len = table[index] >> 12;
+  int index = bit_stream_peek(stream, MAX_LENGTH);
+  int entry = table[index & (ROOT_SIZE - 1)];
+  int len = entry >> 12;
+
+  // Root entries with a length above the root bits link to a subtable
+  if (len > ROOT_BITS)
+  {
+    entry = table[(entry & 0xfff) + ((index & ((1 << len) - 1)) >> ROOT_BITS)];
+    len = entry >> 12;
+  }
 
   bit_stream_bits(stream, len);
 
-  return table[index] & 0xfff;
+  return entry & 0xfff;
 }
 
 //-----------------------------------------------------------------------------
@@ -355,12 +751,16 @@ static bool prepare_dynamic_tables(BitStream *stream, uint16_t *lit_table, uint1
   for (int i = 0; i < hclen; i++)
     length[length_index_map[i]] = bit_stream_bits(stream, 3);
 
-  build_huffman_table(lit_table, length, 19);
+  if (!build_huffman_table(lit_table, length, 19))
+    return false;
 
   while (index < (hlit + hdist))
   {
     int sym = get_symbol(stream, lit_table);
 
+    if (stream->error)
+      return false;
+
     if (sym < 16)
     {
       alphabet[index++] = sym;
@@ -388,8 +788,7 @@ static bool prepare_dynamic_tables(BitStream *stream, uint16_t *lit_table, uint1
       }
       else
       {
-        // Should never happen due to the way Huffman table is built
-        assert(false);
+        return false;
       }
 
       if ((index + repeat_count) > (hlit + hdist))
@@ -406,8 +805,85 @@ static bool prepare_dynamic_tables(BitStream *stream, uint16_t *lit_table, uint1
   if (alphabet[256] == 0)
     return false; // Must be at least one End-Of-Block symbol
 
-  build_huffman_table(lit_table, alphabet, hlit);
-  build_huffman_table(dist_table, &alphabet[hlit], hdist);
+  return build_huffman_table(lit_table, alphabet, hlit) &&
+      build_huffman_table(dist_table, &alphabet[hlit], hdist);
+}
+
+//-----------------------------------------------------------------------------
+static bool output_write(OutputBuffer *buf, uint8_t *data, size_t size)
+{
+  // The checksum is updated while the data is still in the cache
+  if (buf->checksum)
+    buf->checksum->adler = checksum_adler32(buf->checksum->adler, data, size);
+
+  return buf->callback(buf->ctx, data, size);
+}
+
+//-----------------------------------------------------------------------------
+static bool output_check_limits(OutputBuffer *buf)
+{
+  // Limits are checked once per block and window flush, which bounds the
+  // work done past a limit
+  if (buf->total > buf->limit || (buf->deadline && png_image_clock() > buf->deadline))
+    buf->limit_error = true;
+
+  return !buf->limit_error;
+}
+
+//-----------------------------------------------------------------------------
+static bool output_count_tables(OutputBuffer *buf, BitStream *stream, int count)
+{
+  // The budget grows with the compressed data read so far, so large images
+  // with many blocks pass, while headers packed into a few bytes don't
+  uint64_t budget = buf->max_table_builds + (stream->loaded - stream->size) / TABLE_BUILD_BYTES;
+
+  buf->table_builds += count;
+
+  if (buf->stats)
+    buf->stats->table_builds += count;
+
+  if (buf->max_table_builds && buf->table_builds > budget)
+    buf->limit_error = true;
+
+  return !buf->limit_error;
+}
+
+//-----------------------------------------------------------------------------
+static bool output_flush(OutputBuffer *buf)
+{
+  int start = (buf->ptr - buf->pending) & WINDOW_MASK;
+
+  if (0 == buf->pending)
+    return true;
+
+  if (!output_check_limits(buf))
+    return false;
+
+  // Pending data may wrap around the end of the window
+  if ((start + buf->pending) > WINDOW_SIZE)
+  {
+    int size = WINDOW_SIZE - start;
+
+    if (!output_write(buf, &buf->data[start], size))
+      return false;
+
+    buf->pending -= size;
+    start = 0;
+  }
+
+  if (!output_write(buf, &buf->data[start], buf->pending))
+    return false;
+
+  buf->pending = 0;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static inline bool output_reserve(OutputBuffer *buf, int size)
+{
+  if ((buf->pending + size) > WINDOW_SIZE)
+    return output_flush(buf);
 
   return true;
 }
@@ -425,12 +901,26 @@ static bool handle_decompressed_block(BitStream *stream, OutputBuffer *buf)
   if ((len ^ nlen) != 0xffff)
     return false;
 
-  if (len > stream->size || (buf->ptr + len) > buf->size)
-    return false;
+  while (len > 0)
+  {
+    int size = WINDOW_SIZE - buf->ptr;
+
+    if (!output_reserve(buf, WINDOW_SIZE))
+      return false;
+
+    if (size > len)
+      size = len;
 
-  bit_stream_buf(stream, &buf->data[buf->ptr], len);
+    bit_stream_buf(stream, &buf->data[buf->ptr], size);
+
+    if (stream->error)
+      return false;
 
-  buf->ptr += len;
+    buf->ptr = (buf->ptr + size) & WINDOW_MASK;
+    buf->pending += size;
+    buf->total += size;
+    len -= size;
+  }
 
   return true;
 }
@@ -446,76 +936,115 @@ static bool handle_compressed_block(BitStream *stream, uint16_t *lit_table,
     if (stream->error)
       return false;
 
+    if (!output_reserve(buf, MAX_MATCH))
+      return false;
+
     if (sym < 256)
     {
-      if (buf->ptr == buf->size)
-        return false;
+      buf->data[buf->ptr] = sym;
+      buf->ptr = (buf->ptr + 1) & WINDOW_MASK;
+      buf->pending++;
+      buf->total++;
 
-      buf->data[buf->ptr++] = sym;
+      if (buf->stats)
+        buf->stats->literals++;
     }
     else if (sym == 256)
     {
       return true;
     }
-    else
+    else if (sym <= 285)
     {
       int length_index = sym - 257;
       int duplicate_length = length_base[length_index] + bit_stream_bits(stream, length_extra_bits[length_index]);
       int dist_index = get_symbol(stream, dist_table);
-      int distance = dist_base[dist_index] + bit_stream_bits(stream, dist_extra_bits[dist_index]);
-      int back_ptr = buf->ptr - distance;
+      int distance, back_ptr;
+
+      // Distance codes 30 and 31 take part in the code, but never occur
+      if (dist_index > 29)
+        return false;
 
-      if (back_ptr < 0 || (buf->ptr + duplicate_length) > buf->size)
+      distance = dist_base[dist_index] + bit_stream_bits(stream, dist_extra_bits[dist_index]);
+      back_ptr = (buf->ptr - distance) & WINDOW_MASK;
+
+      if (0 == distance || (size_t)distance > buf->total)
         return false;
 
+      buf->pending += duplicate_length;
+      buf->total += duplicate_length;
+
+      if (buf->stats)
+      {
+        buf->stats->matches++;
+        buf->stats->match_bytes += duplicate_length;
+      }
+
       while (duplicate_length)
       {
         buf->data[buf->ptr] = buf->data[back_ptr];
-        buf->ptr++;
-        back_ptr++;
+        buf->ptr = (buf->ptr + 1) & WINDOW_MASK;
+        back_ptr = (back_ptr + 1) & WINDOW_MASK;
         duplicate_length--;
       }
     }
+    else
+    {
+      return false;
+    }
   }
 
   return false;
 }
 
 //-----------------------------------------------------------------------------
-static bool deflate_decompress(uint8_t *data, int size, uint8_t *dec_data, int *dec_size)
+static bool deflate_decompress(PNGDecoder *decoder, uint8_t *data, uint8_t *end, int flags,
+    InflateChecksum *checksum, OutputCallback callback, void *ctx)
 {
+  PNGImageStats *stats = decoder->stats;
+  PNGLimits *limits = &decoder->limits;
   BitStream stream;
   OutputBuffer buf;
-  uint16_t *lit_table, *dist_table;
+  PNGDecoderState *state = decoder->state;
+  uint16_t *lit_table = state->lit_table;
+  uint16_t *dist_table = state->dist_table;
   int final, type, cmf, flg, chk;
   bool res = false;
 
-  buf.data = dec_data;
-  buf.size = *dec_size;
-  buf.ptr  = 0;
-
-  bit_stream_init(&stream, data, size);
-
-  cmf = bit_stream_bits(&stream, 8);
-  flg = bit_stream_bits(&stream, 8);
-  chk = (cmf << 8) | flg;
-
-  if ((cmf & 0x0f) != 0x08 || flg & (1 << 5) || (chk % 31) != 0)
-    return false;
+  bit_stream_init(&stream, data, end);
 
-  lit_table  = (uint16_t *)malloc((1 << MAX_LENGTH) * sizeof(uint16_t));
-  dist_table = (uint16_t *)malloc((1 << MAX_LENGTH) * sizeof(uint16_t));
+  if (flags & DEFLATE_FDAT)
+    stream.type = PNG_FDAT;
 
-  if (!lit_table || !dist_table)
+  if (0 == (flags & DEFLATE_RAW))
   {
-    free(lit_table);
-    free(dist_table);
-    return false;
+    cmf = bit_stream_bits(&stream, 8);
+    flg = bit_stream_bits(&stream, 8);
+    chk = (cmf << 8) | flg;
+
+    if ((cmf & 0x0f) != 0x08 || flg & (1 << 5) || (chk % 31) != 0)
+      return false;
   }
 
+  buf.data     = state->window;
+  buf.ptr      = 0;
+  buf.pending  = 0;
+  buf.total    = 0;
+  buf.checksum = checksum;
+  buf.stats    = stats;
+  buf.limit    = SIZE_MAX;
+  buf.deadline = state->deadline;
+  buf.table_builds = 0;
+  buf.max_table_builds = limits->table_builds;
+  buf.limit_error = false;
+  buf.callback = callback;
+  buf.ctx      = ctx;
+
+  if (limits->ratio && !png_size_mul(limits->ratio, end - data, &buf.limit))
+    buf.limit = SIZE_MAX;
+
   do
   {
-    if (stream.error)
+    if (stream.error || !output_check_limits(&buf))
       break;
 
     final = bit_stream_bits(&stream, 1);
@@ -524,19 +1053,42 @@ static bool deflate_decompress(uint8_t *data, int size, uint8_t *dec_data, int *
 
     if (type == 0)
     {
+      if (stats)
+        stats->stored_blocks++;
+
       if (!handle_decompressed_block(&stream, &buf))
         break;
     }
     else if (type == 1)
     {
-      build_huffman_table(lit_table, fixed_lengths, FIXED_HLIT);
-      build_huffman_table(dist_table, &fixed_lengths[FIXED_HLIT], FIXED_HDIST);
+      if (stats)
+        stats->fixed_blocks++;
+
+      // Fixed tables are kept until a dynamic block overwrites them
+      if (!state->fixed_tables)
+      {
+        if (!output_count_tables(&buf, &stream, 2))
+          break;
+
+        build_huffman_table(lit_table, fixed_lengths, FIXED_HLIT);
+        build_huffman_table(dist_table, &fixed_lengths[FIXED_HLIT], FIXED_HDIST);
+        state->fixed_tables = true;
+      }
 
       if (!handle_compressed_block(&stream, lit_table, dist_table, &buf))
         break;
     }
     else if (type == 2)
     {
+      state->fixed_tables = false;
+
+      if (stats)
+        stats->dynamic_blocks++;
+
+      // Code length, literal/length and distance tables
+      if (!output_count_tables(&buf, &stream, 3))
+        break;
+
       if (!prepare_dynamic_tables(&stream, lit_table, dist_table))
         break;
 
@@ -549,235 +1101,2998 @@ static bool deflate_decompress(uint8_t *data, int size, uint8_t *dec_data, int *
     }
 
     res = true;
+
+    if ((flags & DEFLATE_PARTIAL) && bit_stream_end(&stream))
+      break;
   } while (!final);
 
-  *dec_size = buf.ptr;
+  if (res)
+    res = output_flush(&buf);
+
+  if (buf.limit_error)
+    state->limit_error = true;
+
+  if (stats)
+    stats->inflated += buf.total;
+
+  // The zlib trailer follows the final block on a byte boundary, a missing
+  // trailer is an error when it needs to be verified
+  if (res && checksum && final)
+  {
+    bit_stream_bits(&stream, stream.bits % 8);
+
+    for (int i = 0; i < 4; i++)
+      checksum->trailer = (checksum->trailer << 8) | bit_stream_bits(&stream, 8);
 
-  free(lit_table);
-  free(dist_table);
+    checksum->final = true;
+    res = !stream.error;
+  }
 
   return res;
 }
 
 //-----------------------------------------------------------------------------
-static bool png_image_defilter(uint8_t *data, int width, int height, int bpp)
+static void defilter_sub(uint8_t *line, uint8_t *prior, int size, int bpp)
 {
-  int line_size = width * bpp + 1;
-
-  for (int i = 0; i < height; i++)
-  {
-    int offset = line_size * i;
-    int filter = data[offset];
-    uint8_t *line = &data[offset + 1];
+  (void)prior;
 
-    if (0 == filter)
-    {
-      continue;
-    }
-    else if (1 == filter)
-    {
-      for (int x = 0; x < width * bpp; x++)
-        line[x] += (uint8_t)((x - bpp) < 0) ? 0 : line[x-bpp];
-    }
-    else if (2 == filter)
-    {
-      uint8_t *prior = line - line_size;
+  for (int x = bpp; x < size; x++)
+    line[x] += line[x-bpp];
+}
 
-      for (int x = 0; x < width * bpp; x++)
-        line[x] += (uint8_t)(i == 0) ? 0 : prior[x];
-    }
-    else if (3 == filter)
-    {
-      uint8_t *prior = line - line_size;
+//-----------------------------------------------------------------------------
+static void defilter_up(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  (void)bpp;
 
-      for (int x = 0; x < width * bpp; x++)
-      {
-        int p = (uint8_t)(i == 0) ? 0 : prior[x];
-        int m = (uint8_t)((x - bpp) < 0) ? 0 : line[x-bpp];
-        line[x] += (m + p) / 2;
-      }
-    }
-    else if (4 == filter)
-    {
-      uint8_t *prior = line - line_size;
-      uint8_t paeth = 0;
+  for (int x = 0; x < size; x++)
+    line[x] += prior[x];
+}
 
-      for (int x = 0; x < width * bpp; x++)
-      {
-        int a = ((x - bpp) < 0) ? 0 : line[x-bpp];
-        int b = (i == 0) ? 0 : prior[x];
-        int c = ((i == 0) || ((x - bpp) < 0)) ? 0 : prior[x-bpp];
-        int p = a + b - c;
-        int pa = abs(p - a);
-        int pb = abs(p - b);
-        int pc = abs(p - c);
-
-        if (pa <= pb && pa <= pc)
-          paeth = a;
-        else if (pb <= pc)
-          paeth = b;
-        else
-          paeth = c;
-
-        line[x] += paeth;
-      }
-    }
-    else
-    {
-      return false;
-    }
-  }
+//-----------------------------------------------------------------------------
+static void defilter_avg(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  for (int x = 0; x < bpp && x < size; x++)
+    line[x] += prior[x] >> 1;
 
-  return true;
+  for (int x = bpp; x < size; x++)
+    line[x] += (line[x-bpp] + prior[x]) >> 1;
 }
 
 //-----------------------------------------------------------------------------
-static void png_image_convert(uint8_t *dst, uint8_t *src, int width, int height, int bpp)
+static void defilter_paeth(uint8_t *line, uint8_t *prior, int size, int bpp)
 {
-  int src_line_size = width * bpp + 1;
-  int dst_line_size = width * sizeof(uint32_t);
+  // With a = c = 0 the predictor for the first pixel is always b
+  for (int x = 0; x < bpp && x < size; x++)
+    line[x] += prior[x];
 
-  if (bpp == 4)
-  {
-    for (int i = 0; i < height; i++)
-      memcpy(dst + dst_line_size * i, src + src_line_size * i + 1, src_line_size - 1);
-  }
-  else
+  for (int x = bpp; x < size; x++)
   {
-    for (int i = 0; i < height; i++)
-    {
-      src++;
-
-      for (int j = 0; j < width; j++)
-      {
-        dst[0] = src[0];
-        dst[1] = src[1];
-        dst[2] = src[2];
-        dst[3] = 0xff;
-        dst += 4;
-        src += 3;
-      }
-    }
+    int a = line[x-bpp];
+    int b = prior[x];
+    int c = prior[x-bpp];
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - c - c);
+
+    line[x] += (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
   }
 }
 
-//-----------------------------------------------------------------------------
-int png_image_read(PNGImage *image, uint8_t *data, int size)
+#if defined(__x86_64__) || defined(__i386__)
+
+// SIMD kernels for 3 and 4 byte pixels. Sub, Average and Paeth depend on the
+// previous reconstructed pixel, so they are vectorized across the channels
+// of a pixel, Sub for 4 byte pixels uses a prefix sum over 4 pixels at a time.
+// Up has no dependencies and processes 16 or 32 bytes per iteration.
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) __m128i load_pixel(uint8_t *ptr, int bpp)
+{
+  uint32_t value = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+
+  if (4 == bpp)
+    value |= (uint32_t)ptr[3] << 24;
+
+  return _mm_cvtsi32_si128(value);
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) void store_pixel(uint8_t *ptr, __m128i pixel, int bpp)
+{
+  uint32_t value = _mm_cvtsi128_si32(pixel);
+
+  ptr[0] = value;
+  ptr[1] = value >> 8;
+  ptr[2] = value >> 16;
+
+  if (4 == bpp)
+    ptr[3] = value >> 24;
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void defilter_up_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  int x = 0;
+
+  for (; x <= (size - 16); x += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&line[x]);
+    __m128i p = _mm_loadu_si128((__m128i *)&prior[x]);
+
+    _mm_storeu_si128((__m128i *)&line[x], _mm_add_epi8(v, p));
+  }
+
+  defilter_up(&line[x], &prior[x], size - x, bpp);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("avx2"))) void defilter_up_avx2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  int x = 0;
+
+  for (; x <= (size - 32); x += 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i *)&line[x]);
+    __m256i p = _mm256_loadu_si256((__m256i *)&prior[x]);
+
+    _mm256_storeu_si256((__m256i *)&line[x], _mm256_add_epi8(v, p));
+  }
+
+  defilter_up_sse2(&line[x], &prior[x], size - x, bpp);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void defilter_sub3_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  __m128i a = _mm_setzero_si128();
+
+  (void)prior;
+  (void)bpp;
+
+  for (int x = 0; x < size; x += 3)
+  {
+    a = _mm_add_epi8(a, load_pixel(&line[x], 3));
+    store_pixel(&line[x], a, 3);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void defilter_sub4_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  __m128i a = _mm_setzero_si128();
+  int x = 0;
+
+  (void)prior;
+  (void)bpp;
+
+  for (; x <= (size - 16); x += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&line[x]);
+
+    v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+    v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+    v = _mm_add_epi8(v, a);
+    _mm_storeu_si128((__m128i *)&line[x], v);
+
+    a = _mm_shuffle_epi32(v, 0xff);
+  }
+
+  for (; x < size; x += 4)
+  {
+    a = _mm_add_epi8(a, load_pixel(&line[x], 4));
+    store_pixel(&line[x], a, 4);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) void defilter_avg_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+
+  for (int x = 0; x < size; x += bpp)
+  {
+    __m128i b = load_pixel(&prior[x], bpp);
+    __m128i v = load_pixel(&line[x], bpp);
+
+    // _mm_avg_epu8() rounds up, PNG average rounds down
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+
+    a = _mm_add_epi8(v, avg);
+    store_pixel(&line[x], a, bpp);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void defilter_avg3_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  (void)bpp;
+  defilter_avg_sse2(line, prior, size, 3);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void defilter_avg4_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  (void)bpp;
+  defilter_avg_sse2(line, prior, size, 4);
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) __m128i abs_epi16_sse2(__m128i v)
+{
+  return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("ssse3"))) __m128i abs_epi16_ssse3(__m128i v)
+{
+  return _mm_abs_epi16(v);
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) __m128i select_si128(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Branch-free Paeth predictor on 16-bit lanes. With p = a + b - c,
+// |p - a| = |b - c|, |p - b| = |a - c| and |p - c| = |(b - c) + (a - c)|.
+#define DEFILTER_PAETH_SIMD(abs_epi16, bpp_value) \
+  __m128i zero = _mm_setzero_si128(); \
+  __m128i a = zero, c = zero; \
+  (void)bpp; \
+  \
+  for (int x = 0; x < size; x += bpp_value) \
+  { \
+    __m128i b = _mm_unpacklo_epi8(load_pixel(&prior[x], bpp_value), zero); \
+    __m128i v = _mm_unpacklo_epi8(load_pixel(&line[x], bpp_value), zero); \
+    __m128i pa = _mm_sub_epi16(b, c); \
+    __m128i pb = _mm_sub_epi16(a, c); \
+    __m128i pc = abs_epi16(_mm_add_epi16(pa, pb)); \
+    __m128i min; \
+    \
+    pa = abs_epi16(pa); \
+    pb = abs_epi16(pb); \
+    min = _mm_min_epi16(pc, _mm_min_epi16(pa, pb)); \
+    \
+    v = _mm_add_epi8(v, select_si128(_mm_cmpeq_epi16(min, pa), a, \
+        select_si128(_mm_cmpeq_epi16(min, pb), b, c))); \
+    store_pixel(&line[x], _mm_packus_epi16(v, v), bpp_value); \
+    \
+    a = v; \
+    c = b; \
+  }
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void defilter_paeth3_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  DEFILTER_PAETH_SIMD(abs_epi16_sse2, 3)
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void defilter_paeth4_sse2(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  DEFILTER_PAETH_SIMD(abs_epi16_sse2, 4)
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void defilter_paeth3_ssse3(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  DEFILTER_PAETH_SIMD(abs_epi16_ssse3, 3)
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void defilter_paeth4_ssse3(uint8_t *line, uint8_t *prior, int size, int bpp)
+{
+  DEFILTER_PAETH_SIMD(abs_epi16_ssse3, 4)
+}
+
+#endif // __x86_64__ || __i386__
+
+//-----------------------------------------------------------------------------
+static inline uint8_t premultiply(int c, int a)
+{
+  int t = c * a + 128;
+
+  return (t + (t >> 8)) >> 8;
+}
+
+//-----------------------------------------------------------------------------
+static void convert_copy3(uint8_t *dst, uint8_t *src, int width)
+{
+  memcpy(dst, src, width * 3);
+}
+
+//-----------------------------------------------------------------------------
+static void convert_copy4(uint8_t *dst, uint8_t *src, int width)
+{
+  memcpy(dst, src, width * 4);
+}
+
+//-----------------------------------------------------------------------------
+static void convert_rgb_to_rgba(uint8_t *dst, uint8_t *src, int width)
+{
+  for (int j = 0; j < width; j++)
+  {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst[3] = 0xff;
+    dst += 4;
+    src += 3;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// The BGRA conversions are done by the pixel converter, it selects its own
+// SIMD kernels. Expanding RGB as if it was BGR swaps R and B.
+static void convert_rgb_to_bgra(uint8_t *dst, uint8_t *src, int width)
+{
+  pixel_convert_bgr_to_rgba(dst, src, width);
+}
+
+//-----------------------------------------------------------------------------
+static void convert_rgba_to_bgra(uint8_t *dst, uint8_t *src, int width)
+{
+  pixel_convert_rgba_to_bgra(dst, src, width);
+}
+
+//-----------------------------------------------------------------------------
+static void convert_rgba_to_rgb(uint8_t *dst, uint8_t *src, int width)
+{
+  for (int j = 0; j < width; j++)
+  {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst += 3;
+    src += 4;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void convert_rgba_to_prgba(uint8_t *dst, uint8_t *src, int width)
+{
+  for (int j = 0; j < width; j++)
+  {
+    int a = src[3];
+
+    dst[0] = premultiply(src[0], a);
+    dst[1] = premultiply(src[1], a);
+    dst[2] = premultiply(src[2], a);
+    dst[3] = a;
+    dst += 4;
+    src += 4;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Conversion kernels process 4 pixels per iteration. Loads and stores never
+// go past the end of the source or destination row, the tail is handled by
+// the scalar versions.
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void convert_rgb_to_rgba_ssse3(uint8_t *dst, uint8_t *src, int width)
+{
+  __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m128i alpha = _mm_set1_epi32(0xff000000);
+  int j = 0;
+
+  for (; (j * 3 + 16) <= (width * 3); j += 4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&src[j * 3]);
+
+    _mm_storeu_si128((__m128i *)&dst[j * 4], _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+  }
+
+  convert_rgb_to_rgba(&dst[j * 4], &src[j * 3], width - j);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void convert_rgba_to_rgb_ssse3(uint8_t *dst, uint8_t *src, int width)
+{
+  __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  int j = 0;
+
+  for (; j <= (width - 4); j += 4)
+  {
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)&src[j * 4]), shuffle);
+    uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+
+    _mm_storel_epi64((__m128i *)&dst[j * 3], v);
+    memcpy(&dst[j * 3 + 8], &tail, sizeof(uint32_t));
+  }
+
+  convert_rgba_to_rgb(&dst[j * 3], &src[j * 4], width - j);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void convert_rgba_to_prgba_sse2(uint8_t *dst, uint8_t *src, int width)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i round = _mm_set1_epi16(128);
+  // Alpha is multiplied by 255, which leaves it unchanged
+  __m128i alpha = _mm_setr_epi16(0, 0, 0, 0xff, 0, 0, 0, 0xff);
+  int j = 0;
+
+  for (; j <= (width - 4); j += 4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&src[j * 4]);
+    __m128i res[2];
+
+    for (int i = 0; i < 2; i++)
+    {
+      __m128i c = i ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+      __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, 0xff), 0xff);
+      __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, _mm_or_si128(a, alpha)), round);
+
+      res[i] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+
+    _mm_storeu_si128((__m128i *)&dst[j * 4], _mm_packus_epi16(res[0], res[1]));
+  }
+
+  convert_rgba_to_prgba(&dst[j * 4], &src[j * 4], width - j);
+}
+
+#endif // __x86_64__ || __i386__
+
+//-----------------------------------------------------------------------------
+static void planar_u8(const PNGTensor *tensor, uint8_t *dst, uint8_t *src, int width)
+{
+  for (int c = 0; c < tensor->channels; c++, dst += tensor->plane_stride)
+  {
+    for (int j = 0; j < width; j++)
+      dst[j] = src[j * 4 + c];
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void planar_f32(const PNGTensor *tensor, uint8_t *dst, uint8_t *src, int width)
+{
+  for (int c = 0; c < tensor->channels; c++, dst += tensor->plane_stride)
+  {
+    float *plane = (float *)dst;
+    float scale = tensor->scale[c];
+    float offset = tensor->offset[c];
+
+    for (int j = 0; j < width; j++)
+      plane[j] = src[j * 4 + c] * scale + offset;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Planar kernels split 16 RGBA pixels per iteration with a transpose of
+// 4-byte groups. Floats are computed with a separate multiply and add,
+// so the results match the scalar versions exactly.
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("ssse3"))) void planar_split_ssse3(uint8_t *src, __m128i ch[4])
+{
+  __m128i shuffle = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  __m128i v[4], rg[2], ba[2];
+
+  // Each vector holds 4 pixels grouped by channel
+  for (int k = 0; k < 4; k++)
+    v[k] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)&src[k * 16]), shuffle);
+
+  rg[0] = _mm_unpacklo_epi32(v[0], v[1]);
+  ba[0] = _mm_unpackhi_epi32(v[0], v[1]);
+  rg[1] = _mm_unpacklo_epi32(v[2], v[3]);
+  ba[1] = _mm_unpackhi_epi32(v[2], v[3]);
+
+  ch[0] = _mm_unpacklo_epi64(rg[0], rg[1]);
+  ch[1] = _mm_unpackhi_epi64(rg[0], rg[1]);
+  ch[2] = _mm_unpacklo_epi64(ba[0], ba[1]);
+  ch[3] = _mm_unpackhi_epi64(ba[0], ba[1]);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void planar_u8_ssse3(const PNGTensor *tensor, uint8_t *dst, uint8_t *src, int width)
+{
+  size_t plane = tensor->plane_stride;
+  int j = 0;
+
+  for (; j + 16 <= width; j += 16)
+  {
+    __m128i ch[4];
+
+    planar_split_ssse3(&src[j * 4], ch);
+
+    for (int c = 0; c < tensor->channels; c++)
+      _mm_storeu_si128((__m128i *)&dst[c * plane + j], ch[c]);
+  }
+
+  planar_u8(tensor, &dst[j], &src[j * 4], width - j);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("ssse3"))) void planar_f32_ssse3(const PNGTensor *tensor, uint8_t *dst, uint8_t *src, int width)
+{
+  size_t plane = tensor->plane_stride;
+  __m128i zero = _mm_setzero_si128();
+  __m128 scale[4], offset[4];
+  int j = 0;
+
+  for (int c = 0; c < 4; c++)
+  {
+    scale[c]  = _mm_set1_ps(tensor->scale[c]);
+    offset[c] = _mm_set1_ps(tensor->offset[c]);
+  }
+
+  for (; j + 16 <= width; j += 16)
+  {
+    __m128i ch[4];
+
+    planar_split_ssse3(&src[j * 4], ch);
+
+    for (int c = 0; c < tensor->channels; c++)
+    {
+      float *out = (float *)&dst[c * plane] + j;
+      __m128i lo = _mm_unpacklo_epi8(ch[c], zero);
+      __m128i hi = _mm_unpackhi_epi8(ch[c], zero);
+      __m128i v[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+          _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+
+      for (int k = 0; k < 4; k++)
+        _mm_storeu_ps(&out[k * 4], _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v[k]), scale[c]), offset[c]));
+    }
+  }
+
+  planar_f32(tensor, &dst[j * sizeof(float)], &src[j * 4], width - j);
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("avx2"))) void planar_f32_avx2(const PNGTensor *tensor, uint8_t *dst, uint8_t *src, int width)
+{
+  size_t plane = tensor->plane_stride;
+  __m256 scale[4], offset[4];
+  int j = 0;
+
+  for (int c = 0; c < 4; c++)
+  {
+    scale[c]  = _mm256_set1_ps(tensor->scale[c]);
+    offset[c] = _mm256_set1_ps(tensor->offset[c]);
+  }
+
+  for (; j + 16 <= width; j += 16)
+  {
+    __m128i ch[4];
+
+    planar_split_ssse3(&src[j * 4], ch);
+
+    for (int c = 0; c < tensor->channels; c++)
+    {
+      float *out = (float *)&dst[c * plane] + j;
+      __m256i lo = _mm256_cvtepu8_epi32(ch[c]);
+      __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(ch[c], 8));
+
+      _mm256_storeu_ps(&out[0], _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale[c]), offset[c]));
+      _mm256_storeu_ps(&out[8], _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale[c]), offset[c]));
+    }
+  }
+
+  planar_f32(tensor, &dst[j * sizeof(float)], &src[j * 4], width - j);
+}
+
+#endif // __x86_64__ || __i386__
+
+//-----------------------------------------------------------------------------
+static inline int png_sample(uint8_t *src, int index, int depth)
+{
+  int bit;
+
+  if (16 == depth)
+    return (src[index * 2] << 8) | src[index * 2 + 1];
+
+  if (8 == depth)
+    return src[index];
+
+  // Sub-byte samples are packed starting from the most significant bit
+  bit = index * depth;
+
+  return (src[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+}
+
+//-----------------------------------------------------------------------------
+static inline int png_gray_scale(int depth)
+{
+  return (depth < 8) ? (255 / ((1 << depth) - 1)) : 1;
+}
+
+//-----------------------------------------------------------------------------
+static void unpack_native(RowDecoder *dec, uint8_t *dst, uint8_t *src, int width)
+{
+  int samples = width * png_channels[dec->type];
+
+  if (8 == dec->depth)
+  {
+    memcpy(dst, src, samples);
+  }
+  else if (16 == dec->depth)
+  {
+    // 16-bit samples are stored in the host byte order
+    for (int i = 0; i < samples; i++)
+    {
+      uint16_t value = (src[i * 2] << 8) | src[i * 2 + 1];
+
+      memcpy(&dst[i * 2], &value, sizeof(uint16_t));
+    }
+  }
+  else
+  {
+    // Sub-byte samples take one byte each, gray levels are scaled to 8 bits
+    int scale = (PNG_IMAGE_TYPE_PALETTE == dec->type) ? 1 : png_gray_scale(dec->depth);
+
+    for (int i = 0; i < samples; i++)
+      dst[i] = png_sample(src, i, dec->depth) * scale;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void unpack_rgba(RowDecoder *dec, uint8_t *dst, uint8_t *src, int width)
+{
+  PNGImage *image = dec->image;
+  int depth = dec->depth;
+  int shift = (16 == depth) ? 8 : 0;
+  int scale = png_gray_scale(depth);
+
+  for (int i = 0; i < width; i++, dst += 4)
+  {
+    if (PNG_IMAGE_TYPE_PALETTE == dec->type)
+    {
+      memcpy(dst, &image->palette[png_sample(src, i, depth) * 4], 4);
+    }
+    else if (PNG_IMAGE_TYPE_GRAY == dec->type)
+    {
+      int g = png_sample(src, i, depth) * scale;
+
+      dst[0] = dst[1] = dst[2] = g >> shift;
+      dst[3] = (image->transparency && g == image->transparent[0]) ? 0 : 255;
+    }
+    else if (PNG_IMAGE_TYPE_GRAY_ALPHA == dec->type)
+    {
+      dst[0] = dst[1] = dst[2] = png_sample(src, i * 2, depth) >> shift;
+      dst[3] = png_sample(src, i * 2 + 1, depth) >> shift;
+    }
+    else if (PNG_IMAGE_TYPE_RGB == dec->type)
+    {
+      int r = png_sample(src, i * 3, depth);
+      int g = png_sample(src, i * 3 + 1, depth);
+      int b = png_sample(src, i * 3 + 2, depth);
+
+      dst[0] = r >> shift;
+      dst[1] = g >> shift;
+      dst[2] = b >> shift;
+      dst[3] = (image->transparency && r == image->transparent[0] &&
+          g == image->transparent[1] && b == image->transparent[2]) ? 0 : 255;
+    }
+    else
+    {
+      for (int c = 0; c < 4; c++)
+        dst[c] = png_sample(src, i * 4 + c, depth) >> shift;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void __attribute__((constructor)) png_image_select_kernels(void)
+{
+  DefilterFunc generic[5] = { NULL, defilter_sub, defilter_up, defilter_avg, defilter_paeth };
+
+  memcpy(defilter_kernels[0], generic, sizeof(generic));
+  memcpy(defilter_kernels[1], generic, sizeof(generic));
+  memcpy(defilter_kernels[2], generic, sizeof(generic));
+
+  convert_kernels[0][PNG_IMAGE_FORMAT_RGBA] = convert_rgb_to_rgba;
+  convert_kernels[0][PNG_IMAGE_FORMAT_BGRA] = convert_rgb_to_bgra;
+  convert_kernels[0][PNG_IMAGE_FORMAT_RGB]  = convert_copy3;
+  convert_kernels[0][PNG_IMAGE_FORMAT_PREMULTIPLIED_RGBA] = convert_rgb_to_rgba;
+  convert_kernels[1][PNG_IMAGE_FORMAT_RGBA] = convert_copy4;
+  convert_kernels[1][PNG_IMAGE_FORMAT_BGRA] = convert_rgba_to_bgra;
+  convert_kernels[1][PNG_IMAGE_FORMAT_RGB]  = convert_rgba_to_rgb;
+  convert_kernels[1][PNG_IMAGE_FORMAT_PREMULTIPLIED_RGBA] = convert_rgba_to_prgba;
+
+  planar_kernels[0] = planar_u8;
+  planar_kernels[1] = planar_f32;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2"))
+  {
+    for (int i = 0; i < 3; i++)
+      defilter_kernels[i][2] = defilter_up_sse2;
+
+    convert_kernels[1][PNG_IMAGE_FORMAT_PREMULTIPLIED_RGBA] = convert_rgba_to_prgba_sse2;
+
+    defilter_kernels[1][1] = defilter_sub3_sse2;
+    defilter_kernels[1][3] = defilter_avg3_sse2;
+    defilter_kernels[1][4] = defilter_paeth3_sse2;
+    defilter_kernels[2][1] = defilter_sub4_sse2;
+    defilter_kernels[2][3] = defilter_avg4_sse2;
+    defilter_kernels[2][4] = defilter_paeth4_sse2;
+  }
+
+  if (__builtin_cpu_supports("ssse3"))
+  {
+    defilter_kernels[1][4] = defilter_paeth3_ssse3;
+    defilter_kernels[2][4] = defilter_paeth4_ssse3;
+
+    convert_kernels[0][PNG_IMAGE_FORMAT_RGBA] = convert_rgb_to_rgba_ssse3;
+    convert_kernels[0][PNG_IMAGE_FORMAT_PREMULTIPLIED_RGBA] = convert_rgb_to_rgba_ssse3;
+    convert_kernels[1][PNG_IMAGE_FORMAT_RGB]  = convert_rgba_to_rgb_ssse3;
+
+    planar_kernels[0] = planar_u8_ssse3;
+    planar_kernels[1] = planar_f32_ssse3;
+  }
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    for (int i = 0; i < 3; i++)
+      defilter_kernels[i][2] = defilter_up_avx2;
+
+    planar_kernels[1] = planar_f32_avx2;
+  }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static void __attribute__((constructor)) png_image_count_cpus(void)
+{
+  online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+//-----------------------------------------------------------------------------
+static bool png_image_defilter_row(uint8_t *line, uint8_t *prior, int size, int bpp, int filter)
+{
+  // The prior line for the first row of the image is all zeros
+  DefilterFunc *kernels = defilter_kernels[(3 == bpp) ? 1 : (4 == bpp) ? 2 : 0];
+
+  if (filter > 4)
+    return false;
+
+  if (filter > 0)
+    kernels[filter](line, prior, size, bpp);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_row_start_pass(RowDecoder *dec)
+{
+  for (; dec->pass <= dec->last_pass; dec->pass++)
+  {
+    const uint8_t *pass = adam7_passes[dec->pass];
+
+    // Passes are empty for images smaller than the Adam7 block
+    dec->width  = (dec->src_width - pass[0] + pass[2] - 1) / pass[2];
+    dec->height = (dec->src_height - pass[1] + pass[3] - 1) / pass[3];
+
+    if (dec->width > 0 && dec->height > 0)
+      break;
+  }
+
+  if (dec->pass > dec->last_pass)
+    return;
+
+  dec->line_size = (dec->width * dec->bits + 7) / 8;
+  dec->row       = 0;
+  dec->ptr       = 0;
+
+  // Each pass is filtered as a separate image
+  memset(dec->prior, 0, dec->line_size + 1);
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_row_convert(RowDecoder *dec, uint8_t *dst, uint8_t *line, int width)
+{
+  if (!dec->unpack)
+  {
+    dec->convert(dst, line, width);
+  }
+  else if (!dec->convert)
+  {
+    dec->unpack(dec, dst, line, width);
+  }
+  else
+  {
+    // Formats other than 8-bit RGB and RGBA are converted through RGBA
+    dec->unpack(dec, dec->rgba, line, width);
+    dec->convert(dst, dec->rgba, width);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *png_image_row_gather(RowDecoder *dec, uint8_t *line, int first, int step, int count)
+{
+  uint8_t *dst = dec->packed;
+  int bits = dec->bits;
+
+  if (1 == step && 0 == ((first * bits) & 7))
+    return &line[(first * bits) >> 3];
+
+  if (bits >= 8)
+  {
+    for (int i = 0; i < count; i++)
+      memcpy(&dst[i * dec->bpp], &line[(first + i * step) * dec->bpp], dec->bpp);
+  }
+  else
+  {
+    // Sub-byte pixels are repacked, so the row can be converted as usual
+    memset(dst, 0, (count * bits + 7) / 8);
+
+    for (int i = 0; i < count; i++)
+    {
+      int bit = i * bits;
+
+      dst[bit >> 3] |= png_sample(line, first + i * step, bits) << (8 - bits - (bit & 7));
+    }
+  }
+
+  return dst;
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_flush_band(RowDecoder *dec, int rows)
+{
+  PNGImage band = *dec->image;
+
+  band.height = rows;
+
+  if (!dec->sink->callback(&band, dec->band_y, dec->sink->ctx))
+    dec->sink_error = true;
+
+  dec->band_y += rows;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *png_image_row_ptr(RowDecoder *dec, int y)
+{
+  PNGImage *image = dec->image;
+
+  // Output rows of non-interlaced images are written in order, so a band is
+  // complete as soon as a row below it is needed
+  if (dec->sink)
+  {
+    if (y >= (dec->band_y + dec->sink->height))
+      png_image_flush_band(dec, dec->sink->height);
+
+    y -= dec->band_y;
+  }
+
+  return &image->data[(size_t)y * image->stride];
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_row_box(RowDecoder *dec, int y, uint8_t *line)
+{
+  PNGImage *image = dec->image;
+  int scale = dec->scale;
+  int step = 1 << scale;
+  int width = dec->crop_width;
+  int samples = dec->pixel_size / dec->sample_size;
+  uint8_t *pixels = dec->pixels;
+  uint32_t *sums = dec->sums;
+  uint8_t *row;
+  int rows;
+
+  png_image_row_convert(dec, pixels, png_image_row_gather(dec, line, dec->crop_x, 1, width), width);
+
+  for (int x = 0; x < width; x++)
+  {
+    uint32_t *sum = &sums[(x >> scale) * samples];
+
+    if (2 == dec->sample_size)
+    {
+      uint16_t *src = (uint16_t *)&pixels[x * dec->pixel_size];
+
+      for (int c = 0; c < samples; c++)
+        sum[c] += src[c];
+    }
+    else
+    {
+      uint8_t *src = &pixels[x * dec->pixel_size];
+
+      for (int c = 0; c < samples; c++)
+        sum[c] += src[c];
+    }
+  }
+
+  if ((y + 1) % step && (y + 1) < dec->crop_height)
+    return;
+
+  // Blocks on the right and bottom edges may be smaller than the step
+  rows = y % step + 1;
+  row  = png_image_row_ptr(dec, y >> scale);
+
+  for (int x = 0; x < image->width; x++)
+  {
+    uint8_t *dst = &row[x * dec->pixel_size];
+    uint32_t *sum = &sums[x * samples];
+    int cols = (width - x * step < step) ? (width - x * step) : step;
+    uint32_t count = rows * cols;
+
+    for (int c = 0; c < samples; c++)
+    {
+      uint32_t value = (sum[c] + count / 2) / count;
+
+      if (2 == dec->sample_size)
+        ((uint16_t *)dst)[c] = value;
+      else
+        dst[c] = value;
+
+      sum[c] = 0;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_row_output(RowDecoder *dec, uint8_t *line)
+{
+  const uint8_t *pass = adam7_passes[dec->pass];
+  PNGImage *image = dec->image;
+  int pixel_size = dec->pixel_size;
+  int scale = dec->scale;
+  int step = 1 << scale;
+  int x0 = pass[0], dx = pass[2];
+  int bw = dec->replicate ? pass[4] : 1;
+  int bh = dec->replicate ? pass[5] : 1;
+  int cx = dec->crop_x, cw = dec->crop_width;
+  int y = pass[1] + dec->row * pass[3] - dec->crop_y;
+  int first, last, y_first, y_last;
+  uint8_t *dst;
+
+  // Coordinates are relative to the region from here on
+  if (0 == dec->pass)
+  {
+    if (y < 0 || y >= dec->crop_height)
+      return;
+
+    if (scale && !dec->subsample)
+      png_image_row_box(dec, y, line);
+    else if (0 == (y & (step - 1)))
+      png_image_row_convert(dec, png_image_row_ptr(dec, y >> scale),
+          png_image_row_gather(dec, line, cx, step, image->width), image->width);
+
+    return;
+  }
+
+  // Interlaced rows are converted and then scattered directly into the output
+  // image, so no full size buffer is needed. Only pixels with blocks that
+  // overlap the region are converted. Scaled images use only the passes that
+  // fall on the reduced grid.
+  y_first = (y < 0) ? 0 : y;
+  y_last  = (y + bh > dec->crop_height) ? dec->crop_height : (y + bh);
+
+  if (y_first >= y_last)
+    return;
+
+  y_first = (y_first + step - 1) >> scale;
+  y_last  = (y_last + step - 1) >> scale;
+
+  first = cx - bw + 1 - x0;
+  first = (first <= 0) ? 0 : (first + dx - 1) / dx;
+  last  = (cx + cw - x0 + dx - 1) / dx;
+  last  = (last > dec->width) ? dec->width : last;
+
+  if (first >= last)
+    return;
+
+  png_image_row_convert(dec, dec->pixels, png_image_row_gather(dec, line, first, 1, last - first),
+      last - first);
+
+  dst = &image->data[(size_t)y_first * image->stride];
+
+  for (int i = first; i < last; i++)
+  {
+    uint8_t *pixel = &dec->pixels[(i - first) * pixel_size];
+    int x = x0 + i * dx - cx;
+    int from = (x < 0) ? 0 : x;
+    int to = (x + bw > cw) ? cw : (x + bw);
+
+    from = (from + step - 1) >> scale;
+    to   = (to + step - 1) >> scale;
+
+    for (int j = from; j < to; j++)
+      memcpy(&dst[j * pixel_size], pixel, pixel_size);
+  }
+
+  // Replicated blocks cover only pixels of the later passes, which will
+  // overwrite them once decoded
+  for (int j = y_first + 1; j < y_last; j++)
+  {
+    uint8_t *row = &image->data[(size_t)j * image->stride];
+
+    for (int i = first; i < last; i++)
+    {
+      int x = x0 + i * dx - cx;
+      int from = (x < 0) ? 0 : x;
+      int to = (x + bw > cw) ? cw : (x + bw);
+
+      from = (from + step - 1) >> scale;
+      to   = (to + step - 1) >> scale;
+
+      memcpy(&row[from * pixel_size], &dst[from * pixel_size], (to - from) * pixel_size);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static bool png_image_row_callback(void *ctx, uint8_t *data, size_t size)
+{
+  RowDecoder *dec = (RowDecoder *)ctx;
+
+  while (size > 0)
+  {
+    size_t len = dec->line_size + 1 - dec->ptr;
+
+    if (dec->pass > dec->last_pass)
+      return false; // More data than the image needs
+
+    if (len > size)
+      len = size;
+
+    memcpy(&dec->line[dec->ptr], data, len);
+    dec->ptr += len;
+    data += len;
+    size -= len;
+
+    if (dec->ptr == (dec->line_size + 1))
+    {
+      uint8_t *line = dec->line;
+      uint64_t time = dec->stats ? png_image_clock() : 0;
+
+      // The first byte of each scanline is the filter type
+      if (!png_image_defilter_row(&line[1], &dec->prior[1], dec->line_size, dec->bpp, line[0]))
+      {
+        dec->filter_error = true;
+        return false;
+      }
+
+      if (dec->stats)
+      {
+        uint64_t now = png_image_clock();
+
+        dec->stats->defilter += now - time;
+        dec->stats->filters[line[0]]++;
+        time = now;
+      }
+
+      png_image_row_output(dec, &line[1]);
+
+      if (dec->stats)
+        dec->stats->convert += png_image_clock() - time;
+
+      if (dec->sink_error)
+        return false;
+
+      dec->line  = dec->prior;
+      dec->prior = line;
+      dec->ptr   = 0;
+      dec->row++;
+
+      // Nothing below the region is needed once the last pass gets there
+      if (dec->pass == dec->last_pass && dec->row < dec->height &&
+          (adam7_passes[dec->pass][1] + dec->row * adam7_passes[dec->pass][3]) >=
+          (dec->crop_y + dec->crop_height))
+      {
+        dec->row     = dec->height;
+        dec->partial = true;
+      }
+
+      if (dec->row == dec->height)
+      {
+        const uint8_t *pass = adam7_passes[dec->pass];
+        int x_step = pass[4] >> dec->scale;
+        int y_step = pass[5] >> dec->scale;
+
+        if (dec->pass > 0 && dec->progress)
+          dec->progress(dec->image, dec->pass, x_step ? x_step : 1, y_step ? y_step : 1,
+              dec->progress_ctx);
+
+        dec->pass++;
+        png_image_row_start_pass(dec);
+      }
+    }
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+uint64_t png_image_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static void *default_alloc(void *ctx, size_t size)
+{
+  (void)ctx;
+  return malloc(size);
+}
+
+//-----------------------------------------------------------------------------
+static void default_free(void *ctx, void *ptr)
+{
+  (void)ctx;
+  free(ptr);
+}
+
+//-----------------------------------------------------------------------------
+static bool png_decoder_prepare(PNGDecoder *decoder, size_t lines_size, size_t pipeline_size)
+{
+  PNGAllocator *allocator = &decoder->allocator;
+  PNGDecoderState *state = decoder->state;
+
+  if (!state)
+  {
+    state = (PNGDecoderState *)allocator->alloc(allocator->ctx, sizeof(PNGDecoderState));
+
+    if (!state)
+      return false;
+
+    memset(state, 0, sizeof(PNGDecoderState));
+    decoder->state = state;
+  }
+
+  if (!state->window)
+    state->window = (uint8_t *)allocator->alloc(allocator->ctx, WINDOW_SIZE);
+
+  if (!state->lit_table)
+    state->lit_table = (uint16_t *)allocator->alloc(allocator->ctx, TABLE_SIZE * sizeof(uint16_t));
+
+  if (!state->dist_table)
+    state->dist_table = (uint16_t *)allocator->alloc(allocator->ctx, TABLE_SIZE * sizeof(uint16_t));
+
+  if (state->lines_size < lines_size)
+  {
+    if (state->lines)
+      allocator->free(allocator->ctx, state->lines);
+
+    state->lines = (uint8_t *)allocator->alloc(allocator->ctx, lines_size);
+    state->lines_size = state->lines ? lines_size : 0;
+  }
+
+  // The pipeline buffer is optional, decodes without it are not pipelined
+  if (state->pipeline_size < pipeline_size)
+  {
+    if (state->pipeline)
+      allocator->free(allocator->ctx, state->pipeline);
+
+    state->pipeline = (uint8_t *)allocator->alloc(allocator->ctx, pipeline_size);
+    state->pipeline_size = state->pipeline ? pipeline_size : 0;
+  }
+
+  return state->window && state->lit_table && state->dist_table &&
+      (state->lines || 0 == lines_size);
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_row_reset(RowDecoder *dec, uint8_t *lines, bool interlace)
+{
+  int line_size = (dec->src_width * dec->bits + 7) / 8 + 1;
+
+  dec->line         = lines;
+  dec->prior        = lines + line_size;
+  dec->pass         = interlace ? 1 : 0;
+  dec->last_pass    = interlace ? 7 - 2 * dec->scale : 0;
+  dec->partial      = interlace && dec->scale;
+  dec->filter_error = false;
+
+  if (dec->sums)
+    memset(dec->sums, 0, (size_t)dec->image->width * dec->pixel_size * sizeof(uint32_t));
+
+  png_image_row_start_pass(dec);
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_add_stats(PNGImageStats *total, const PNGImageStats *stats)
+{
+  total->parse          += stats->parse;
+  total->inflate        += stats->inflate;
+  total->defilter       += stats->defilter;
+  total->convert        += stats->convert;
+  total->stored_blocks  += stats->stored_blocks;
+  total->fixed_blocks   += stats->fixed_blocks;
+  total->dynamic_blocks += stats->dynamic_blocks;
+  total->table_builds   += stats->table_builds;
+  total->literals       += stats->literals;
+  total->matches        += stats->matches;
+  total->match_bytes    += stats->match_bytes;
+  total->inflated       += stats->inflated;
+
+  for (int i = 0; i < 5; i++)
+    total->filters[i] += stats->filters[i];
+}
+
+//-----------------------------------------------------------------------------
+static bool png_segment_callback(void *ctx, uint8_t *data, size_t size)
+{
+  SegmentTask *task = (SegmentTask *)ctx;
+
+  if ((task->ptr + size) > task->size)
+    return false;
+
+  memcpy(&task->buf[task->ptr], data, size);
+  task->ptr += size;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void png_segment_task(void *arg)
+{
+  SegmentTask *task = (SegmentTask *)arg;
+  int flags = DEFLATE_RAW | (task->last ? 0 : DEFLATE_PARTIAL);
+
+  task->res = deflate_decompress(task->decoder, task->data, task->end, flags,
+      task->verify ? &task->checksum : NULL, png_segment_callback, task);
+  task->res = task->res && (task->ptr == task->size);
+}
+
+//-----------------------------------------------------------------------------
+static bool png_image_inflate_parallel(PNGDecoder *decoder, RowDecoder *dec,
+    InflateSegment *segments, int count, InflateChecksum *checksum)
+{
+  PNGAllocator *allocator = &decoder->allocator;
+  SegmentTask tasks[PNG_MAX_SEGMENTS];
+  ThreadPoolGroup group;
+  bool res = true;
+
+  thread_pool_group_init(&group);
+
+  // Later segments are decompressed into row buffers by the pool, while the
+  // first one goes straight through the row pipeline. Segment contexts and
+  // their buffers are reused between decodes, like the decoder's own.
+  for (int i = 1; i < count; i++)
+  {
+    SegmentTask *task = &tasks[i];
+    PNGDecoder *segment = &decoder->state->segments[i - 1];
+
+    if (!segment->allocator.alloc)
+      png_decoder_init(segment, allocator);
+
+    segment->limits = decoder->limits;
+    segment->stats  = NULL;
+
+    task->decoder = NULL;
+    task->data = segments[i].data;
+    task->end  = segments[i].end;
+    task->last = (i == (count - 1));
+    task->size = (size_t)segments[i].rows * (dec->line_size + 1);
+    task->ptr  = 0;
+    task->res  = false;
+    task->verify = (NULL != checksum);
+    task->checksum.adler   = CHECKSUM_ADLER32_INIT;
+    task->checksum.trailer = 0;
+    task->checksum.final   = false;
+
+    if (decoder->stats)
+    {
+      memset(&task->stats, 0, sizeof(PNGImageStats));
+      segment->stats = &task->stats;
+    }
+
+    if (!png_decoder_prepare(segment, task->size, 0))
+    {
+      res = false;
+      continue;
+    }
+
+    task->decoder = segment;
+    task->buf = segment->state->lines;
+    segment->state->deadline    = decoder->state->deadline;
+    segment->state->limit_error = false;
+
+    if (!thread_pool_submit(decoder->pool, &group, png_segment_task, task))
+      res = false;
+  }
+
+  if (res)
+  {
+    res = deflate_decompress(decoder, segments[0].data, segments[0].end, DEFLATE_PARTIAL,
+        checksum, png_image_row_callback, dec);
+    res = res && (dec->row == segments[1].first_row) && (0 == dec->ptr);
+  }
+
+  thread_pool_wait(decoder->pool, &group);
+
+  for (int i = 1; i < count; i++)
+  {
+    SegmentTask *task = &tasks[i];
+
+    // Rows are defiltered in order, since the first row of each segment
+    // depends on the last row of the previous one
+    res = res && task->res && png_image_row_callback(dec, task->buf, task->size);
+
+    // Segment checksums are combined into the checksum of the whole stream
+    if (res && checksum)
+    {
+      checksum->adler   = checksum_adler32_combine(checksum->adler, task->checksum.adler, task->size);
+      checksum->trailer = task->checksum.trailer;
+      checksum->final   = task->checksum.final;
+    }
+
+    if (decoder->stats)
+      png_image_add_stats(decoder->stats, &task->stats);
+
+    if (task->decoder && task->decoder->state->limit_error)
+      decoder->state->limit_error = true;
+
+    decoder->state->segments[i - 1].stats = NULL;
+  }
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static bool png_image_idot_segments(uint8_t *idot, uint8_t *idat, uint8_t *idat_end,
+    uint32_t *info, int height, InflateSegment *segments)
+{
+  // Apple's iDOT chunk: segment count (always 2), reserved, height of the
+  // first segment, offset of the first segment, height of the first and the
+  // second segment, offset of the second segment. Offsets are from the start
+  // of the iDOT chunk to the first IDAT chunk of each segment.
+  uint8_t *ptr = idat;
+  uint8_t *second;
+
+  if (2 != info[0] || info[4] == 0 || info[5] == 0 || (info[4] + info[5]) != (uint32_t)height)
+    return false;
+
+  if (info[3] != (uint32_t)(idat - idot) || info[6] >= (uint32_t)(idat_end - idot))
+    return false;
+
+  second = idot + info[6];
+
+  // The second offset must point to one of the IDAT chunks
+  while (ptr < second)
+    ptr += 12 + (((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3]);
+
+  if (ptr != second || ptr == idat)
+    return false;
+
+  segments[0].data      = idat;
+  segments[0].end       = second;
+  segments[0].first_row = 0;
+  segments[0].rows      = info[4];
+  segments[1].data      = second;
+  segments[1].end       = idat_end;
+  segments[1].first_row = info[4];
+  segments[1].rows      = info[5];
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// The buffer holds the ring, the zero prior row, slot flags and a scratch
+// row for each worker
+static size_t png_pipeline_size(int row_size, int height, size_t scratch_size, int *slots)
+{
+  int n = PNG_PIPELINE_RING / row_size;
+
+  if (n < 8)
+    n = 8;
+
+  if (n > height + 2)
+    n = height + 2;
+
+  if (slots)
+    *slots = n;
+
+  return (size_t)(n + 1) * row_size + n + PNG_PIPELINE_WORKERS * scratch_size;
+}
+
+//-----------------------------------------------------------------------------
+static inline uint8_t *png_pipeline_row(RowPipeline *pipe, int row)
+{
+  return &pipe->ring[(size_t)(row % pipe->slots) * pipe->row_size];
+}
+
+//-----------------------------------------------------------------------------
+static void png_pipeline_wait(RowPipeline *pipe)
+{
+  pipe->sleeping++;
+  pthread_cond_wait(&pipe->cond, &pipe->mutex);
+  pipe->sleeping--;
+}
+
+//-----------------------------------------------------------------------------
+static void png_pipeline_wake(RowPipeline *pipe)
+{
+  // Waking threads that have nothing to wait for is the main cost on
+  // machines with few cores
+  if (pipe->sleeping)
+    pthread_cond_broadcast(&pipe->cond);
+}
+
+//-----------------------------------------------------------------------------
+static bool png_pipeline_claim(RowPipeline *pipe, int *first, int *last)
+{
+  int row = pipe->claim;
+  int end = row + 1;
+
+  if (row >= pipe->ready)
+    return false;
+
+  // Rows with None and Sub filters don't read the previous row
+  if (row > 0 && png_pipeline_row(pipe, row)[0] > 1 &&
+      !pipe->done[(row - 1) % pipe->slots])
+    return false;
+
+  while (end < pipe->ready && png_pipeline_row(pipe, end)[0] > 1)
+    end++;
+
+  pipe->claim = end;
+  *first = row;
+  *last  = end;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Called without the lock, returns with the lock held
+static void png_pipeline_process(RowPipeline *pipe, RowDecoder *dec, int first, int last,
+    uint64_t *defilter, uint64_t *convert)
+{
+  PNGImage *image = dec->image;
+
+  for (int row = first; row < last; row++)
+  {
+    uint8_t *line = png_pipeline_row(pipe, row);
+    uint8_t *prior = row ? png_pipeline_row(pipe, row - 1) : pipe->zero;
+    uint64_t time = dec->stats ? png_image_clock() : 0;
+
+    // Filter types are checked as the rows arrive
+    png_image_defilter_row(&line[1], &prior[1], dec->line_size, dec->bpp, line[0]);
+
+    if (dec->stats)
+    {
+      uint64_t now = png_image_clock();
+
+      *defilter += now - time;
+      time = now;
+    }
+
+    png_image_row_convert(dec, &image->data[(size_t)row * image->stride], &line[1], image->width);
+
+    if (dec->stats)
+      *convert += png_image_clock() - time;
+  }
+
+  pthread_mutex_lock(&pipe->mutex);
+
+  for (int row = first; row < last; row++)
+    pipe->done[row % pipe->slots] = 1;
+
+  while (pipe->completed < pipe->ready && pipe->done[pipe->completed % pipe->slots])
+    pipe->completed++;
+
+  png_pipeline_wake(pipe);
+}
+
+//-----------------------------------------------------------------------------
+static void png_pipeline_task(void *arg)
+{
+  RowPipeline *pipe = (RowPipeline *)arg;
+  uint64_t defilter = 0, convert = 0;
+  RowDecoder dec = *pipe->dec;
+  int first, last, index;
+
+  pthread_mutex_lock(&pipe->mutex);
+
+  // Each running worker converts through its own scratch row
+  index = __builtin_ctz(pipe->free_scratch);
+  pipe->free_scratch &= ~(1u << index);
+  dec.rgba = pipe->scratch + (size_t)index * pipe->scratch_size;
+
+  while (png_pipeline_claim(pipe, &first, &last))
+  {
+    pthread_mutex_unlock(&pipe->mutex);
+    png_pipeline_process(pipe, &dec, first, last, &defilter, &convert);
+  }
+
+  pipe->free_scratch |= (1u << index);
+  pipe->active--;
+  pipe->defilter += defilter;
+  pipe->convert  += convert;
+
+  pthread_mutex_unlock(&pipe->mutex);
+}
+
+//-----------------------------------------------------------------------------
+// Called with the lock held, returns once all ready rows are processed
+static void png_pipeline_drain(RowPipeline *pipe, int until)
+{
+  RowDecoder *dec = pipe->dec;
+
+  while (until > pipe->completed)
+  {
+    int first, last;
+
+    // The inflating thread helps instead of waiting, so the decode
+    // can't stall if the pool is busy with other work. It only waits
+    // for rows that are being processed by the workers.
+    if (png_pipeline_claim(pipe, &first, &last))
+    {
+      uint64_t defilter = 0, convert = 0;
+
+      pthread_mutex_unlock(&pipe->mutex);
+      png_pipeline_process(pipe, dec, first, last, &defilter, &convert);
+
+      if (dec->stats)
+      {
+        dec->stats->defilter += defilter;
+        dec->stats->convert  += convert;
+      }
+    }
+    else
+    {
+      png_pipeline_wait(pipe);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Called with the lock held
+static void png_pipeline_publish(RowPipeline *pipe)
+{
+  for (int row = pipe->ready; row < pipe->written; row++)
+    pipe->done[row % pipe->slots] = 0;
+
+  pipe->ready = pipe->written;
+  pipe->limit = pipe->completed;
+
+  while (pipe->claim < pipe->ready && pipe->active < PNG_PIPELINE_WORKERS)
+  {
+    if (!thread_pool_submit(pipe->pool, pipe->group, png_pipeline_task, pipe))
+      break;
+
+    pipe->active++;
+  }
+
+  png_pipeline_wake(pipe);
+}
+
+//-----------------------------------------------------------------------------
+static bool png_pipeline_callback(void *ctx, uint8_t *data, size_t size)
+{
+  RowPipeline *pipe = (RowPipeline *)ctx;
+  RowDecoder *dec = pipe->dec;
+  bool res = true;
+
+  while (size > 0)
+  {
+    uint8_t *line;
+    size_t len;
+
+    if (pipe->written == pipe->height)
+    {
+      res = false; // More data than the image needs
+      break;
+    }
+
+    // The slot is free once its row and the row after it are processed
+    if (0 == pipe->ptr && pipe->written + 2 - pipe->slots > pipe->limit)
+    {
+      pthread_mutex_lock(&pipe->mutex);
+
+      png_pipeline_publish(pipe);
+      png_pipeline_drain(pipe, pipe->written + 2 - pipe->slots);
+
+      pipe->limit = pipe->completed;
+      pthread_mutex_unlock(&pipe->mutex);
+    }
+
+    line = png_pipeline_row(pipe, pipe->written);
+    len  = pipe->row_size - pipe->ptr;
+
+    if (len > size)
+      len = size;
+
+    memcpy(&line[pipe->ptr], data, len);
+    pipe->ptr += len;
+    data += len;
+    size -= len;
+
+    if (pipe->ptr == pipe->row_size)
+    {
+      if (line[0] > 4)
+      {
+        dec->filter_error = true;
+        res = false;
+        break;
+      }
+
+      if (dec->stats)
+        dec->stats->filters[line[0]]++;
+
+      pipe->written++;
+      pipe->ptr = 0;
+    }
+  }
+
+  // Rows are handed over once per inflated block of data
+  pthread_mutex_lock(&pipe->mutex);
+  png_pipeline_publish(pipe);
+  pthread_mutex_unlock(&pipe->mutex);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+// One thread inflates while the workers defilter and convert the rows, so
+// the decode time approaches the inflate time. Only non-interlaced images
+// decoded at full size without a region are pipelined. The buffer is kept
+// in the decoder state.
+static bool png_image_inflate_pipelined(PNGDecoder *decoder, RowDecoder *dec, uint8_t *idat,
+    uint8_t *idat_end, int flags, InflateChecksum *checksum, size_t scratch_size,
+    PNGImageStats *workers)
+{
+  ThreadPoolGroup group;
+  RowPipeline pipe;
+  bool res;
+
+  memset(&pipe, 0, sizeof(RowPipeline));
+
+  pipe.dec          = dec;
+  pipe.pool         = decoder->pool;
+  pipe.group        = &group;
+  pipe.free_scratch = (1u << PNG_PIPELINE_WORKERS) - 1;
+  pipe.row_size     = dec->line_size + 1;
+  pipe.height       = dec->height;
+  pipe.scratch_size = scratch_size;
+
+  png_pipeline_size(pipe.row_size, pipe.height, scratch_size, &pipe.slots);
+
+  pipe.ring    = decoder->state->pipeline;
+  pipe.zero    = pipe.ring + (size_t)pipe.slots * pipe.row_size;
+  pipe.done    = pipe.zero + pipe.row_size;
+  pipe.scratch = pipe.done + pipe.slots;
+
+  memset(pipe.zero, 0, pipe.row_size);
+
+  pthread_mutex_init(&pipe.mutex, NULL);
+  pthread_cond_init(&pipe.cond, NULL);
+
+  thread_pool_group_init(&group);
+
+  res = deflate_decompress(decoder, idat, idat_end, flags, checksum, png_pipeline_callback, &pipe);
+
+  // The rows that are left are finished here, the scratch row of the
+  // inflating thread is the one of the decoder
+  pthread_mutex_lock(&pipe.mutex);
+  png_pipeline_drain(&pipe, pipe.ready);
+  pthread_mutex_unlock(&pipe.mutex);
+
+  thread_pool_wait(decoder->pool, &group);
+
+  pthread_mutex_destroy(&pipe.mutex);
+  pthread_cond_destroy(&pipe.cond);
+
+  workers->defilter = pipe.defilter;
+  workers->convert  = pipe.convert;
+
+  if (pipe.ready == pipe.height)
+    dec->pass = dec->last_pass + 1;
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static bool png_image_chunk_crc(ByteStream *stream, uint8_t *chunk, bool verify)
+{
+  // The CRC covers the chunk type and data, but not the length
+  uint8_t *end = stream->data;
+  uint32_t crc = byte_stream_word_be(stream);
+
+  if (!verify || stream->error)
+    return true;
+
+  return crc == checksum_crc32(CHECKSUM_CRC32_INIT, chunk + 4, end - chunk - 4);
+}
+
+//-----------------------------------------------------------------------------
+static int png_image_parse_header(ByteStream *stream, PNGImageInfo *info, bool verify)
+{
+  uint8_t *chunk;
+  uint32_t ch_len, ch_type;
+  int comp, filter;
+
+  if (PNG_HEADER_1 != byte_stream_word(stream))
+    return PNG_IMAGE_HEADER_1_ERROR;
+
+  if (PNG_HEADER_2 != byte_stream_word(stream))
+    return PNG_IMAGE_HEADER_2_ERROR;
+
+  chunk   = stream->data;
+  ch_len  = byte_stream_word_be(stream);
+  ch_type = byte_stream_word(stream);
+
+  // IHDR must be the first chunk
+  if (PNG_IHDR != ch_type || 13 != ch_len)
+    return PNG_IMAGE_IHDR_HEADER_ERROR;
+
+  info->width     = byte_stream_word_be(stream);
+  info->height    = byte_stream_word_be(stream);
+  info->depth     = byte_stream_byte(stream);
+  info->type      = byte_stream_byte(stream);
+  comp            = byte_stream_byte(stream);
+  filter          = byte_stream_byte(stream);
+  info->interlace = byte_stream_byte(stream);
+
+  if (!png_image_chunk_crc(stream, chunk, verify))
+    return PNG_IMAGE_CRC_ERROR;
+
+  if (stream->error)
+    return PNG_IMAGE_STREAM_ERROR;
+
+  if (info->width <= 0 || info->height <= 0 || comp != 0 || filter != 0 || info->interlace > 1)
+    return PNG_IMAGE_IHDR_OPTION_ERROR;
+
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+static bool png_image_valid_depth(int type, int depth)
+{
+  if (PNG_IMAGE_TYPE_GRAY == type)
+    return (1 == depth || 2 == depth || 4 == depth || 8 == depth || 16 == depth);
+  else if (PNG_IMAGE_TYPE_PALETTE == type)
+    return (1 == depth || 2 == depth || 4 == depth || 8 == depth);
+  else
+    return (8 == depth || 16 == depth);
+}
+
+//-----------------------------------------------------------------------------
+static int png_image_check_header(const PNGImageInfo *info)
+{
+  if (info->type > PNG_IMAGE_TYPE_RGBA || 0 == png_channels[info->type])
+    return PNG_IMAGE_IHDR_TYPE_ERROR;
+
+  if (!png_image_valid_depth(info->type, info->depth))
+    return PNG_IMAGE_IHDR_OPTION_ERROR;
+
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+static int png_image_pixel_size(int format, int type, int depth)
+{
+  if (PNG_IMAGE_FORMAT_NATIVE == format)
+    return png_channels[type] * ((16 == depth) ? 2 : 1);
+
+  return (PNG_IMAGE_FORMAT_RGB == format) ? 3 : 4;
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_reset_palette(PNGImage *image, const PNGImageInfo *info)
+{
+  image->type         = info->type;
+  image->depth        = (16 == info->depth) ? 16 : 8;
+  image->palette_size = 0;
+  image->transparency = false;
+
+  // Indices outside of the palette decode as opaque black
+  for (int i = 0; i < 256; i++)
+  {
+    image->palette[i * 4 + 0] = 0;
+    image->palette[i * 4 + 1] = 0;
+    image->palette[i * 4 + 2] = 0;
+    image->palette[i * 4 + 3] = 255;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static bool png_image_parse_palette(ByteStream *stream, PNGImage *image, uint32_t ch_len)
+{
+  if (image->palette_size || 0 == ch_len || ch_len > 256 * 3 || (ch_len % 3) ||
+      PNG_IMAGE_TYPE_GRAY == image->type || PNG_IMAGE_TYPE_GRAY_ALPHA == image->type)
+    return false;
+
+  image->palette_size = ch_len / 3;
+
+  for (int i = 0; i < image->palette_size; i++)
+  {
+    image->palette[i * 4 + 0] = byte_stream_byte(stream);
+    image->palette[i * 4 + 1] = byte_stream_byte(stream);
+    image->palette[i * 4 + 2] = byte_stream_byte(stream);
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_parse_transparency(ByteStream *stream, PNGImage *image, int depth, uint32_t ch_len)
+{
+  int mask = (1 << depth) - 1;
+  int scale = png_gray_scale(depth);
+
+  if (PNG_IMAGE_TYPE_PALETTE == image->type && ch_len <= (uint32_t)image->palette_size)
+  {
+    for (int i = 0; i < (int)ch_len; i++)
+      image->palette[i * 4 + 3] = byte_stream_byte(stream);
+  }
+  else if (PNG_IMAGE_TYPE_GRAY == image->type && 2 == ch_len)
+  {
+    // The key is stored in the same scale as the native samples
+    image->transparent[0] = (byte_stream_word16_be(stream) & mask) * scale;
+    image->transparency = true;
+  }
+  else if (PNG_IMAGE_TYPE_RGB == image->type && 6 == ch_len)
+  {
+    for (int i = 0; i < 3; i++)
+      image->transparent[i] = byte_stream_word16_be(stream) & mask;
+
+    image->transparency = true;
+  }
+  else
+  {
+    // Malformed transparency is ignored, the chunk is not critical
+    byte_stream_buf(stream, NULL, ch_len);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void png_image_update_stats(PNGImageStats *stats, uint64_t start, uint64_t inflate_start,
+    uint64_t rows_time)
+{
+  // Defiltering and conversion run from the inflate output callback
+  uint64_t inflate = png_image_clock() - inflate_start;
+
+  rows_time = stats->defilter + stats->convert - rows_time;
+
+  stats->parse   += inflate_start - start;
+  stats->inflate += inflate - rows_time;
+}
+
+//-----------------------------------------------------------------------------
+// Decompresses and converts the image data once all of the chunks before it
+// are parsed. Segments are set if the data can be decompressed in parallel.
+static int png_image_decode_data(PNGDecoder *decoder, PNGImage *image, const PNGImageInfo *info,
+    const PNGRect *region, uint8_t *idat, uint8_t *idat_end, int flags, bool allocate,
+    const BandSink *sink, InflateSegment *segments, uint64_t start)
+{
+  int width = info->width;
+  int height = info->height;
+  int bits = png_channels[info->type] * info->depth;
+  uint64_t row_bits = (uint64_t)width * bits;
+  int pixel_size = png_image_pixel_size(image->format, info->type, info->depth);
+  int scale = decoder->scale;
+  int mask = (1 << scale) - 1;
+  int out_width = (region->width + mask) >> scale;
+  int out_height = (region->height + mask) >> scale;
+  int line_size, out_rows;
+  size_t sums_size = 0, pixels_size = 0, rgba_size = 0, packed_size = 0, pipeline_size = 0;
+  size_t data_size;
+  InflateChecksum checksum = { CHECKSUM_ADLER32_INIT, 0, false };
+  InflateChecksum *check = decoder->verify ? &checksum : NULL;
+  PNGImageStats *stats = decoder->stats;
+  PNGImageStats workers;
+  PNGDecoderState *state;
+  uint64_t inflate_start, rows_time;
+  bool pipeline;
+  RowDecoder dec;
+  bool res = false;
+
+  // Each Adam7 pass covers the whole image
+  if (sink && info->interlace)
+    return PNG_IMAGE_IHDR_OPTION_ERROR;
+
+  if (PNG_IMAGE_TYPE_PALETTE == info->type && 0 == image->palette_size)
+    return PNG_IMAGE_PALETTE_ERROR;
+
+  // Offsets within a row are int, offsets within the image are size_t
+  if (row_bits > INT32_MAX || (uint64_t)width * ((pixel_size > 4) ? pixel_size : 4) > INT32_MAX)
+    return PNG_IMAGE_SIZE_ERROR;
+
+  line_size = (row_bits + 7) / 8;
+
+  // Rows up to the bottom of the region can't be produced by the data, so the
+  // decode fails before the image is allocated. Interlaced images are only
+  // checked as they are decompressed.
+  if (decoder->limits.ratio && !info->interlace && (uint64_t)(line_size + 1) *
+      (region->y + region->height) / decoder->limits.ratio > (uint64_t)(idat_end - idat))
+    return PNG_IMAGE_LIMIT_ERROR;
+
+  if (!allocate && (out_width > image->width || out_height > image->height ||
+      image->stride < out_width * pixel_size))
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  // Palette indices can't be averaged
+  dec.subsample = decoder->subsample ||
+      (PNG_IMAGE_FORMAT_NATIVE == image->format && PNG_IMAGE_TYPE_PALETTE == info->type);
+
+  if (PNG_IMAGE_FORMAT_NATIVE == image->format)
+  {
+    dec.unpack  = unpack_native;
+    dec.convert = NULL;
+  }
+  else if (8 == info->depth && !image->transparency &&
+      (PNG_IMAGE_TYPE_RGB == info->type || PNG_IMAGE_TYPE_RGBA == info->type))
+  {
+    dec.unpack  = NULL;
+    dec.convert = convert_kernels[(PNG_IMAGE_TYPE_RGB == info->type) ? 0 : 1][image->format];
+  }
+  else
+  {
+    dec.unpack  = unpack_rgba;
+    dec.convert = (PNG_IMAGE_FORMAT_RGBA == image->format) ? NULL :
+        convert_kernels[1][image->format];
+  }
+
+  // Interlaced and box filtered images need one more row for the converted
+  // pixels, box filtered images also need the sums for one output row
+  if (scale && !info->interlace && !dec.subsample)
+    sums_size = (size_t)out_width * pixel_size * sizeof(uint32_t);
+
+  if (info->interlace || sums_size)
+    pixels_size = (size_t)width * pixel_size;
+
+  if (dec.unpack && dec.convert)
+    rgba_size = (size_t)width * 4;
+
+  // Rows are repacked when sub-byte pixels don't start on a byte boundary
+  packed_size = line_size;
+
+  pipeline = decoder->pool && online_cpus > 1 && 0 == scale && !info->interlace &&
+      !segments && !sink && width == region->width && height == region->height &&
+      (uint64_t)(line_size + 1) * height >= PNG_PIPELINE_MIN_SIZE;
+
+  if (pipeline)
+    pipeline_size = png_pipeline_size(line_size + 1, height, rgba_size, NULL);
+
+  // Rows are defiltered and converted as soon as they are decompressed,
+  // so only two scanlines are kept in addition to the output image
+  if (!png_decoder_prepare(decoder, sums_size + pixels_size + rgba_size + packed_size +
+      2 * (line_size + 1), pipeline_size))
+    return PNG_IMAGE_MALLOC_ERROR;
+
+  // The cycle budget includes parsing of the chunks before the image data
+  state = decoder->state;
+  state->deadline    = decoder->limits.cycles ? start + decoder->limits.cycles : 0;
+  state->limit_error = false;
+
+  if (allocate)
+  {
+    // Bands only need the buffer for one band
+    out_rows = (sink && sink->height < out_height) ? sink->height : out_height;
+    image->stride = out_width * pixel_size;
+
+    if (!png_size_mul(image->stride, out_rows, &data_size))
+      return PNG_IMAGE_SIZE_ERROR;
+
+    image->data = (uint8_t *)malloc(data_size);
+
+    if (!image->data)
+      return PNG_IMAGE_MALLOC_ERROR;
+  }
+
+  image->width  = out_width;
+  image->height = out_height;
+
+  dec.image        = image;
+  dec.type         = info->type;
+  dec.depth        = info->depth;
+  dec.bits         = bits;
+  dec.bpp          = (bits + 7) / 8;
+  dec.pixel_size   = pixel_size;
+  dec.sample_size  = (PNG_IMAGE_FORMAT_NATIVE == image->format && 16 == info->depth) ? 2 : 1;
+  dec.src_width    = width;
+  dec.src_height   = height;
+  dec.crop_x       = region->x;
+  dec.crop_y       = region->y;
+  dec.crop_width   = region->width;
+  dec.crop_height  = region->height;
+  dec.scale        = scale;
+  dec.sums         = sums_size ? (uint32_t *)state->lines : NULL;
+  dec.pixels       = state->lines + sums_size;
+  dec.rgba         = dec.pixels + pixels_size;
+  dec.packed       = dec.rgba + rgba_size;
+  dec.replicate    = decoder->replicate;
+  dec.progress     = decoder->progress;
+  dec.progress_ctx = decoder->progress_ctx;
+  dec.stats        = stats;
+  dec.sink         = sink;
+  dec.band_y       = 0;
+  dec.sink_error   = false;
+
+  png_image_row_reset(&dec, dec.packed + packed_size, info->interlace);
+
+  rows_time     = stats ? stats->defilter + stats->convert : 0;
+  inflate_start = stats ? png_image_clock() : 0;
+
+  if (segments)
+  {
+    PNGImageStats saved;
+
+    if (stats)
+      saved = *stats;
+
+    res = png_image_inflate_parallel(decoder, &dec, segments, PNG_MAX_SEGMENTS, check);
+
+    // Segments that turn out not to be independent are decoded serially,
+    // with the limits checked again for the whole stream. Only the serial
+    // decode is counted, the wasted time goes to inflate.
+    if (!res)
+    {
+      png_image_row_reset(&dec, dec.packed + packed_size, false);
+      checksum.adler = CHECKSUM_ADLER32_INIT;
+      state->limit_error = false;
+
+      if (stats)
+        *stats = saved;
+    }
+  }
+
+  memset(&workers, 0, sizeof(PNGImageStats));
+
+  if (!res && pipeline && state->pipeline_size >= pipeline_size)
+    res = png_image_inflate_pipelined(decoder, &dec, idat, idat_end, flags, check, rgba_size, &workers);
+  else if (!res)
+    res = deflate_decompress(decoder, idat, idat_end, flags, check, png_image_row_callback, &dec);
+
+  // Time spent in the workers overlaps with the inflate time
+  if (stats)
+  {
+    png_image_update_stats(stats, start, inflate_start, rows_time);
+    png_image_add_stats(stats, &workers);
+  }
+
+  if (dec.sink_error)
+    return PNG_IMAGE_CALLBACK_ERROR;
+
+  if (state->limit_error)
+    return PNG_IMAGE_LIMIT_ERROR;
+
+  // Regions and scaled interlaced images don't need all of the data
+  if ((!res && !dec.partial) || dec.pass <= dec.last_pass)
+    return dec.filter_error ? PNG_IMAGE_DEFILTER_ERROR : PNG_IMAGE_DECOMPRESS_ERROR;
+
+  // Decodes that stop early never get to the trailer, so only the chunk
+  // CRCs are verified for them
+  if (checksum.final && checksum.adler != checksum.trailer)
+    return PNG_IMAGE_ADLER_ERROR;
+
+  if (sink && dec.band_y < out_height)
+    png_image_flush_band(&dec, out_height - dec.band_y);
+
+  return dec.sink_error ? PNG_IMAGE_CALLBACK_ERROR : PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+static int png_image_decode(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size,
+    bool allocate, const PNGRect *rect, const BandSink *sink)
+{
+  int width, height, res, mask;
+  PNGRect region;
+  uint8_t *idat = NULL, *idat_end = NULL, *idot = NULL;
+  uint32_t idot_info[7];
+  bool idat_done = false;
+  uint64_t start = (decoder->stats || decoder->limits.cycles) ? png_image_clock() : 0;
+  PNGImageInfo info;
+  ByteStream stream;
+
+  byte_stream_init(&stream, data, size);
+
+  res = png_image_parse_header(&stream, &info, decoder->verify);
+
+  if (PNG_IMAGE_SUCCESS == res)
+    res = png_image_check_header(&info);
+
+  if (PNG_IMAGE_SUCCESS != res)
+    return res;
+
+  if (decoder->scale < 0 || decoder->scale > 3)
+    return PNG_IMAGE_ERROR;
+
+  width  = info.width;
+  height = info.height;
+  mask   = (1 << decoder->scale) - 1;
+
+  region.x      = 0;
+  region.y      = 0;
+  region.width  = width;
+  region.height = height;
+
+  if (rect)
+  {
+    if (rect->x < 0 || rect->y < 0 || rect->width <= 0 || rect->height <= 0 ||
+        rect->x > width - rect->width || rect->y > height - rect->height)
+      return PNG_IMAGE_REGION_ERROR;
+
+    // The region is aligned to the grid of the reduced image
+    region.x      = rect->x & ~mask;
+    region.y      = rect->y & ~mask;
+    region.width  = rect->width + (rect->x & mask);
+    region.height = rect->height + (rect->y & mask);
+  }
+
+  png_image_reset_palette(image, &info);
+
+  while (1)
+  {
+    uint8_t *chunk = stream.data;
+    uint32_t ch_len  = byte_stream_word_be(&stream);
+    uint32_t ch_type = byte_stream_word(&stream);
+    int letter  = ch_type & 0xff;
+    bool mandatory = ('A' <= letter && letter <= 'Z');
+
+    // Chunk lengths are limited to 2^31 - 1 bytes by the specification
+    if (stream.error || ch_len > INT32_MAX)
+      return PNG_IMAGE_STREAM_ERROR;
+
+    if (idat && !idat_done && PNG_IDAT != ch_type)
+    {
+      idat_done = true;
+      idat_end = chunk;
+    }
+
+    if (PNG_IHDR == ch_type)
+    {
+      return PNG_IMAGE_IHDR_HEADER_ERROR;
+    }
+    else if (PNG_IDAT == ch_type)
+    {
+      // IDAT chunks must be consecutive, they are decompressed in place later
+      if (idat_done)
+        return PNG_IMAGE_IDAT_SIZE_ERROR;
+
+      if (!idat)
+        idat = chunk;
+
+      byte_stream_buf(&stream, NULL, ch_len);
+    }
+    else if (PNG_IDOT == ch_type && 28 == ch_len && !idat)
+    {
+      idot = chunk;
+
+      for (int i = 0; i < 7; i++)
+        idot_info[i] = byte_stream_word_be(&stream);
+    }
+    else if (PNG_PLTE == ch_type)
+    {
+      if (idat || !png_image_parse_palette(&stream, image, ch_len))
+        return PNG_IMAGE_PALETTE_ERROR;
+    }
+    else if (PNG_TRNS == ch_type && !idat)
+    {
+      png_image_parse_transparency(&stream, image, info.depth, ch_len);
+    }
+    else if (PNG_IEND == ch_type)
+    {
+      InflateSegment segments[PNG_MAX_SEGMENTS];
+      bool parallel;
+
+      if (ch_len > 0)
+        return PNG_IMAGE_SIZE_ERROR;
+
+      if (!png_image_chunk_crc(&stream, chunk, decoder->verify))
+        return PNG_IMAGE_CRC_ERROR;
+
+      if (stream.size || stream.error)
+        return PNG_IMAGE_STREAM_ERROR;
+
+      if (!idat)
+        return PNG_IMAGE_IDAT_SIZE_ERROR;
+
+      // Bands passed to the sink can't be taken back by the serial fallback
+      parallel = decoder->pool && idot && !info.interlace && !sink &&
+          png_image_idot_segments(idot, idat, idat_end, idot_info, height, segments) &&
+          segments[1].first_row < (region.y + region.height);
+
+      return png_image_decode_data(decoder, image, &info, &region, idat, idat_end, 0, allocate,
+          sink, parallel ? segments : NULL, start);
+    }
+    else if (mandatory)
+    {
+      return PNG_IMAGE_UNKNOWN_CHUNK_ERROR;
+    }
+    else
+    {
+      byte_stream_buf(&stream, NULL, ch_len);
+    }
+
+    if (!png_image_chunk_crc(&stream, chunk, decoder->verify))
+      return PNG_IMAGE_CRC_ERROR;
+  }
+
+  return PNG_IMAGE_ERROR;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_info(PNGImageInfo *info, uint8_t *data, size_t size)
+{
+  ByteStream stream;
+  int res;
+
+  memset(info, 0, sizeof(PNGImageInfo));
+  byte_stream_init(&stream, data, size);
+
+  res = png_image_parse_header(&stream, info, false);
+
+  if (PNG_IMAGE_SUCCESS == res)
+    res = png_image_check_header(info);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+void png_decoder_init(PNGDecoder *decoder, const PNGAllocator *allocator)
+{
+  memset(decoder, 0, sizeof(PNGDecoder));
+
+  if (allocator)
+  {
+    decoder->allocator = *allocator;
+  }
+  else
+  {
+    decoder->allocator.alloc = default_alloc;
+    decoder->allocator.free  = default_free;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void png_decoder_free(PNGDecoder *decoder)
+{
+  PNGDecoderState *state;
+  PNGAllocator allocator;
+
+  assert(decoder);
+
+  allocator = decoder->allocator;
+  state = decoder->state;
+
+  if (state)
+  {
+    if (state->window)
+      allocator.free(allocator.ctx, state->window);
+
+    if (state->lit_table)
+      allocator.free(allocator.ctx, state->lit_table);
+
+    if (state->dist_table)
+      allocator.free(allocator.ctx, state->dist_table);
+
+    if (state->lines)
+      allocator.free(allocator.ctx, state->lines);
+
+    if (state->pipeline)
+      allocator.free(allocator.ctx, state->pipeline);
+
+    for (int i = 0; i < PNG_MAX_SEGMENTS - 1; i++)
+      png_decoder_free(&state->segments[i]);
+
+    allocator.free(allocator.ctx, state);
+  }
+
+  png_decoder_init(decoder, &allocator);
+}
+
+//-----------------------------------------------------------------------------
+int png_decoder_read(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size)
+{
+  return png_decoder_read_as(decoder, image, data, size, PNG_IMAGE_FORMAT_RGBA);
+}
+
+//-----------------------------------------------------------------------------
+int png_decoder_read_as(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size, int format)
+{
+  return png_decoder_read_region(decoder, image, data, size, format, NULL);
+}
+
+//-----------------------------------------------------------------------------
+int png_decoder_read_region(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size,
+    int format, const PNGRect *rect)
+{
+  int res;
+
+  memset(image, 0, sizeof(PNGImage));
+
+  if (format < 0 || format >= PNG_IMAGE_FORMAT_COUNT)
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  image->format = format;
+
+  res = png_image_decode(decoder, image, data, size, true, rect, NULL);
+
+  if (PNG_IMAGE_SUCCESS != res)
+    png_image_free(image);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int png_decoder_read_into(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size)
+{
+  // The stride is checked once the pixel size of the image is known
+  if (image->format < 0 || image->format >= PNG_IMAGE_FORMAT_COUNT || !image->data)
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  if (image->width < 0 || image->height < 0)
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  return png_image_decode(decoder, image, data, size, false, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+int png_decoder_read_bands(PNGDecoder *decoder, uint8_t *data, size_t size, int format,
+    int band_height, PNGBandCallback callback, void *ctx)
+{
+  BandSink sink = { callback, ctx, band_height };
+  PNGImage image;
+  int res;
+
+  if (format < 0 || format >= PNG_IMAGE_FORMAT_COUNT || band_height <= 0 || !callback)
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  memset(&image, 0, sizeof(PNGImage));
+  image.format = format;
+
+  res = png_image_decode(decoder, &image, data, size, true, NULL, &sink);
+
+  png_image_free(&image);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static bool png_tensor_band(const PNGImage *band, int y, void *ctx)
+{
+  PNGTensor *tensor = (PNGTensor *)ctx;
+  PlanarFunc planar = planar_kernels[tensor->float32 ? 1 : 0];
+
+  for (int i = 0; i < band->height; i++)
+    planar(tensor, (uint8_t *)tensor->data + (size_t)(y + i) * tensor->stride,
+        &band->data[(size_t)i * band->stride], band->width);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+int png_decoder_read_tensor(PNGDecoder *decoder, PNGTensor *tensor, uint8_t *data, size_t size)
+{
+  // Each row is split into planes as soon as the next one is converted,
+  // while it is still in the cache
+  BandSink sink = { png_tensor_band, tensor, 1 };
+  size_t sample_size = tensor->float32 ? sizeof(float) : 1;
+  size_t stride, plane_size, data_size;
+  bool allocate = !tensor->data;
+  int width, height, mask, res;
+  PNGImageInfo info;
+  PNGImage image;
+
+  if (3 != tensor->channels && 4 != tensor->channels)
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  if (decoder->scale < 0 || decoder->scale > 3)
+    return PNG_IMAGE_ERROR;
+
+  res = png_image_info(&info, data, size);
+
+  if (PNG_IMAGE_SUCCESS != res)
+    return res;
+
+  mask   = (1 << decoder->scale) - 1;
+  width  = (info.width + mask) >> decoder->scale;
+  height = (info.height + mask) >> decoder->scale;
+
+  if (!png_size_mul(width, sample_size, &stride))
+    return PNG_IMAGE_SIZE_ERROR;
+
+  if (allocate)
+  {
+    if (!png_size_mul(stride, height, &plane_size) ||
+        !png_size_mul(plane_size, tensor->channels, &data_size))
+      return PNG_IMAGE_SIZE_ERROR;
+
+    tensor->data = malloc(data_size);
+
+    if (!tensor->data)
+      return PNG_IMAGE_MALLOC_ERROR;
+
+    tensor->stride       = stride;
+    tensor->plane_stride = plane_size;
+  }
+  else
+  {
+    if (width > tensor->width || height > tensor->height || tensor->stride < stride ||
+        !png_size_mul(tensor->stride, height, &plane_size) || tensor->plane_stride < plane_size)
+      return PNG_IMAGE_BUFFER_ERROR;
+
+    if (((uintptr_t)tensor->data | tensor->stride | tensor->plane_stride) % sample_size)
+      return PNG_IMAGE_BUFFER_ERROR;
+  }
+
+  tensor->width  = width;
+  tensor->height = height;
+
+  memset(&image, 0, sizeof(PNGImage));
+  image.format = PNG_IMAGE_FORMAT_RGBA;
+
+  // Adam7 passes update rows all over the image, so interlaced images are
+  // split once they are complete
+  if (info.interlace)
+  {
+    res = png_image_decode(decoder, &image, data, size, true, NULL, NULL);
+
+    if (PNG_IMAGE_SUCCESS == res)
+    {
+      uint64_t time = decoder->stats ? png_image_clock() : 0;
+
+      png_tensor_band(&image, 0, tensor);
+
+      if (decoder->stats)
+        decoder->stats->convert += png_image_clock() - time;
+    }
+  }
+  else
+  {
+    res = png_image_decode(decoder, &image, data, size, true, NULL, &sink);
+  }
+
+  png_image_free(&image);
+
+  if (PNG_IMAGE_SUCCESS != res && allocate)
+  {
+    free(tensor->data);
+    tensor->data = NULL;
+  }
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *png_file_read(int fd, size_t *size)
+{
+  size_t capacity = FILE_READ_SIZE;
+  uint8_t *data = malloc(capacity);
+  ssize_t len;
+
+  *size = 0;
+
+  while (data)
+  {
+    if (*size == capacity)
+    {
+      uint8_t *ptr = realloc(data, capacity * 2);
+
+      if (!ptr)
+        break;
+
+      data = ptr;
+      capacity *= 2;
+    }
+
+    len = read(fd, &data[*size], capacity - *size);
+
+    if (0 == len)
+      return data;
+
+    if (len < 0)
+      break;
+
+    *size += len;
+  }
+
+  free(data);
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+int png_decoder_read_file(PNGDecoder *decoder, PNGImage *image, const char *path, int format)
+{
+  struct stat stat;
+  uint8_t *data = MAP_FAILED;
+  size_t size = 0;
+  int fd, res;
+
+  memset(image, 0, sizeof(PNGImage));
+
+  fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return PNG_IMAGE_FILE_ERROR;
+
+  if (fstat(fd, &stat) < 0)
+  {
+    close(fd);
+    return PNG_IMAGE_FILE_ERROR;
+  }
+
+  // The decoder reads the data in place, so the pages are only touched once
+  if (S_ISREG(stat.st_mode) && stat.st_size > 0 && (uint64_t)stat.st_size <= SIZE_MAX)
+  {
+    size = stat.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (MAP_FAILED != data)
+      posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+  }
+
+  if (MAP_FAILED == data)
+  {
+    uint8_t *buf = png_file_read(fd, &size);
+
+    close(fd);
+
+    if (!buf)
+      return PNG_IMAGE_FILE_ERROR;
+
+    res = png_decoder_read_as(decoder, image, buf, size, format);
+    free(buf);
+
+    return res;
+  }
+
+  close(fd);
+
+  res = png_decoder_read_as(decoder, image, data, size, format);
+  munmap(data, size);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_read(PNGImage *image, uint8_t *data, size_t size)
+{
+  PNGDecoder decoder;
+  int res;
+
+  png_decoder_init(&decoder, NULL);
+  res = png_decoder_read(&decoder, image, data, size);
+  png_decoder_free(&decoder);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_read_as(PNGImage *image, uint8_t *data, size_t size, int format)
+{
+  PNGDecoder decoder;
+  int res;
+
+  png_decoder_init(&decoder, NULL);
+  res = png_decoder_read_as(&decoder, image, data, size, format);
+  png_decoder_free(&decoder);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_read_region(PNGImage *image, uint8_t *data, size_t size, int format, const PNGRect *rect)
+{
+  PNGDecoder decoder;
+  int res;
+
+  png_decoder_init(&decoder, NULL);
+  res = png_decoder_read_region(&decoder, image, data, size, format, rect);
+  png_decoder_free(&decoder);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_read_into(PNGImage *image, uint8_t *data, size_t size)
+{
+  PNGDecoder decoder;
+  int res;
+
+  png_decoder_init(&decoder, NULL);
+  res = png_decoder_read_into(&decoder, image, data, size);
+  png_decoder_free(&decoder);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_read_file(PNGImage *image, const char *path, int format)
+{
+  PNGDecoder decoder;
+  int res;
+
+  png_decoder_init(&decoder, NULL);
+  res = png_decoder_read_file(&decoder, image, path, format);
+  png_decoder_free(&decoder);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_read_tensor(PNGTensor *tensor, uint8_t *data, size_t size)
+{
+  PNGDecoder decoder;
+  int res;
+
+  png_decoder_init(&decoder, NULL);
+  res = png_decoder_read_tensor(&decoder, tensor, data, size);
+  png_decoder_free(&decoder);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static void png_rect_union(PNGRect *rect, const PNGRect *other)
+{
+  int x1, y1;
+
+  if (0 == other->width || 0 == other->height)
+    return;
+
+  if (0 == rect->width || 0 == rect->height)
+  {
+    *rect = *other;
+    return;
+  }
+
+  x1 = (rect->x + rect->width > other->x + other->width) ? rect->x + rect->width : other->x + other->width;
+  y1 = (rect->y + rect->height > other->y + other->height) ? rect->y + rect->height : other->y + other->height;
+
+  rect->x      = (rect->x < other->x) ? rect->x : other->x;
+  rect->y      = (rect->y < other->y) ? rect->y : other->y;
+  rect->width  = x1 - rect->x;
+  rect->height = y1 - rect->y;
+}
+
+//-----------------------------------------------------------------------------
+static int png_animation_parse_frame(ByteStream *stream, PNGAnimation *anim, PNGFrame *frame,
+    uint32_t ch_len, uint32_t sequence)
+{
+  uint32_t width, height, x, y;
+
+  if (26 != ch_len || byte_stream_word_be(stream) != sequence)
+    return PNG_IMAGE_FRAME_ERROR;
+
+  width  = byte_stream_word_be(stream);
+  height = byte_stream_word_be(stream);
+  x      = byte_stream_word_be(stream);
+  y      = byte_stream_word_be(stream);
+
+  frame->delay_num = byte_stream_word16_be(stream);
+  frame->delay_den = byte_stream_word16_be(stream);
+  frame->dispose   = byte_stream_byte(stream);
+  frame->blend     = byte_stream_byte(stream);
+
+  if (0 == width || 0 == height || (uint64_t)x + width > (uint64_t)anim->canvas.width ||
+      (uint64_t)y + height > (uint64_t)anim->canvas.height ||
+      frame->dispose > PNG_DISPOSE_PREVIOUS || frame->blend > PNG_BLEND_OVER)
+    return PNG_IMAGE_FRAME_ERROR;
+
+  frame->x      = x;
+  frame->y      = y;
+  frame->width  = width;
+  frame->height = height;
+
+  // A zero denominator means 1/100 of a second
+  if (0 == frame->delay_den)
+    frame->delay_den = 100;
+
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *png_animation_buffer(PNGAnimation *anim, uint8_t **buf)
+{
+  PNGAllocator *allocator = &anim->decoder->allocator;
+
+  // Frames are never larger than the canvas, so one allocation is enough
+  if (!*buf)
+    *buf = allocator->alloc(allocator->ctx, (size_t)anim->canvas.stride * anim->canvas.height);
+
+  return *buf;
+}
+
+//-----------------------------------------------------------------------------
+static void png_animation_copy(PNGAnimation *anim, const PNGFrame *frame, uint8_t *buf, bool save)
+{
+  PNGImage *canvas = &anim->canvas;
+  int size = frame->width * 4;
+
+  for (int y = 0; y < frame->height; y++)
+  {
+    uint8_t *row = &canvas->data[(size_t)(frame->y + y) * canvas->stride + frame->x * 4];
+
+    if (save)
+      memcpy(&buf[(size_t)y * size], row, size);
+    else
+      memcpy(row, &buf[(size_t)y * size], size);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void png_animation_dispose(PNGAnimation *anim, PNGRect *rect)
+{
+  PNGImage *canvas = &anim->canvas;
+  PNGFrame *frame = &anim->frame;
+
+  rect->x      = frame->x;
+  rect->y      = frame->y;
+  rect->width  = frame->width;
+  rect->height = frame->height;
+
+  if (PNG_DISPOSE_BACKGROUND == frame->dispose)
+  {
+    for (int y = 0; y < frame->height; y++)
+      memset(&canvas->data[(size_t)(frame->y + y) * canvas->stride + frame->x * 4], 0, frame->width * 4);
+  }
+  else if (PNG_DISPOSE_PREVIOUS == frame->dispose)
+  {
+    png_animation_copy(anim, frame, anim->saved, false);
+  }
+  else
+  {
+    rect->width  = 0;
+    rect->height = 0;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void png_animation_blend(PNGAnimation *anim, const PNGFrame *frame)
+{
+  PNGImage *canvas = &anim->canvas;
+  bool premultiplied = (PNG_IMAGE_FORMAT_PREMULTIPLIED_RGBA == canvas->format);
+
+  for (int y = 0; y < frame->height; y++)
+  {
+    uint8_t *dst = &canvas->data[(size_t)(frame->y + y) * canvas->stride + frame->x * 4];
+    uint8_t *src = &anim->scratch[(size_t)y * frame->width * 4];
+
+    for (int x = 0; x < frame->width; x++, dst += 4, src += 4)
+    {
+      int sa = src[3];
+
+      if (255 == sa)
+      {
+        memcpy(dst, src, 4);
+      }
+      else if (0 == sa)
+      {
+        continue;
+      }
+      else if (premultiplied)
+      {
+        for (int c = 0; c < 4; c++)
+          dst[c] = src[c] + (dst[c] * (255 - sa) + 127) / 255;
+      }
+      else
+      {
+        // Both weights are scaled by 255
+        int fs = sa * 255;
+        int fd = dst[3] * (255 - sa);
+        int fa = fs + fd;
+
+        for (int c = 0; c < 3; c++)
+          dst[c] = (src[c] * fs + dst[c] * fd + fa / 2) / fa;
+
+        dst[3] = (fa + 127) / 255;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+int png_animation_init(PNGAnimation *anim, PNGDecoder *decoder, uint8_t *data, size_t size, int format)
 {
-  int width = 0, height = 0, depth, type, comp, filter, interlace, bpp = 0;
-  uint8_t *compressed_data = (uint8_t *)malloc(size);
-  int compressed_size = 0;
-  bool first_chunk = true;
-  bool have_header = false;
+  PNGImage *canvas = &anim->canvas;
+  size_t canvas_size;
   ByteStream stream;
+  int res;
 
-  memset(image, 0, sizeof(PNGImage));
+  memset(anim, 0, sizeof(PNGAnimation));
 
-  if (!compressed_data)
-    return PNG_IMAGE_MALLOC_ERROR;
+  anim->decoder = decoder;
+  anim->end     = data + size;
+  anim->frames  = 1;
+  anim->index   = -1;
+  anim->single  = true;
+
+  // Frames are composited with the alpha of the canvas
+  if (PNG_IMAGE_FORMAT_RGBA != format && PNG_IMAGE_FORMAT_BGRA != format &&
+      PNG_IMAGE_FORMAT_PREMULTIPLIED_RGBA != format)
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  if (decoder->scale)
+    return PNG_IMAGE_ERROR;
 
   byte_stream_init(&stream, data, size);
 
-  if (PNG_HEADER_1 != byte_stream_word(&stream))
-    return PNG_IMAGE_HEADER_1_ERROR;
+  res = png_image_parse_header(&stream, &anim->info, decoder->verify);
 
-  if (PNG_HEADER_2 != byte_stream_word(&stream))
-    return PNG_IMAGE_HEADER_2_ERROR;
+  if (PNG_IMAGE_SUCCESS == res)
+    res = png_image_check_header(&anim->info);
+
+  if (PNG_IMAGE_SUCCESS != res)
+    return res;
+
+  png_image_reset_palette(canvas, &anim->info);
+  canvas->format = format;
 
+  // Chunks before the first frame control or image data
   while (1)
   {
-    int ch_len  = byte_stream_word_be(&stream);
-    int ch_type = byte_stream_word(&stream);
+    uint8_t *chunk = stream.data;
+    uint32_t ch_len  = byte_stream_word_be(&stream);
+    uint32_t ch_type = byte_stream_word(&stream);
     int letter  = ch_type & 0xff;
     bool mandatory = ('A' <= letter && letter <= 'Z');
 
-    if (stream.error)
+    if (stream.error || ch_len > INT32_MAX)
       return PNG_IMAGE_STREAM_ERROR;
 
-    if (PNG_IHDR == ch_type)
+    if (PNG_IDAT == ch_type || PNG_FCTL == ch_type)
     {
-      if (!first_chunk || 13 != ch_len)
-        return PNG_IMAGE_IHDR_HEADER_ERROR;
-
-      width  = byte_stream_word_be(&stream);
-      height = byte_stream_word_be(&stream);
-      depth  = byte_stream_byte(&stream);
-      type   = byte_stream_byte(&stream);
-      comp   = byte_stream_byte(&stream);
-      filter = byte_stream_byte(&stream);
-      interlace = byte_stream_byte(&stream);
-
-      if (depth != 8 || filter != 0 || interlace != 0 || comp != 0)
-        return PNG_IMAGE_IHDR_OPTION_ERROR;
-
-      if (PNG_TYPE_RGB != type && PNG_TYPE_RGBA != type)
-        return PNG_IMAGE_IHDR_TYPE_ERROR;
-
-      bpp = (PNG_TYPE_RGB == type) ? 3 : 4;
-      have_header = true;
+      anim->first = chunk;
+      break;
     }
-    else if (PNG_IDAT == ch_type)
+    else if (PNG_IHDR == ch_type)
     {
-      if ((compressed_size + ch_len) > size)
-        return PNG_IMAGE_IDAT_SIZE_ERROR;
+      return PNG_IMAGE_IHDR_HEADER_ERROR;
+    }
+    else if (PNG_PLTE == ch_type)
+    {
+      if (!png_image_parse_palette(&stream, canvas, ch_len))
+        return PNG_IMAGE_PALETTE_ERROR;
+    }
+    else if (PNG_TRNS == ch_type)
+    {
+      png_image_parse_transparency(&stream, canvas, anim->info.depth, ch_len);
+    }
+    else if (PNG_ACTL == ch_type && 8 == ch_len)
+    {
+      uint32_t frames = byte_stream_word_be(&stream);
 
-      byte_stream_buf(&stream, &compressed_data[compressed_size], ch_len);
+      anim->plays  = byte_stream_word_be(&stream);
+      anim->single = false;
 
-      compressed_size += ch_len;
+      if (0 == frames || frames > INT32_MAX)
+        return PNG_IMAGE_FRAME_ERROR;
+
+      anim->frames = frames;
     }
     else if (PNG_IEND == ch_type)
     {
-      int expected_size = width * height * bpp + height;
-      int decompressed_size = expected_size;
-      uint8_t *decompressed_data;
-      bool res;
+      return PNG_IMAGE_IDAT_SIZE_ERROR;
+    }
+    else if (mandatory)
+    {
+      return PNG_IMAGE_UNKNOWN_CHUNK_ERROR;
+    }
+    else
+    {
+      byte_stream_buf(&stream, NULL, ch_len);
+    }
 
-      if (ch_len > 0)
-        return PNG_IMAGE_SIZE_ERROR;
+    if (!png_image_chunk_crc(&stream, chunk, decoder->verify))
+      return PNG_IMAGE_CRC_ERROR;
+  }
 
-      byte_stream_word(&stream); // Skip CRC32
+  if ((uint64_t)anim->info.width * 4 > INT32_MAX)
+    return PNG_IMAGE_SIZE_ERROR;
 
-      if (stream.size || stream.error || !have_header)
-        return PNG_IMAGE_STREAM_ERROR;
+  canvas->width  = anim->info.width;
+  canvas->height = anim->info.height;
+  canvas->stride = canvas->width * 4;
 
-      decompressed_data = (uint8_t *)malloc(decompressed_size);
+  if (!png_size_mul(canvas->stride, canvas->height, &canvas_size))
+    return PNG_IMAGE_SIZE_ERROR;
 
-      if (!decompressed_data)
-      {
-        free(compressed_data);
-        return PNG_IMAGE_MALLOC_ERROR;
-      }
+  // The canvas starts fully transparent
+  canvas->data = (uint8_t *)calloc(1, canvas_size);
 
-      res = deflate_decompress(compressed_data, compressed_size, decompressed_data, &decompressed_size);
-      free(compressed_data);
+  if (!canvas->data)
+    return PNG_IMAGE_MALLOC_ERROR;
 
-      if (!res || expected_size != decompressed_size)
-      {
-        free(decompressed_data);
-        return PNG_IMAGE_DECOMPRESS_ERROR;
-      }
+  anim->next = anim->first;
 
-      if (!png_image_defilter(decompressed_data, width, height, bpp))
-      {
-        free(decompressed_data);
-        return PNG_IMAGE_DEFILTER_ERROR;
-      }
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+int png_animation_next(PNGAnimation *anim)
+{
+  PNGDecoder *decoder = anim->decoder;
+  PNGImage *canvas = &anim->canvas;
+  uint64_t start = (decoder->stats || decoder->limits.cycles) ? png_image_clock() : 0;
+  uint8_t *data = NULL, *data_end = NULL;
+  uint32_t data_type = 0, sequence = anim->sequence;
+  bool control = anim->single;
+  PNGImageInfo info = anim->info;
+  PNGRect region, disposed;
+  PNGFrame frame;
+  PNGImage image;
+  ByteStream stream;
+  int res;
+
+  if (!canvas->data)
+    return PNG_IMAGE_ERROR;
+
+  if (anim->index + 1 >= anim->frames)
+    return PNG_IMAGE_END;
+
+  // A still image is a single frame covering the canvas
+  frame.x         = 0;
+  frame.y         = 0;
+  frame.width     = canvas->width;
+  frame.height    = canvas->height;
+  frame.delay_num = 0;
+  frame.delay_den = 100;
+  frame.dispose   = PNG_DISPOSE_NONE;
+  frame.blend     = PNG_BLEND_SOURCE;
+
+  byte_stream_init(&stream, anim->next, anim->end - anim->next);
 
-      image->width  = width;
-      image->height = height;
-      image->data = (uint8_t *)malloc(width * height * sizeof(uint32_t));
+  // Finds the frame control and the run of data chunks of the next frame
+  while (1)
+  {
+    uint8_t *chunk = stream.data;
+    uint32_t ch_len  = byte_stream_word_be(&stream);
+    uint32_t ch_type = byte_stream_word(&stream);
+    int letter  = ch_type & 0xff;
+    bool mandatory = ('A' <= letter && letter <= 'Z');
+
+    if (stream.error || ch_len > INT32_MAX)
+      return PNG_IMAGE_STREAM_ERROR;
+
+    if (data && data_type != ch_type)
+    {
+      data_end = chunk;
+      break;
+    }
+
+    if (PNG_FCTL == ch_type)
+    {
+      if (control)
+        return PNG_IMAGE_FRAME_ERROR;
 
-      if (!image->data)
+      res = png_animation_parse_frame(&stream, anim, &frame, ch_len, sequence++);
+
+      if (PNG_IMAGE_SUCCESS != res)
+        return res;
+
+      control = true;
+    }
+    else if (PNG_IDAT == ch_type || PNG_FDAT == ch_type)
+    {
+      // Image data without a frame control is the default image, which is
+      // not a part of the animation
+      if (!data && control)
       {
-        free(decompressed_data);
-        return PNG_IMAGE_MALLOC_ERROR;
+        data = chunk;
+        data_type = ch_type;
+      }
+      else if (!data && PNG_FDAT == ch_type)
+      {
+        return PNG_IMAGE_FRAME_ERROR;
       }
 
-      png_image_convert(image->data, decompressed_data, width, height, bpp);
+      // Frame data chunks continue the sequence of the frame controls
+      if (PNG_FDAT == ch_type)
+      {
+        if (ch_len < 4 || byte_stream_word_be(&stream) != sequence++)
+          return PNG_IMAGE_FRAME_ERROR;
 
-      free(decompressed_data);
+        ch_len -= 4;
+      }
 
-      return PNG_IMAGE_SUCCESS;
+      byte_stream_buf(&stream, NULL, ch_len);
+    }
+    else if (PNG_IEND == ch_type)
+    {
+      return PNG_IMAGE_FRAME_ERROR;
     }
     else if (mandatory)
     {
@@ -788,12 +4103,256 @@ int png_image_read(PNGImage *image, uint8_t *data, int size)
       byte_stream_buf(&stream, NULL, ch_len);
     }
 
-    byte_stream_word(&stream); // Skip CRC32
+    if (!png_image_chunk_crc(&stream, chunk, decoder->verify))
+      return PNG_IMAGE_CRC_ERROR;
+  }
+
+  // The default image must cover the whole canvas
+  if (PNG_IDAT == data_type && (frame.x || frame.y || frame.width != canvas->width ||
+      frame.height != canvas->height))
+    return PNG_IMAGE_FRAME_ERROR;
+
+  if (anim->index < 0 && PNG_DISPOSE_PREVIOUS == frame.dispose)
+    frame.dispose = PNG_DISPOSE_BACKGROUND;
+
+  // The frame is decoded aside and the canvas is only changed once the
+  // decode succeeded, so a failed frame leaves the animation as it was
+  image        = *canvas;
+  image.width  = frame.width;
+  image.height = frame.height;
+  image.data   = png_animation_buffer(anim, &anim->scratch);
+  image.stride = frame.width * 4;
+
+  if (!image.data)
+    return PNG_IMAGE_MALLOC_ERROR;
+
+  if (PNG_DISPOSE_PREVIOUS == frame.dispose && !png_animation_buffer(anim, &anim->saved))
+    return PNG_IMAGE_MALLOC_ERROR;
+
+  info.width  = frame.width;
+  info.height = frame.height;
+
+  region.x      = 0;
+  region.y      = 0;
+  region.width  = frame.width;
+  region.height = frame.height;
+
+  res = png_image_decode_data(decoder, &image, &info, &region, data, data_end,
+      (PNG_FDAT == data_type) ? DEFLATE_FDAT : 0, false, NULL, NULL, start);
+
+  if (PNG_IMAGE_SUCCESS != res)
+    return res;
+
+  disposed.width  = 0;
+  disposed.height = 0;
+
+  if (anim->index >= 0)
+    png_animation_dispose(anim, &disposed);
+
+  if (PNG_DISPOSE_PREVIOUS == frame.dispose)
+    png_animation_copy(anim, &frame, anim->saved, true);
+
+  if (PNG_BLEND_OVER == frame.blend)
+    png_animation_blend(anim, &frame);
+  else
+    png_animation_copy(anim, &frame, anim->scratch, false);
+
+  anim->dirty.x      = frame.x;
+  anim->dirty.y      = frame.y;
+  anim->dirty.width  = frame.width;
+  anim->dirty.height = frame.height;
 
-    first_chunk = false;
+  if (anim->index < 0)
+  {
+    anim->dirty.x      = 0;
+    anim->dirty.y      = 0;
+    anim->dirty.width  = canvas->width;
+    anim->dirty.height = canvas->height;
   }
 
-  return PNG_IMAGE_ERROR;
+  png_rect_union(&anim->dirty, &disposed);
+
+  anim->frame    = frame;
+  anim->next     = data_end;
+  anim->sequence = sequence;
+  anim->index++;
+
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+void png_animation_rewind(PNGAnimation *anim)
+{
+  PNGImage *canvas = &anim->canvas;
+
+  if (canvas->data)
+    memset(canvas->data, 0, (size_t)canvas->stride * canvas->height);
+
+  anim->next     = anim->first;
+  anim->index    = -1;
+  anim->sequence = 0;
+}
+
+//-----------------------------------------------------------------------------
+void png_animation_free(PNGAnimation *anim)
+{
+  PNGAllocator *allocator = &anim->decoder->allocator;
+
+  if (anim->scratch)
+    allocator->free(allocator->ctx, anim->scratch);
+
+  if (anim->saved)
+    allocator->free(allocator->ctx, anim->saved);
+
+  png_image_free(&anim->canvas);
+
+  anim->scratch = NULL;
+  anim->saved   = NULL;
+}
+
+//-----------------------------------------------------------------------------
+static BatchDecoder *png_batch_get_decoder(BatchContext *batch)
+{
+  BatchDecoder *bd;
+
+  pthread_mutex_lock(&batch->mutex);
+
+  bd = batch->decoders;
+
+  if (bd)
+    batch->decoders = bd->next;
+
+  pthread_mutex_unlock(&batch->mutex);
+
+  if (bd)
+    return bd;
+
+  // The number of decoders grows up to the number of threads that are
+  // actually decoding at the same time
+  bd = malloc(sizeof(BatchDecoder));
+
+  if (bd)
+  {
+    png_decoder_init(&bd->decoder, NULL);
+    bd->decoder.pool = batch->pool;
+  }
+
+  return bd;
+}
+
+//-----------------------------------------------------------------------------
+static void png_batch_put_decoder(BatchContext *batch, BatchDecoder *bd)
+{
+  pthread_mutex_lock(&batch->mutex);
+  bd->next = batch->decoders;
+  batch->decoders = bd;
+  pthread_mutex_unlock(&batch->mutex);
+}
+
+//-----------------------------------------------------------------------------
+static void png_batch_decode(BatchContext *batch, PNGBatchItem *item)
+{
+  BatchDecoder *bd = png_batch_get_decoder(batch);
+
+  if (!bd)
+    item->status = PNG_IMAGE_MALLOC_ERROR;
+  else if (item->image.data)
+    item->status = png_decoder_read_into(&bd->decoder, &item->image, item->data, item->size);
+  else
+    item->status = png_decoder_read_as(&bd->decoder, &item->image, item->data, item->size,
+        item->image.format);
+
+  if (bd)
+    png_batch_put_decoder(batch, bd);
+
+  if (batch->callback)
+    batch->callback(item, batch->ctx);
+}
+
+//-----------------------------------------------------------------------------
+static void png_batch_task(void *arg)
+{
+  BatchTask *task = (BatchTask *)arg;
+
+  png_batch_decode(task->batch, task->item);
+}
+
+//-----------------------------------------------------------------------------
+static int png_batch_compare(const void *a, const void *b)
+{
+  const BatchTask *ta = (const BatchTask *)a;
+  const BatchTask *tb = (const BatchTask *)b;
+
+  return (tb->item->size > ta->item->size) - (tb->item->size < ta->item->size);
+}
+
+//-----------------------------------------------------------------------------
+int png_image_read_batch(struct ThreadPool *pool, PNGBatchItem *items, int count,
+    PNGBatchCallback callback, void *ctx)
+{
+  BatchContext batch;
+  BatchTask *tasks = NULL;
+  ThreadPoolGroup group;
+
+  if (count < 0 || (count > 0 && !items))
+    return PNG_IMAGE_BUFFER_ERROR;
+
+  if (pool && count > 1)
+  {
+    tasks = malloc(count * sizeof(BatchTask));
+
+    if (!tasks)
+      return PNG_IMAGE_MALLOC_ERROR;
+  }
+
+  pthread_mutex_init(&batch.mutex, NULL);
+  batch.decoders = NULL;
+  batch.pool     = pool;
+  batch.callback = callback;
+  batch.ctx      = ctx;
+
+  if (tasks)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      tasks[i].batch = &batch;
+      tasks[i].item  = &items[i];
+    }
+
+    // Large images go first, so they don't end up as a long tail
+    qsort(tasks, count, sizeof(BatchTask), png_batch_compare);
+
+    thread_pool_group_init(&group);
+
+    for (int i = 0; i < count; i++)
+    {
+      if (!thread_pool_submit(pool, &group, png_batch_task, &tasks[i]))
+        png_batch_task(&tasks[i]);
+    }
+
+    // The calling thread decodes queued images while waiting
+    thread_pool_wait(pool, &group);
+
+    free(tasks);
+  }
+  else
+  {
+    for (int i = 0; i < count; i++)
+      png_batch_decode(&batch, &items[i]);
+  }
+
+  while (batch.decoders)
+  {
+    BatchDecoder *bd = batch.decoders;
+
+    batch.decoders = bd->next;
+    png_decoder_free(&bd->decoder);
+    free(bd);
+  }
+
+  pthread_mutex_destroy(&batch.mutex);
+
+  return PNG_IMAGE_SUCCESS;
 }
 
 //-----------------------------------------------------------------------------
@@ -801,5 +4360,6 @@ void png_image_free(PNGImage *image)
 {
   assert(image);
   free(image->data);
+  memset(image, 0, sizeof(PNGImage));
 }
 
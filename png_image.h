@@ -29,9 +29,15 @@
 #ifndef _PNG_IMAGE_H_
 #define _PNG_IMAGE_H_
 
+/*- Includes ----------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 /*- Definitions -------------------------------------------------------------*/
 enum
 {
+  PNG_IMAGE_END                 = 1,
   PNG_IMAGE_SUCCESS             = 0,
   PNG_IMAGE_ERROR               = -1,
   PNG_IMAGE_MALLOC_ERROR        = -2,
@@ -46,19 +52,320 @@ enum
   PNG_IMAGE_DECOMPRESS_ERROR    = -11,
   PNG_IMAGE_DEFILTER_ERROR      = -12,
   PNG_IMAGE_UNKNOWN_CHUNK_ERROR = -13,
+  PNG_IMAGE_BUFFER_ERROR        = -14,
+  PNG_IMAGE_PALETTE_ERROR       = -15,
+  PNG_IMAGE_REGION_ERROR        = -16,
+  PNG_IMAGE_CRC_ERROR           = -17,
+  PNG_IMAGE_ADLER_ERROR         = -18,
+  PNG_IMAGE_CALLBACK_ERROR      = -19,
+  PNG_IMAGE_FILE_ERROR          = -20,
+  PNG_IMAGE_FRAME_ERROR         = -21,
+  PNG_IMAGE_LIMIT_ERROR         = -22,
+};
+
+enum
+{
+  PNG_IMAGE_FORMAT_RGBA,
+  PNG_IMAGE_FORMAT_BGRA,
+  PNG_IMAGE_FORMAT_RGB,
+  PNG_IMAGE_FORMAT_PREMULTIPLIED_RGBA,
+  PNG_IMAGE_FORMAT_NATIVE,
+  PNG_IMAGE_FORMAT_COUNT,
+};
+
+// PNG color types
+enum
+{
+  PNG_IMAGE_TYPE_GRAY           = 0,
+  PNG_IMAGE_TYPE_RGB            = 2,
+  PNG_IMAGE_TYPE_PALETTE        = 3,
+  PNG_IMAGE_TYPE_GRAY_ALPHA     = 4,
+  PNG_IMAGE_TYPE_RGBA           = 6,
+};
+
+// APNG frame disposal and blending operations
+enum
+{
+  PNG_DISPOSE_NONE              = 0,
+  PNG_DISPOSE_BACKGROUND        = 1,
+  PNG_DISPOSE_PREVIOUS          = 2,
+};
+
+enum
+{
+  PNG_BLEND_SOURCE              = 0,
+  PNG_BLEND_OVER                = 1,
 };
 
 /*- Types -------------------------------------------------------------------*/
+// The native format keeps the color type of the file. Samples take one byte
+// (sub-byte gray levels are scaled to 8 bits, palette indices are not) or
+// two bytes in the host byte order for 16-bit images. The palette and the
+// transparent color are filled in for all formats.
 typedef struct
 {
   int      width;
   int      height;
+  int      stride;
+  int      format;
   uint8_t  *data;
+  int      type;
+  int      depth;
+  int      palette_size;
+  uint8_t  palette[256 * 4];
+  bool     transparency;
+  uint16_t transparent[3];
 } PNGImage;
 
+// Header information. Type is the PNG color type and depth is the number
+// of bits per sample as stored in the file.
+typedef struct
+{
+  int      width;
+  int      height;
+  int      depth;
+  int      type;
+  int      interlace;
+} PNGImageInfo;
+
+typedef struct
+{
+  int      x;
+  int      y;
+  int      width;
+  int      height;
+} PNGRect;
+
+typedef struct
+{
+  void     *(*alloc)(void *ctx, size_t size);
+  void     (*free)(void *ctx, void *ptr);
+  void     *ctx;
+} PNGAllocator;
+
+// Called after each Adam7 pass of an interlaced image. Pixels on the grid
+// with x_step and y_step are final, so the grid can be used as a low
+// resolution preview. With replication enabled in the decoder, the whole
+// image is filled with pixel blocks of that size.
+typedef void (*PNGProgressCallback)(const PNGImage *image, int pass, int x_step, int y_step, void *ctx);
+
+// Receives a band of decoded rows, which starts at row y of the output image.
+// The band data is only valid during the call, returning false stops the decode.
+typedef bool (*PNGBandCallback)(const PNGImage *band, int y, void *ctx);
+
+// Decode statistics, collected only when the stats pointer of the decoder
+// is set, so it can be enabled for sampled calls only. The values are added
+// to, the caller clears the structure before the first decode. Stage times
+// are in png_image_clock() ticks. Inflate time excludes the time spent in
+// the stages it feeds, parsing is everything outside of the decompression,
+// including allocations. Literals and matches are deflate symbols, the
+// average match length is match_bytes / matches.
+typedef struct
+{
+  uint64_t parse;
+  uint64_t inflate;
+  uint64_t defilter;
+  uint64_t convert;
+  uint64_t stored_blocks;
+  uint64_t fixed_blocks;
+  uint64_t dynamic_blocks;
+  uint64_t table_builds;
+  uint64_t literals;
+  uint64_t matches;
+  uint64_t match_bytes;
+  uint64_t inflated;
+  uint64_t filters[5];
+} PNGImageStats;
+
+// Work limits for untrusted data, zero disables a limit. Table builds are
+// Huffman tables built for one compressed stream, each dynamic block takes
+// three of them. The budget grows by one table for every 64 bytes of
+// compressed data read. The decompressed size is limited to ratio times the
+// size of the compressed data. Cycles is the budget for the whole decode in
+// png_image_clock() ticks. Decodes over a limit fail with PNG_IMAGE_LIMIT_ERROR
+// shortly after the limit is reached.
+typedef struct
+{
+  uint64_t table_builds;
+  uint64_t ratio;
+  uint64_t cycles;
+} PNGLimits;
+
+// Decoder context. The inflate window, Huffman tables and scanline buffers
+// are kept in the internal state between decodes, the state is allocated on
+// first use and released by png_decoder_free(). Only the fields before it
+// are options, the context must not be copied or shared between threads.
+// If a thread pool is set, images with an iDOT chunk are decompressed
+// in parallel. A non-zero scale reduces the output by 2^scale (up to 1/8)
+// using a box filter or subsampling. Interlaced images are always
+// subsampled and only the passes on the reduced grid are decompressed.
+// With verify set, chunk CRCs and the zlib Adler-32 are checked. Decodes
+// that stop before the end of the data only check the CRCs. Stats are
+// collected only if the pointer is set. Limits bound the work done for
+// crafted images.
+typedef struct
+{
+  PNGAllocator allocator;
+  struct ThreadPool *pool;
+  PNGProgressCallback progress;
+  void     *progress_ctx;
+  bool     replicate;
+  int      scale;
+  bool     subsample;
+  bool     verify;
+  PNGImageStats *stats;
+  PNGLimits limits;
+  struct PNGDecoderState *state;
+} PNGDecoder;
+
+// Frame control of an animation frame, the delay is delay_num / delay_den
+// seconds. The disposal is applied before the next frame is composited.
+typedef struct
+{
+  int      x;
+  int      y;
+  int      width;
+  int      height;
+  int      delay_num;
+  int      delay_den;
+  int      dispose;
+  int      blend;
+} PNGFrame;
+
+// APNG frame iterator. Each frame is decoded into its own rectangle and
+// composited onto the canvas, which keeps its contents between frames.
+// Dirty is the part of the canvas changed by the last step, including the
+// disposal of the previous frame, nothing outside of it is touched. Plain
+// PNG images are animations with a single frame. The decoder must not be
+// scaled and the format must be RGBA, BGRA or premultiplied RGBA. Sequence
+// is the number expected in the next fcTL or fdAT chunk.
+typedef struct
+{
+  PNGDecoder *decoder;
+  PNGImage canvas;
+  PNGFrame frame;
+  PNGRect  dirty;
+  int      frames;
+  int      plays;
+  int      index;
+  uint32_t sequence;
+  PNGImageInfo info;
+  bool     single;
+  uint8_t  *first;
+  uint8_t  *next;
+  uint8_t  *end;
+  uint8_t  *scratch;
+  uint8_t  *saved;
+} PNGAnimation;
+
+// Planar output for machine learning frameworks. Each channel is stored in
+// its own plane in the RGBA order (CHW layout), alpha is dropped when
+// channels is 3. Samples are bytes or, with float32 set, 8-bit values
+// mapped to value * scale[c] + offset[c]. Rows are split into the planes as
+// they are decoded, only interlaced images go through a full RGBA image.
+// If data is NULL, the planes are allocated in one malloc()-ed block and the
+// strides are set. Otherwise width and height are the capacity on input as
+// with png_image_read_into(). Strides are in bytes, between the rows of a
+// plane and between the planes.
+typedef struct
+{
+  int      width;
+  int      height;
+  int      channels;
+  bool     float32;
+  float    scale[4];
+  float    offset[4];
+  void     *data;
+  size_t   stride;
+  size_t   plane_stride;
+} PNGTensor;
+
+// A single image of a batch. If image.data is set, the image is decoded
+// into that buffer as with png_image_read_into(), otherwise it is allocated
+// in image.format and must be freed with png_image_free(). The result is
+// stored in status.
+typedef struct
+{
+  uint8_t  *data;
+  size_t   size;
+  PNGImage image;
+  int      status;
+  void     *user;
+} PNGBatchItem;
+
+// Called from a worker thread as soon as an item is done
+typedef void (*PNGBatchCallback)(PNGBatchItem *item, void *ctx);
+
 /*- Prototypes --------------------------------------------------------------*/
-int png_image_read(PNGImage *image, uint8_t *data, int size);
+int png_image_read(PNGImage *image, uint8_t *data, size_t size);
+int png_image_read_as(PNGImage *image, uint8_t *data, size_t size, int format);
+
+// Decodes only the rectangle, the image is allocated with the size of the
+// rectangle. Decompression stops after the last row of the rectangle. With a
+// scaled decoder the rectangle origin is aligned down to the reduced grid.
+int png_image_read_region(PNGImage *image, uint8_t *data, size_t size, int format, const PNGRect *rect);
 void png_image_free(PNGImage *image);
 
+// Decodes directly from a read-only mapping of the file, so the data is
+// not copied to the heap. Pipes and other files that can't be mapped are
+// read into a temporary buffer.
+int png_image_read_file(PNGImage *image, const char *path, int format);
+
+int png_image_read_tensor(PNGTensor *tensor, uint8_t *data, size_t size);
+
+// Parses the signature and IHDR only, the rest of the data is not touched.
+// Color types and bit depths that can't be decoded are reported as errors.
+int png_image_info(PNGImageInfo *info, uint8_t *data, size_t size);
+
+// Decodes into a caller-provided buffer. The caller sets data, stride and
+// format, width and height are the buffer capacity on input and the image
+// size on output. The buffer is never freed by the library.
+int png_image_read_into(PNGImage *image, uint8_t *data, size_t size);
+
+// The allocator is used for the scratch memory only, images returned by
+// png_decoder_read() are allocated with malloc() and freed with png_image_free().
+void png_decoder_init(PNGDecoder *decoder, const PNGAllocator *allocator);
+void png_decoder_free(PNGDecoder *decoder);
+int png_decoder_read(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size);
+int png_decoder_read_as(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size, int format);
+int png_decoder_read_region(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size,
+    int format, const PNGRect *rect);
+int png_decoder_read_into(PNGDecoder *decoder, PNGImage *image, uint8_t *data, size_t size);
+int png_decoder_read_file(PNGDecoder *decoder, PNGImage *image, const char *path, int format);
+
+// Decodes the image into a buffer of band_height rows, which is passed to the
+// callback each time it is filled. The last band may be shorter. Memory use
+// doesn't depend on the image height, so images larger than the available
+// memory can be processed. Interlaced images are not supported.
+int png_decoder_read_bands(PNGDecoder *decoder, uint8_t *data, size_t size, int format,
+    int band_height, PNGBandCallback callback, void *ctx);
+
+// Decodes into separate planes of bytes or floats, see PNGTensor
+int png_decoder_read_tensor(PNGDecoder *decoder, PNGTensor *tensor, uint8_t *data, size_t size);
+
+// The data must stay valid until the animation is freed. Next returns
+// PNG_IMAGE_END after the last frame, rewind starts the next play from an
+// empty canvas. A failed next leaves the canvas and the position as they
+// were after the previous frame.
+int png_animation_init(PNGAnimation *anim, PNGDecoder *decoder, uint8_t *data, size_t size, int format);
+int png_animation_next(PNGAnimation *anim);
+void png_animation_rewind(PNGAnimation *anim);
+void png_animation_free(PNGAnimation *anim);
+
+// Decodes all items on the pool, the calling thread takes part in decoding.
+// Without a pool the items are decoded sequentially. Decoder contexts are
+// shared between the items, so the scratch memory is only allocated once
+// per thread.
+int png_image_read_batch(struct ThreadPool *pool, PNGBatchItem *items, int count,
+    PNGBatchCallback callback, void *ctx);
+
+// CPU time stamp counter where available, monotonic nanoseconds otherwise
+uint64_t png_image_clock(void);
+
+// Encodes the image into a malloc()-ed buffer. The level is from 0 (stored)
+// to 9. With a pool, rows are filtered and compressed in bands in parallel.
+// RGB, RGBA, BGRA and native 8- and 16-bit images are supported.
+int png_image_write(const PNGImage *image, int level, struct ThreadPool *pool, uint8_t **data, size_t *size);
+
 #endif // _PNG_IMAGE_H_
 
@@ -0,0 +1,260 @@
+// The kernels are static, so the decoder and the pixel converter are built as
+// a part of the demo. The decoder goes first, its feature test macros must
+// come before the system headers.
+#include "png_image.c"
+#include "pixel_convert.c"
+#include <stdio.h>
+
+/*- Definitions -------------------------------------------------------------*/
+#define RANDOM_ROWS    100000
+#define MAX_ROW_SIZE   (4 * 80)
+#define MAX_WIDTH      300
+#define GUARD_SIZE     32
+#define OUTPUT_SIZE    (MAX_WIDTH * 4 + GUARD_SIZE)
+
+enum
+{
+  ISA_SSE2,
+  ISA_SSSE3,
+  ISA_AVX2,
+};
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  const char   *name;
+  int          filter;
+  int          bpp;
+  int          isa;
+  DefilterFunc kernel;
+} DefilterKernel;
+
+typedef struct
+{
+  const char       *name;
+  int              src_bytes;
+  int              dst_bytes;
+  int              isa;
+  PixelConvertFunc kernel;
+  PixelConvertFunc scalar;
+} ConvertKernel;
+
+/*- Constants ---------------------------------------------------------------*/
+static const char *filter_names[5] = { "none", "sub", "up", "avg", "paeth" };
+
+#if defined(__x86_64__) || defined(__i386__)
+static const DefilterKernel defilter_tests[] =
+{
+  { "up_sse2",      2, 3, ISA_SSE2,  defilter_up_sse2 },
+  { "up_sse2",      2, 4, ISA_SSE2,  defilter_up_sse2 },
+  { "up_avx2",      2, 3, ISA_AVX2,  defilter_up_avx2 },
+  { "up_avx2",      2, 4, ISA_AVX2,  defilter_up_avx2 },
+  { "sub3_sse2",    1, 3, ISA_SSE2,  defilter_sub3_sse2 },
+  { "sub4_sse2",    1, 4, ISA_SSE2,  defilter_sub4_sse2 },
+  { "avg3_sse2",    3, 3, ISA_SSE2,  defilter_avg3_sse2 },
+  { "avg4_sse2",    3, 4, ISA_SSE2,  defilter_avg4_sse2 },
+  { "paeth3_sse2",  4, 3, ISA_SSE2,  defilter_paeth3_sse2 },
+  { "paeth4_sse2",  4, 4, ISA_SSE2,  defilter_paeth4_sse2 },
+  { "paeth3_ssse3", 4, 3, ISA_SSSE3, defilter_paeth3_ssse3 },
+  { "paeth4_ssse3", 4, 4, ISA_SSSE3, defilter_paeth4_ssse3 },
+};
+
+static const ConvertKernel convert_tests[] =
+{
+  { "rgba_to_bgr_ssse3",  4, 3, ISA_SSSE3, convert_bgr_ssse3,  convert_bgr_scalar },
+  { "rgba_to_bgr_avx2",   4, 3, ISA_AVX2,  convert_bgr_avx2,   convert_bgr_scalar },
+  { "rgba_to_bgra_ssse3", 4, 4, ISA_SSSE3, convert_bgra_ssse3, convert_bgra_scalar },
+  { "rgba_to_bgra_avx2",  4, 4, ISA_AVX2,  convert_bgra_avx2,  convert_bgra_scalar },
+  { "bgr_to_rgba_ssse3",  3, 4, ISA_SSSE3, convert_rgba_ssse3, convert_rgba_scalar },
+};
+#endif
+
+/*- Variables ---------------------------------------------------------------*/
+static DefilterFunc scalar[5] = { NULL, defilter_sub, defilter_up, defilter_avg, defilter_paeth };
+static uint32_t random_state = 1;
+static int total_checks = 0;
+static int total_errors = 0;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static uint8_t demo_random(void)
+{
+  random_state = random_state * 1103515245 + 12345;
+  return random_state >> 16;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//-----------------------------------------------------------------------------
+static bool isa_supported(const char *name, int isa)
+{
+  bool res;
+
+  __builtin_cpu_init();
+
+  if (ISA_SSE2 == isa)
+    res = __builtin_cpu_supports("sse2");
+  else if (ISA_SSSE3 == isa)
+    res = __builtin_cpu_supports("ssse3");
+  else
+    res = __builtin_cpu_supports("avx2");
+
+  if (!res)
+    printf("Skipped: %s, not supported by the CPU\n", name);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static void reset_outputs(uint8_t *expected, uint8_t *actual)
+{
+  // The guard bytes after the row must not be touched
+  memset(expected, 0xa5, OUTPUT_SIZE);
+  memset(actual, 0xa5, OUTPUT_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+static bool same_outputs(uint8_t *expected, uint8_t *actual)
+{
+  total_checks++;
+
+  return 0 == memcmp(expected, actual, OUTPUT_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+static bool check_row(const DefilterKernel *k, uint8_t *line, uint8_t *prior, int size)
+{
+  uint8_t expected[OUTPUT_SIZE];
+  uint8_t actual[OUTPUT_SIZE];
+
+  reset_outputs(expected, actual);
+  memcpy(expected, line, size);
+  memcpy(actual, line, size);
+
+  scalar[k->filter](expected, prior, size, k->bpp);
+  k->kernel(actual, prior, size, k->bpp);
+
+  return same_outputs(expected, actual);
+}
+
+//-----------------------------------------------------------------------------
+static void random_rows(const DefilterKernel *k)
+{
+  uint8_t line[MAX_ROW_SIZE], prior[MAX_ROW_SIZE + GUARD_SIZE];
+
+  for (int i = 0; i < RANDOM_ROWS; i++)
+  {
+    int size = (demo_random() % (MAX_ROW_SIZE / k->bpp + 1)) * k->bpp;
+
+    for (int x = 0; x < size; x++)
+    {
+      line[x]  = demo_random();
+      prior[x] = demo_random();
+    }
+
+    if (!check_row(k, line, prior, size))
+    {
+      printf("Error: %s (%s, bpp %d), row size %d\n", k->name, filter_names[k->filter], k->bpp, size);
+      total_errors++;
+      return;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void paeth_sweep(const DefilterKernel *k)
+{
+  uint8_t line[8], prior[8 + GUARD_SIZE];
+
+  // Every (a, b, c) combination on the second pixel of a two pixel row. The
+  // first pixel reconstructs to a, each channel is offset to cover the
+  // byte wraparound on a different lane.
+  for (int a = 0; a < 256; a++)
+  {
+    for (int b = 0; b < 256; b++)
+    {
+      for (int c = 0; c < 256; c++)
+      {
+        for (int ch = 0; ch < k->bpp; ch++)
+        {
+          prior[ch] = c + ch;
+          prior[k->bpp + ch] = b;
+          line[ch] = (uint8_t)(a - (uint8_t)(c + ch));
+          line[k->bpp + ch] = a ^ b ^ c;
+        }
+
+        if (!check_row(k, line, prior, 2 * k->bpp))
+        {
+          printf("Error: %s paeth sweep, a = %d, b = %d, c = %d\n", k->name, a, b, c);
+          total_errors++;
+          return;
+        }
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void random_pixels(const ConvertKernel *k)
+{
+  uint8_t expected[OUTPUT_SIZE];
+  uint8_t actual[OUTPUT_SIZE];
+
+  for (int i = 0; i < RANDOM_ROWS; i++)
+  {
+    int width = demo_random() % (MAX_WIDTH + 1);
+    // Exactly sized, so reads past the end show up under a memory checker
+    uint8_t *src = malloc(width * k->src_bytes);
+
+    for (int x = 0; x < width * k->src_bytes; x++)
+      src[x] = demo_random();
+
+    reset_outputs(expected, actual);
+
+    k->scalar(expected, src, width);
+    k->kernel(actual, src, width);
+
+    free(src);
+
+    if (!same_outputs(expected, actual))
+    {
+      printf("Error: %s, width %d\n", k->name, width);
+      total_errors++;
+      return;
+    }
+  }
+}
+
+#endif // __x86_64__ || __i386__
+
+//-----------------------------------------------------------------------------
+int main(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  for (int i = 0; i < (int)(sizeof(defilter_tests) / sizeof(defilter_tests[0])); i++)
+  {
+    const DefilterKernel *k = &defilter_tests[i];
+
+    if (!isa_supported(k->name, k->isa))
+      continue;
+
+    random_rows(k);
+
+    if (4 == k->filter)
+      paeth_sweep(k);
+  }
+
+  for (int i = 0; i < (int)(sizeof(convert_tests) / sizeof(convert_tests[0])); i++)
+  {
+    if (isa_supported(convert_tests[i].name, convert_tests[i].isa))
+      random_pixels(&convert_tests[i]);
+  }
+#else
+  printf("No SIMD kernels on this platform\n");
+#endif
+
+  printf("Checks: %d, errors: %d\n", total_checks, total_errors);
+
+  return total_errors ? 1 : 0;
+}
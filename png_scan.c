@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "png_image.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define PNG_IDAT       0x49444154
+#define PNG_IEND       0x49454e44
+
+/*- Variables ---------------------------------------------------------------*/
+static int total_files = 0;
+static int total_errors = 0;
+static uint64_t total_idat = 0;
+static uint64_t total_memory = 0;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static const char *type_name(int type)
+{
+  switch (type)
+  {
+    case PNG_IMAGE_TYPE_GRAY:       return "gray";
+    case PNG_IMAGE_TYPE_RGB:        return "rgb";
+    case PNG_IMAGE_TYPE_PALETTE:    return "palette";
+    case PNG_IMAGE_TYPE_GRAY_ALPHA: return "gray+alpha";
+    case PNG_IMAGE_TYPE_RGBA:       return "rgba";
+  }
+  return "unknown";
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t read_be(uint8_t *data)
+{
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+//-----------------------------------------------------------------------------
+// Only the chunk headers are touched, so the pages with the chunk data
+// are never read from the disk
+static uint64_t idat_size(uint8_t *data, size_t size)
+{
+  uint64_t idat = 0;
+  size_t ptr = 8;
+
+  while (ptr + 8 <= size)
+  {
+    uint32_t len  = read_be(&data[ptr]);
+    uint32_t type = read_be(&data[ptr + 4]);
+
+    if (PNG_IDAT == type)
+      idat += len;
+    else if (PNG_IEND == type)
+      break;
+
+    ptr += (uint64_t)len + 12;
+  }
+
+  return idat;
+}
+
+//-----------------------------------------------------------------------------
+static void scan_file(char *name)
+{
+  PNGImageInfo info;
+  struct stat stat;
+  uint8_t *data;
+  uint64_t idat, memory;
+  int fd, res;
+
+  fd = open(name, O_RDONLY);
+
+  if (fd < 0)
+    return;
+
+  if (fstat(fd, &stat) < 0 || !S_ISREG(stat.st_mode) || 0 == stat.st_size)
+  {
+    close(fd);
+    return;
+  }
+
+  data = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (MAP_FAILED == data)
+    return;
+
+  total_files++;
+
+  res = png_image_info(&info, data, stat.st_size);
+
+  if (PNG_IMAGE_SUCCESS == res)
+  {
+    idat   = idat_size(data, stat.st_size);
+    memory = (uint64_t)info.width * info.height * 4;
+
+    printf("%s: %d x %d, %s, %d bit, %s, idat = %llu, memory = %llu\n", name,
+        info.width, info.height, type_name(info.type), info.depth,
+        info.interlace ? "interlaced" : "progressive",
+        (unsigned long long)idat, (unsigned long long)memory);
+
+    total_idat += idat;
+    total_memory += memory;
+  }
+  else
+  {
+    printf("%s: error %d\n", name, res);
+    total_errors++;
+  }
+
+  munmap(data, stat.st_size);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+  struct dirent *entry;
+  char name[4096];
+  DIR *dir;
+
+  if (argc != 2)
+  {
+    printf("Directory name required\n");
+    return 0;
+  }
+
+  dir = opendir(argv[1]);
+
+  if (!dir)
+  {
+    printf("Error: can't open the directory\n");
+    return 1;
+  }
+
+  while ((entry = readdir(dir)))
+  {
+    int len = strlen(entry->d_name);
+
+    if (len < 4 || strcasecmp(&entry->d_name[len - 4], ".png"))
+      continue;
+
+    snprintf(name, sizeof(name), "%s/%s", argv[1], entry->d_name);
+    scan_file(name);
+  }
+
+  closedir(dir);
+
+  printf("Files: %d, errors: %d, idat = %llu, memory = %llu\n", total_files, total_errors,
+      (unsigned long long)total_idat, (unsigned long long)total_memory);
+
+  return 0;
+}
@@ -0,0 +1,649 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "thread_pool.h"
+#include "checksum.h"
+#include "deflate.h"
+#include "pixel_convert.h"
+#include "png_image.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define PNG_IDAT_SIZE      (256 * 1024)
+#define PNG_BAND_SIZE      (256 * 1024) // Minimal amount of data compressed by one task
+
+/*- Types -------------------------------------------------------------------*/
+typedef void (*FilterFunc)(const uint8_t *line, const uint8_t *prior, int size, int bpp,
+    uint8_t **out, uint32_t *sums);
+
+typedef struct
+{
+  const PNGImage *image;
+  int      type;
+  int      depth;
+  int      bpp;
+  int      line_size;
+  int      level;
+  bool     bgra;
+  bool     swap16;
+  bool     adaptive;
+  uint8_t  *filtered;
+} PNGWriter;
+
+typedef struct
+{
+  PNGWriter *writer;
+  int      first_row;
+  int      rows;
+  bool     last;
+  uint8_t  *data;
+  size_t   size;
+  uint32_t adler;
+  bool     res;
+} PNGWriteBand;
+
+typedef struct
+{
+  uint8_t  *ptr;
+  uint8_t  *chunk;
+  int      left;
+  size_t   remaining;
+} PNGIdatWriter;
+
+/*- Constants ---------------------------------------------------------------*/
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+static const int png_write_channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+
+/*- Variables ---------------------------------------------------------------*/
+static FilterFunc filter_kernel;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static inline int paeth_predictor(int a, int b, int c)
+{
+  int pa = abs(b - c);
+  int pb = abs(a - c);
+  int pc = abs(a + b - 2 * c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  else if (pb <= pc)
+    return b;
+
+  return c;
+}
+
+//-----------------------------------------------------------------------------
+static inline uint32_t filter_cost(uint8_t value)
+{
+  // Filtered bytes are treated as signed, small differences are cheap
+  return (value < 128) ? value : 256 - value;
+}
+
+//-----------------------------------------------------------------------------
+static void filter_bytes(const uint8_t *line, const uint8_t *prior, int from, int to, int bpp,
+    uint8_t **out, uint32_t *sums)
+{
+  for (int i = from; i < to; i++)
+  {
+    int x = line[i];
+    int b = prior[i];
+    int a = (i >= bpp) ? line[i - bpp] : 0;
+    int c = (i >= bpp) ? prior[i - bpp] : 0;
+
+    out[0][i] = x - a;
+    out[1][i] = x - b;
+    out[2][i] = x - ((a + b) >> 1);
+    out[3][i] = x - paeth_predictor(a, b, c);
+
+    sums[0] += filter_cost(x);
+    sums[1] += filter_cost(out[0][i]);
+    sums[2] += filter_cost(out[1][i]);
+    sums[3] += filter_cost(out[2][i]);
+    sums[4] += filter_cost(out[3][i]);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void filter_row(const uint8_t *line, const uint8_t *prior, int size, int bpp,
+    uint8_t **out, uint32_t *sums)
+{
+  memset(sums, 0, 5 * sizeof(uint32_t));
+  filter_bytes(line, prior, 0, size, bpp, out, sums);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) __m128i cost_sse2(__m128i v)
+{
+  __m128i zero = _mm_setzero_si128();
+
+  return _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero);
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) __m128i abs_epi16_sse2(__m128i v)
+{
+  return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+//-----------------------------------------------------------------------------
+static inline __attribute__((target("sse2"))) __m128i paeth_epi16_sse2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = abs_epi16_sse2(_mm_add_epi16(pa, pb));
+  __m128i not_a, not_b, bc;
+
+  pa = abs_epi16_sse2(pa);
+  pb = abs_epi16_sse2(pb);
+
+  not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+  not_b = _mm_cmpgt_epi16(pb, pc);
+  bc = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+
+  return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+}
+
+//-----------------------------------------------------------------------------
+static __attribute__((target("sse2"))) void filter_row_sse2(const uint8_t *line, const uint8_t *prior,
+    int size, int bpp, uint8_t **out, uint32_t *sums)
+{
+  // Unlike defiltering, filtering has no dependency between the bytes of
+  // a row, so all four filters and their costs are computed in one pass
+  __m128i zero = _mm_setzero_si128();
+  __m128i one = _mm_set1_epi8(1);
+  __m128i acc[5] = { zero, zero, zero, zero, zero };
+  int i = (bpp < size) ? bpp : size;
+
+  memset(sums, 0, 5 * sizeof(uint32_t));
+  filter_bytes(line, prior, 0, i, bpp, out, sums);
+
+  for (; (i + 16) <= size; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((__m128i *)&line[i]);
+    __m128i a = _mm_loadu_si128((__m128i *)&line[i - bpp]);
+    __m128i b = _mm_loadu_si128((__m128i *)&prior[i]);
+    __m128i c = _mm_loadu_si128((__m128i *)&prior[i - bpp]);
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    __m128i lo = paeth_epi16_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i hi = paeth_epi16_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    __m128i f1 = _mm_sub_epi8(x, a);
+    __m128i f2 = _mm_sub_epi8(x, b);
+    __m128i f3 = _mm_sub_epi8(x, avg);
+    __m128i f4 = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+
+    _mm_storeu_si128((__m128i *)&out[0][i], f1);
+    _mm_storeu_si128((__m128i *)&out[1][i], f2);
+    _mm_storeu_si128((__m128i *)&out[2][i], f3);
+    _mm_storeu_si128((__m128i *)&out[3][i], f4);
+
+    acc[0] = _mm_add_epi64(acc[0], cost_sse2(x));
+    acc[1] = _mm_add_epi64(acc[1], cost_sse2(f1));
+    acc[2] = _mm_add_epi64(acc[2], cost_sse2(f2));
+    acc[3] = _mm_add_epi64(acc[3], cost_sse2(f3));
+    acc[4] = _mm_add_epi64(acc[4], cost_sse2(f4));
+  }
+
+  for (int f = 0; f < 5; f++)
+    sums[f] += _mm_cvtsi128_si32(acc[f]) + _mm_cvtsi128_si32(_mm_srli_si128(acc[f], 8));
+
+  filter_bytes(line, prior, i, size, bpp, out, sums);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+static void __attribute__((constructor)) png_write_select_kernels(void)
+{
+  filter_kernel = filter_row;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2"))
+    filter_kernel = filter_row_sse2;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static const uint8_t *png_write_pack_row(PNGWriter *w, int y, uint8_t *buf)
+{
+  const PNGImage *image = w->image;
+  const uint8_t *src = image->data + (size_t)y * image->stride;
+
+  if (w->bgra)
+  {
+    pixel_convert_rgba_to_bgra(buf, src, image->width);
+    return buf;
+  }
+
+  if (w->swap16)
+  {
+    // Native 16-bit samples are in the host byte order, PNG is big-endian
+    for (int i = 0; i < w->line_size; i += 2)
+    {
+      uint16_t value;
+
+      memcpy(&value, &src[i], sizeof(uint16_t));
+      buf[i + 0] = value >> 8;
+      buf[i + 1] = value;
+    }
+
+    return buf;
+  }
+
+  return src;
+}
+
+//-----------------------------------------------------------------------------
+static bool png_write_filter_rows(PNGWriter *w, int first, int rows)
+{
+  int size = w->line_size;
+  uint8_t *scratch = (uint8_t *)malloc(size * 7);
+  uint8_t *bufs[2], *out[4];
+  const uint8_t *prior;
+
+  if (!scratch)
+    return false;
+
+  memset(scratch, 0, size);
+  bufs[0] = scratch + size;
+  bufs[1] = scratch + size * 2;
+
+  for (int i = 0; i < 4; i++)
+    out[i] = scratch + size * (3 + i);
+
+  // The first row of the image is filtered against a row of zeros
+  prior = (first > 0) ? png_write_pack_row(w, first - 1, bufs[(first - 1) & 1]) : scratch;
+
+  for (int y = first; y < (first + rows); y++)
+  {
+    const uint8_t *line = png_write_pack_row(w, y, bufs[y & 1]);
+    uint8_t *dst = &w->filtered[(size_t)y * (size + 1)];
+    int best = 0;
+
+    // Filter with the minimum sum of absolute differences, as suggested
+    // by the PNG specification
+    if (w->adaptive)
+    {
+      uint32_t sums[5];
+
+      filter_kernel(line, prior, size, w->bpp, out, sums);
+
+      for (int f = 1; f < 5; f++)
+      {
+        if (sums[f] < sums[best])
+          best = f;
+      }
+    }
+
+    dst[0] = best;
+    memcpy(&dst[1], best ? out[best - 1] : line, size);
+    prior = line;
+  }
+
+  free(scratch);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void png_write_filter_task(void *arg)
+{
+  PNGWriteBand *band = (PNGWriteBand *)arg;
+
+  band->res = png_write_filter_rows(band->writer, band->first_row, band->rows);
+}
+
+//-----------------------------------------------------------------------------
+static void png_write_compress_task(void *arg)
+{
+  PNGWriteBand *band = (PNGWriteBand *)arg;
+  PNGWriter *w = band->writer;
+  size_t start = (size_t)band->first_row * (w->line_size + 1);
+  size_t size = (size_t)band->rows * (w->line_size + 1);
+  int dict_size = (start < DEFLATE_DICT_SIZE) ? (int)start : DEFLATE_DICT_SIZE;
+
+  // Each band is primed with the data before it, so the bands compress
+  // almost as well as a single stream
+  band->data  = deflate_compress(&w->filtered[start], size, dict_size, w->level,
+      band->last ? DEFLATE_FINAL : 0, &band->size);
+  band->adler = checksum_adler32(CHECKSUM_ADLER32_INIT, &w->filtered[start], size);
+  band->res   = (NULL != band->data);
+}
+
+//-----------------------------------------------------------------------------
+static bool png_write_bands(struct ThreadPool *pool, PNGWriteBand *bands, int count, ThreadPoolFunc func)
+{
+  ThreadPoolGroup group;
+  bool res = true;
+
+  if (!pool || 1 == count)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      func(&bands[i]);
+      res = res && bands[i].res;
+    }
+
+    return res;
+  }
+
+  thread_pool_group_init(&group);
+
+  for (int i = 0; i < count; i++)
+  {
+    if (!thread_pool_submit(pool, &group, func, &bands[i]))
+      func(&bands[i]);
+  }
+
+  thread_pool_wait(pool, &group);
+
+  for (int i = 0; i < count; i++)
+    res = res && bands[i].res;
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *png_put_word(uint8_t *ptr, uint32_t value)
+{
+  ptr[0] = value >> 24;
+  ptr[1] = value >> 16;
+  ptr[2] = value >> 8;
+  ptr[3] = value;
+
+  return ptr + 4;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *png_put_chunk(uint8_t *ptr, const char *type, const uint8_t *data, int size)
+{
+  uint8_t *start = ptr;
+
+  ptr = png_put_word(ptr, size);
+  memcpy(ptr, type, 4);
+  ptr += 4;
+
+  if (size)
+    memcpy(ptr, data, size);
+
+  ptr += size;
+
+  return png_put_word(ptr, checksum_crc32(CHECKSUM_CRC32_INIT, start + 4, size + 4));
+}
+
+//-----------------------------------------------------------------------------
+static void png_put_idat(PNGIdatWriter *idat, const uint8_t *data, size_t size)
+{
+  // The compressed stream is split into chunks of a fixed size as it is
+  // written, the parts of the stream don't have to line up with the chunks
+  while (size > 0)
+  {
+    int len;
+
+    if (0 == idat->left)
+    {
+      idat->left  = (idat->remaining < PNG_IDAT_SIZE) ? (int)idat->remaining : PNG_IDAT_SIZE;
+      idat->chunk = idat->ptr;
+      idat->ptr   = png_put_word(idat->ptr, idat->left);
+      memcpy(idat->ptr, "IDAT", 4);
+      idat->ptr  += 4;
+    }
+
+    len = (size < (size_t)idat->left) ? (int)size : idat->left;
+
+    memcpy(idat->ptr, data, len);
+    idat->ptr += len;
+    idat->left -= len;
+    idat->remaining -= len;
+    data += len;
+    size -= len;
+
+    if (0 == idat->left)
+      idat->ptr = png_put_word(idat->ptr, checksum_crc32(CHECKSUM_CRC32_INIT, idat->chunk + 4, idat->ptr - idat->chunk - 4));
+  }
+}
+
+//-----------------------------------------------------------------------------
+static int png_write_setup(PNGWriter *w, const PNGImage *image, int level)
+{
+  w->image = image;
+  w->level = level;
+  w->bgra  = false;
+  w->swap16 = false;
+
+  if (PNG_IMAGE_FORMAT_RGBA == image->format || PNG_IMAGE_FORMAT_BGRA == image->format)
+  {
+    w->type  = PNG_IMAGE_TYPE_RGBA;
+    w->depth = 8;
+    w->bgra  = (PNG_IMAGE_FORMAT_BGRA == image->format);
+  }
+  else if (PNG_IMAGE_FORMAT_RGB == image->format)
+  {
+    w->type  = PNG_IMAGE_TYPE_RGB;
+    w->depth = 8;
+  }
+  else if (PNG_IMAGE_FORMAT_NATIVE == image->format)
+  {
+    w->type  = image->type;
+    w->depth = image->depth;
+
+    if (w->type < 0 || w->type > PNG_IMAGE_TYPE_RGBA || 0 == png_write_channels[w->type] ||
+        (8 != w->depth && 16 != w->depth) || (PNG_IMAGE_TYPE_PALETTE == w->type && 16 == w->depth))
+      return PNG_IMAGE_IHDR_TYPE_ERROR;
+
+    if (PNG_IMAGE_TYPE_PALETTE == w->type && (image->palette_size < 1 || image->palette_size > 256))
+      return PNG_IMAGE_PALETTE_ERROR;
+
+    w->swap16 = (16 == w->depth);
+  }
+  else
+  {
+    // Premultiplied colors can't be restored exactly
+    return PNG_IMAGE_ERROR;
+  }
+
+  w->bpp = png_write_channels[w->type] * w->depth / 8;
+
+  if (image->width <= 0 || image->height <= 0 || !image->data ||
+      image->width > (INT32_MAX - 1) / w->bpp || image->stride < image->width * w->bpp)
+    return PNG_IMAGE_SIZE_ERROR;
+
+  w->line_size = image->width * w->bpp;
+
+  // The output may be a bit larger than the filtered rows
+  if ((uint64_t)image->height * (w->line_size + 1) > SIZE_MAX / 2)
+    return PNG_IMAGE_SIZE_ERROR;
+
+  // Palette indices are not a continuous tone, filtering only hurts them
+  w->adaptive = (level > 0 && PNG_IMAGE_TYPE_PALETTE != w->type);
+
+  return PNG_IMAGE_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+int png_image_write(const PNGImage *image, int level, struct ThreadPool *pool, uint8_t **data, size_t *size)
+{
+  static const uint8_t zlib_flags[DEFLATE_MAX_LEVEL + 1] =
+      { 0x01, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0xda, 0xda, 0xda };
+  uint8_t header[13], zlib[2], trailer[4], palette[256 * 3], alpha[256];
+  int rows_per_band, count, alpha_size = 0;
+  size_t filtered_size, zsize, chunks, total;
+  PNGWriteBand *bands;
+  PNGIdatWriter idat;
+  PNGWriter w;
+  uint32_t adler;
+  uint8_t *ptr;
+  int res;
+
+  if (level < 0 || level > DEFLATE_MAX_LEVEL)
+    return PNG_IMAGE_ERROR;
+
+  res = png_write_setup(&w, image, level);
+
+  if (PNG_IMAGE_SUCCESS != res)
+    return res;
+
+  filtered_size = (size_t)image->height * (w.line_size + 1);
+  rows_per_band = pool ? PNG_BAND_SIZE / (w.line_size + 1) + 1 : image->height;
+  count = (image->height + rows_per_band - 1) / rows_per_band;
+
+  w.filtered = (uint8_t *)malloc(filtered_size);
+  bands = (PNGWriteBand *)calloc(count, sizeof(PNGWriteBand));
+
+  if (!w.filtered || !bands)
+  {
+    free(w.filtered);
+    free(bands);
+    return PNG_IMAGE_MALLOC_ERROR;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    bands[i].writer    = &w;
+    bands[i].first_row = i * rows_per_band;
+    bands[i].rows      = (i == (count - 1)) ? image->height - i * rows_per_band : rows_per_band;
+    bands[i].last      = (i == (count - 1));
+  }
+
+  // Bands are compressed only after all rows are filtered, since each band
+  // uses the end of the previous one as a dictionary
+  res = PNG_IMAGE_MALLOC_ERROR;
+
+  if (png_write_bands(pool, bands, count, png_write_filter_task) &&
+      png_write_bands(pool, bands, count, png_write_compress_task))
+    res = PNG_IMAGE_SUCCESS;
+
+  zsize = sizeof(zlib) + sizeof(trailer);
+  adler = CHECKSUM_ADLER32_INIT;
+
+  for (int i = 0; i < count && PNG_IMAGE_SUCCESS == res; i++)
+  {
+    size_t band_size = (size_t)bands[i].rows * (w.line_size + 1);
+
+    zsize += bands[i].size;
+    adler = checksum_adler32_combine(adler, bands[i].adler, band_size);
+  }
+
+  if (PNG_IMAGE_SUCCESS == res)
+  {
+    if (PNG_IMAGE_TYPE_PALETTE == w.type)
+    {
+      for (int i = 0; i < image->palette_size; i++)
+      {
+        memcpy(&palette[i * 3], &image->palette[i * 4], 3);
+        alpha[i] = image->palette[i * 4 + 3];
+
+        if (alpha[i] != 255)
+          alpha_size = i + 1;
+      }
+    }
+    else if (PNG_IMAGE_FORMAT_NATIVE == image->format && image->transparency &&
+        (PNG_IMAGE_TYPE_GRAY == w.type || PNG_IMAGE_TYPE_RGB == w.type))
+    {
+      alpha_size = png_write_channels[w.type] * 2;
+
+      for (int i = 0; i < alpha_size / 2; i++)
+      {
+        alpha[i * 2 + 0] = image->transparent[i] >> 8;
+        alpha[i * 2 + 1] = image->transparent[i];
+      }
+    }
+
+    chunks = (zsize + PNG_IDAT_SIZE - 1) / PNG_IDAT_SIZE;
+    total = sizeof(png_signature) + (12 + sizeof(header)) + zsize + chunks * 12 + 12;
+
+    if (PNG_IMAGE_TYPE_PALETTE == w.type)
+      total += 12 + image->palette_size * 3;
+
+    if (alpha_size)
+      total += 12 + alpha_size;
+
+    *data = (uint8_t *)malloc(total);
+
+    if (!*data)
+      res = PNG_IMAGE_MALLOC_ERROR;
+  }
+
+  if (PNG_IMAGE_SUCCESS == res)
+  {
+    png_put_word(&header[0], image->width);
+    png_put_word(&header[4], image->height);
+    header[8]  = w.depth;
+    header[9]  = w.type;
+    header[10] = 0; // Compression
+    header[11] = 0; // Filter
+    header[12] = 0; // Interlace
+
+    zlib[0] = 0x78; // Deflate with 32K window
+    zlib[1] = zlib_flags[level];
+    png_put_word(trailer, adler);
+
+    ptr = *data;
+    memcpy(ptr, png_signature, sizeof(png_signature));
+    ptr = png_put_chunk(ptr + sizeof(png_signature), "IHDR", header, sizeof(header));
+
+    if (PNG_IMAGE_TYPE_PALETTE == w.type)
+      ptr = png_put_chunk(ptr, "PLTE", palette, image->palette_size * 3);
+
+    if (alpha_size)
+      ptr = png_put_chunk(ptr, "tRNS", alpha, alpha_size);
+
+    idat.ptr       = ptr;
+    idat.chunk     = NULL;
+    idat.left      = 0;
+    idat.remaining = zsize;
+
+    png_put_idat(&idat, zlib, sizeof(zlib));
+
+    for (int i = 0; i < count; i++)
+      png_put_idat(&idat, bands[i].data, bands[i].size);
+
+    png_put_idat(&idat, trailer, sizeof(trailer));
+
+    ptr = png_put_chunk(idat.ptr, "IEND", NULL, 0);
+    *size = ptr - *data;
+  }
+
+  for (int i = 0; i < count; i++)
+    free(bands[i].data);
+
+  free(bands);
+  free(w.filtered);
+
+  return res;
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "thread_pool.h"
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct ThreadPoolTask
+{
+  ThreadPoolFunc  func;
+  void            *arg;
+  ThreadPoolGroup *group;
+  struct ThreadPoolTask *prev;
+  struct ThreadPoolTask *next;
+} ThreadPoolTask;
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  ThreadPoolTask  *top;
+  ThreadPoolTask  *bottom;
+} ThreadPoolQueue;
+
+typedef struct
+{
+  ThreadPool      *pool;
+  int             index;
+  pthread_t       thread;
+} ThreadPoolWorker;
+
+struct ThreadPool
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  task_cond;
+  pthread_cond_t  done_cond;
+  // One queue per worker, the last one receives tasks from other threads
+  ThreadPoolQueue *queues;
+  ThreadPoolWorker *workers;
+  int             count;
+  int             started;
+  int             queued;
+  bool            stop;
+};
+
+/*- Variables ---------------------------------------------------------------*/
+static __thread ThreadPool *current_pool = NULL;
+static __thread int current_index = -1;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void queue_push_bottom(ThreadPoolQueue *queue, ThreadPoolTask *task)
+{
+  pthread_mutex_lock(&queue->mutex);
+
+  task->next = NULL;
+  task->prev = queue->bottom;
+
+  if (queue->bottom)
+    queue->bottom->next = task;
+  else
+    queue->top = task;
+
+  queue->bottom = task;
+
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+//-----------------------------------------------------------------------------
+static ThreadPoolTask *queue_pop_bottom(ThreadPoolQueue *queue)
+{
+  ThreadPoolTask *task;
+
+  pthread_mutex_lock(&queue->mutex);
+
+  task = queue->bottom;
+
+  if (task)
+  {
+    queue->bottom = task->prev;
+
+    if (queue->bottom)
+      queue->bottom->next = NULL;
+    else
+      queue->top = NULL;
+  }
+
+  pthread_mutex_unlock(&queue->mutex);
+
+  return task;
+}
+
+//-----------------------------------------------------------------------------
+static ThreadPoolTask *queue_pop_top(ThreadPoolQueue *queue)
+{
+  ThreadPoolTask *task;
+
+  pthread_mutex_lock(&queue->mutex);
+
+  task = queue->top;
+
+  if (task)
+  {
+    queue->top = task->next;
+
+    if (queue->top)
+      queue->top->prev = NULL;
+    else
+      queue->bottom = NULL;
+  }
+
+  pthread_mutex_unlock(&queue->mutex);
+
+  return task;
+}
+
+//-----------------------------------------------------------------------------
+static ThreadPoolTask *thread_pool_find(ThreadPool *pool)
+{
+  int self = (current_pool == pool) ? current_index : pool->count;
+  ThreadPoolTask *task = NULL;
+
+  // Workers take the most recent task from their own queue first, which
+  // keeps sub-tasks on the thread that created them. Otherwise the oldest
+  // task is stolen from the shared queue or from another worker.
+  if (self < pool->count)
+    task = queue_pop_bottom(&pool->queues[self]);
+
+  for (int i = 0; i <= pool->count && !task; i++)
+  {
+    int index = (self + 1 + i) % (pool->count + 1);
+
+    if (index != self || self == pool->count)
+      task = queue_pop_top(&pool->queues[index]);
+  }
+
+  if (task)
+  {
+    pthread_mutex_lock(&pool->mutex);
+    pool->queued--;
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  return task;
+}
+
+//-----------------------------------------------------------------------------
+static void thread_pool_run(ThreadPool *pool, ThreadPoolTask *task)
+{
+  task->func(task->arg);
+
+  pthread_mutex_lock(&pool->mutex);
+
+  task->group->pending--;
+
+  if (0 == task->group->pending)
+    pthread_cond_broadcast(&pool->done_cond);
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  free(task);
+}
+
+//-----------------------------------------------------------------------------
+static void *thread_pool_worker(void *arg)
+{
+  ThreadPoolWorker *worker = (ThreadPoolWorker *)arg;
+  ThreadPool *pool = worker->pool;
+
+  current_pool  = pool;
+  current_index = worker->index;
+
+  while (1)
+  {
+    ThreadPoolTask *task = thread_pool_find(pool);
+
+    if (task)
+    {
+      thread_pool_run(pool, task);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->stop)
+    {
+      pthread_mutex_unlock(&pool->mutex);
+      break;
+    }
+
+    if (0 == pool->queued)
+      pthread_cond_wait(&pool->task_cond, &pool->mutex);
+
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+ThreadPool *thread_pool_create(int threads)
+{
+  ThreadPool *pool;
+
+  if (threads < 1)
+    return NULL;
+
+  pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+
+  if (!pool)
+    return NULL;
+
+  pool->queues  = (ThreadPoolQueue *)calloc(threads + 1, sizeof(ThreadPoolQueue));
+  pool->workers = (ThreadPoolWorker *)calloc(threads, sizeof(ThreadPoolWorker));
+
+  if (!pool->queues || !pool->workers)
+  {
+    free(pool->queues);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->task_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  for (int i = 0; i <= threads; i++)
+    pthread_mutex_init(&pool->queues[i].mutex, NULL);
+
+  pool->count = threads;
+
+  for (int i = 0; i < threads; i++)
+  {
+    pool->workers[i].pool  = pool;
+    pool->workers[i].index = i;
+
+    if (0 != pthread_create(&pool->workers[i].thread, NULL, thread_pool_worker, &pool->workers[i]))
+      break;
+
+    pool->started++;
+  }
+
+  if (pool->started < threads)
+  {
+    thread_pool_destroy(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+//-----------------------------------------------------------------------------
+void thread_pool_destroy(ThreadPool *pool)
+{
+  assert(pool);
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->task_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 0; i < pool->started; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+
+  // Tasks that were never started are dropped
+  for (int i = 0; i <= pool->count; i++)
+  {
+    ThreadPoolTask *task;
+
+    while (NULL != (task = queue_pop_top(&pool->queues[i])))
+      free(task);
+
+    pthread_mutex_destroy(&pool->queues[i].mutex);
+  }
+
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->task_cond);
+  pthread_cond_destroy(&pool->done_cond);
+
+  free(pool->queues);
+  free(pool->workers);
+  free(pool);
+}
+
+//-----------------------------------------------------------------------------
+void thread_pool_group_init(ThreadPoolGroup *group)
+{
+  group->pending = 0;
+}
+
+//-----------------------------------------------------------------------------
+bool thread_pool_submit(ThreadPool *pool, ThreadPoolGroup *group, ThreadPoolFunc func, void *arg)
+{
+  ThreadPoolTask *task = (ThreadPoolTask *)malloc(sizeof(ThreadPoolTask));
+  int index = (current_pool == pool) ? current_index : pool->count;
+
+  if (!task)
+    return false;
+
+  task->func  = func;
+  task->arg   = arg;
+  task->group = group;
+
+  // Counters are updated before the task becomes visible, so it can't
+  // complete before it is accounted for
+  pthread_mutex_lock(&pool->mutex);
+  group->pending++;
+  pool->queued++;
+  pthread_mutex_unlock(&pool->mutex);
+
+  queue_push_bottom(&pool->queues[index], task);
+
+  pthread_cond_signal(&pool->task_cond);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+void thread_pool_wait(ThreadPool *pool, ThreadPoolGroup *group)
+{
+  pthread_mutex_lock(&pool->mutex);
+
+  // The waiting thread runs queued tasks instead of blocking, so tasks that
+  // wait for their own sub-tasks can't deadlock the pool
+  while (group->pending > 0)
+  {
+    ThreadPoolTask *task;
+
+    pthread_mutex_unlock(&pool->mutex);
+    task = thread_pool_find(pool);
+
+    if (task)
+      thread_pool_run(pool, task);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (!task && group->pending > 0)
+      pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2019, Alex Taradov <alex@taradov.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdbool.h>
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct ThreadPool ThreadPool;
+
+typedef void (*ThreadPoolFunc)(void *arg);
+
+// Tasks are submitted as a part of a group, so independent users of the same
+// pool can wait for their own tasks only
+typedef struct
+{
+  int      pending;
+} ThreadPoolGroup;
+
+/*- Prototypes --------------------------------------------------------------*/
+ThreadPool *thread_pool_create(int threads);
+void thread_pool_destroy(ThreadPool *pool);
+void thread_pool_group_init(ThreadPoolGroup *group);
+bool thread_pool_submit(ThreadPool *pool, ThreadPoolGroup *group, ThreadPoolFunc func, void *arg);
+void thread_pool_wait(ThreadPool *pool, ThreadPoolGroup *group);
+
+#endif // _THREAD_POOL_H_